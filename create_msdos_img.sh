@@ -13,6 +13,13 @@ start_sector=${1}
 end_sector=${2}
 count=$(($end_sector-($start_sector+1)+1))
 disk_image=${3}
+# the tools and boot code live next to this script, wherever it is run from
+script_dir=$(dirname "$0")
+# compressed disk images (ATZIMG01) and overlays (ATOIMG01) are written through img_zip, stored ones (ATDIMG01) through img_dedup
+img_zip=${IMG_ZIP:-$script_dir/tools/linux/img_zip/img_zip}
+img_dedup=${IMG_DEDUP:-$script_dir/tools/linux/img_dedup/img_dedup}
+# cluster size / reserved sectors / root entries for the expected file sizes (FAT_MIX, see fat_geom)
+fat_geom=${FAT_GEOM:-$script_dir/tools/linux/fat_geom/fat_geom}
 
 tmp_file=$(mktemp)
 # TODO: parameter ci chcem zmazat alebo ponechat MBR
@@ -23,12 +30,12 @@ dd if=/dev/zero of="$tmp_file" bs=512 count="$count" 2> /dev/null
 
 echo "Starting cfdisk..."
 #cfdisk "$tmp_file"
-LD_LIBRARY_PATH=cfdisk cfdisk "$tmp_file"
+LD_LIBRARY_PATH="$script_dir/cfdisk" cfdisk "$tmp_file"
 
 # TODO: MBR & whole part su rozdielne switche!
 echo
 echo "Writing bootstrap code into MBR..."
-dd if=bootstrap.bin of="$tmp_file" bs=512 count=1 conv=notrunc 2> /dev/null
+dd if="$script_dir/bootstrap.bin" of="$tmp_file" bs=512 count=1 conv=notrunc 2> /dev/null
 
 fdisk -c=dos -b 512 -t dos -o Start,Sectors,Type -l "$tmp_file" | grep FAT16 | while IFS=' ' read -r start sectors fstype
 do
@@ -40,9 +47,15 @@ do
 	dd if=/dev/zero of="$tmp_file" bs=512 seek="$start" count="$sectors" conv=notrunc 2> /dev/null
 	# block count is specified in KiB (1024)
 	# TODO: is -h always $start and not $start+previous_partition_size? is sectors per track == $start?
-	mkdosfs -a -g 64/34 -h "$start" --offset="$start" "$tmp_file" $(($sectors*512/1024)) > /dev/null
+	geom_opts=""
+	if [ -x "$fat_geom" ]
+	then
+	  geom_opts=$("$fat_geom" -o -h "$start" ${FAT_MIX:+-m "$FAT_MIX"} $(($sectors/2*2))) || geom_opts=""
+	  echo "FAT16 layout: $geom_opts"
+	fi
+	mkdosfs -a -g 64/34 -h "$start" $geom_opts --offset="$start" "$tmp_file" $(($sectors*512/1024)) > /dev/null
 	# WARNING: hardcoded offset (assumes 0xeb 0x3c 0x90 at $start)
-	dd if=bootloader.bin of="$tmp_file" bs=1 seek=$(($start*512+62)) conv=notrunc 2> /dev/null
+	dd if="$script_dir/bootloader.bin" of="$tmp_file" bs=1 seek=$(($start*512+62)) conv=notrunc 2> /dev/null
 done 
 
 echo
@@ -51,7 +64,16 @@ case $yn in
 	[Yy]* )
 	  # disable Atari root sector
 	  #dd if=/dev/zero   of="$disk_image" bs=512 seek=$(($start_sector+0)) count=1        conv=notrunc 2> /dev/null
-	  dd if="$tmp_file" of="$disk_image" bs=512 seek=$(($start_sector+1)) count="$count" conv=notrunc 2> /dev/null
+	  magic=$(head -c 8 "$disk_image")
+	  if [ "$magic" = "ATZIMG01" ] || [ "$magic" = "ATOIMG01" ]
+	  then
+	    "$img_zip" put "$disk_image" $(($start_sector+1)) "$tmp_file"
+	  elif [ "$magic" = "ATDIMG01" ]
+	  then
+	    "$img_dedup" put "$disk_image" $(($start_sector+1)) "$tmp_file"
+	  else
+	    dd if="$tmp_file" of="$disk_image" bs=512 seek=$(($start_sector+1)) count="$count" conv=notrunc 2> /dev/null
+	  fi
 	  ;;
 esac
 
@@ -16,6 +16,19 @@
 #define BUS_SCSI   8
 #define BUS_IDE    16
 #define GIB_SEC    (1024*1024*1024UL/MAXPHYSSECTSIZE)
+#define FAT_BATCH  32   // sectors per Lrwabs() when streaming FATs
+#define RANGES_MAX 8
+#define DMA_ALIGN  16   // 68030 cache line; also satisfies TT SCSI longword DMA
+#define SCAN_BATCH 128  // sectors per Lrwabs() during the surface scan
+#define BAD_MAX    64   // bad sectors reported/recorded per drive
+#define DEPTH_MAX  8    // directory levels searched for the owner of a bad cluster
+#define BSL_MAGIC  0xa5
+#define FAT16_MIN_CLUSTERS 4085     // fewer is FAT12
+#define FAT16_MAX_CLUSTERS 65524
+
+#ifndef MX_STRAM
+#define MX_STRAM   0
+#endif
 
 #define min(a,b) \
    ({ __typeof__ (a) _a = (a); \
@@ -23,6 +36,10 @@
      _a < _b ? _a : _b; })
 
 static int arg_skip_fat_check;
+static int arg_check_mirror;
+static int arg_mirror_source;
+static int arg_surface_scan;
+static int arg_update_bsl;
 
 static struct {
     int skipped;
@@ -36,18 +53,117 @@ static struct {
     uint32_t sector_end;
 } drives[DRIVES_MAX] = {};
 
-static PHYSSECT physsect, physsect2;
+static PHYSSECT* physsect;
+static PHYSSECT* physsect2;
+static PHYSSECT* fatbuf;
+static PHYSSECT* fatbuf2;
+static PHYSSECT* scanbuf;
+
+static uint32_t bad_sectors[BAD_MAX];
+static int num_bad;
+
+// volume of the last bad sector, its FAT cached across the sectors of a drive
+static struct {
+    uint16_t dev;
+    uint32_t start;
+    uint16_t ratio;         /* phys. sectors per log. sector */
+    uint8_t spc;
+    uint16_t dir;
+    uint32_t fat_sectors;   /* phys. sectors, as all of the below */
+    uint32_t fat_start;
+    uint32_t root_start;
+    uint32_t data_start;
+    uint32_t end;
+    uint32_t clusters;
+    PHYSSECT* fat;
+} vol;
 
 static int num_warnings;
 
+static int32_t read_sectors(uint8_t* buffer, uint16_t dev, uint32_t sector, uint16_t count)
+{
+    return Lrwabs((0<<RW_WRITE) | (1<<RW_NOMEDIACH) | (0<<RW_NORETRIES) | (1<<RW_NOTRANSLATE), buffer, count, sector, dev);
+}
+
+static int32_t write_sectors(uint8_t* buffer, uint16_t dev, uint32_t sector, uint16_t count)
+{
+    return Lrwabs((1<<RW_WRITE) | (1<<RW_NOMEDIACH) | (0<<RW_NORETRIES) | (1<<RW_NOTRANSLATE), buffer, count, sector, dev);
+}
+
 static int32_t read_sector(uint8_t* buffer, uint16_t dev, uint32_t sector)
 {
-    return Lrwabs((0<<RW_WRITE) | (1<<RW_NOMEDIACH) | (0<<RW_NORETRIES) | (1<<RW_NOTRANSLATE), buffer, 1, sector, dev);
+    return read_sectors(buffer, dev, sector, 1);
 }
 
 static int32_t write_sector(uint8_t* buffer, uint16_t dev, uint32_t sector)
 {
-    return Lrwabs((1<<RW_WRITE) | (1<<RW_NOMEDIACH) | (0<<RW_NORETRIES) | (1<<RW_NOTRANSLATE), buffer, 1, sector, dev);
+    return write_sectors(buffer, dev, sector, 1);
+}
+
+
+static uint32_t get_phystop(void)
+{
+  int32_t oldstack = Super(0L);
+  uint32_t p = *phystop;
+  Super ((void *)oldstack);
+
+  return p;
+}
+
+// sector buffers must live in ST-RAM, otherwise the driver bounce-copies every transfer
+static PHYSSECT* alloc_dma_buffer(size_t sectors)
+{
+    size_t size = sectors * sizeof(PHYSSECT) + DMA_ALIGN + sizeof(void*);
+
+    // Mxalloc() is not available on TOS 1.x (-> EINVFN) but there all RAM is ST-RAM anyway
+    void* raw = (void*)Mxalloc(size, MX_STRAM);
+    if ((int32_t)raw <= 0)
+        raw = (void*)Malloc(size);
+    if ((int32_t)raw <= 0)
+        return NULL;
+
+    uintptr_t aligned = ((uintptr_t)raw + sizeof(void*) + DMA_ALIGN - 1) & ~(uintptr_t)(DMA_ALIGN - 1);
+    ((void**)aligned)[-1] = raw;
+
+    return (PHYSSECT*)aligned;
+}
+
+static void free_dma_buffer(PHYSSECT* buffer)
+{
+    if (buffer)
+        Mfree(((void**)buffer)[-1]);
+}
+
+static int is_dma_buffer(const PHYSSECT* buffer, size_t sectors)
+{
+    return (uintptr_t)buffer + sectors * sizeof(PHYSSECT) <= get_phystop();
+}
+
+static void alloc_sector_buffers(void)
+{
+    physsect  = alloc_dma_buffer(1);
+    physsect2 = alloc_dma_buffer(1);
+
+    if (arg_check_mirror) {
+        fatbuf  = alloc_dma_buffer(FAT_BATCH);
+        fatbuf2 = alloc_dma_buffer(FAT_BATCH);
+    }
+
+    if (arg_surface_scan)
+        scanbuf = alloc_dma_buffer(SCAN_BATCH);
+
+    if (!physsect || !physsect2 || (arg_check_mirror && (!fatbuf || !fatbuf2)) || (arg_surface_scan && !scanbuf)) {
+        fprintf(stderr, "Not enough memory for sector buffers\r\n");
+        fprintf(stderr, "Press Return to exit.\r\n");
+        getchar();
+        exit(EXIT_FAILURE);
+    }
+
+    if (is_dma_buffer(physsect, 1) && is_dma_buffer(physsect2, 1))
+        printf("Sector buffers: ST-RAM (direct DMA)\r\n");
+    else
+        printf("Sector buffers: Alt-RAM (driver bounce buffer)\r\n");
+    printf("\r\n");
 }
 
 
@@ -57,6 +173,10 @@ static void print_help(int exit_code)
     fprintf(stderr, "<option> is one of:\r\n");
     fprintf(stderr, "  -h: this help\r\n");
     fprintf(stderr, "  -s: skip FAT16 check\r\n");
+    fprintf(stderr, "  -m: check FAT copies\r\n");
+    fprintf(stderr, "  -r1/-r2: repair FAT copies from FAT #1/#2\r\n");
+    fprintf(stderr, "  -v: surface scan (read-verify)\r\n");
+    fprintf(stderr, "  -b: surface scan, update bad sector list\r\n");
     fprintf(stderr, "<drv letter> is one: of X, X: or X:\\\r\n\r\n");
     fprintf(stderr,
         "This program helps with preparing and\r\n"
@@ -86,6 +206,23 @@ static void parse_args(int argc, const char* argv[])
             continue;
         }
 
+        if (strcmp(argv[i], "-m") == 0) {
+            arg_check_mirror = 1;
+            continue;
+        }
+
+        if (strcmp(argv[i], "-v") == 0 || strcmp(argv[i], "-b") == 0) {
+            arg_surface_scan = 1;
+            arg_update_bsl |= argv[i][1] == 'b';
+            continue;
+        }
+
+        if (strcmp(argv[i], "-r1") == 0 || strcmp(argv[i], "-r2") == 0) {
+            arg_check_mirror = 1;
+            arg_mirror_source = argv[i][2] - '0';
+            continue;
+        }
+
         switch (strlen(argv[i])) {
             case 3:
                 if (argv[i][2] != '\\')
@@ -216,10 +353,10 @@ static int analyze_mbr(const MBR* mbr, uint32_t prim_start, uint32_t ext_start,
             else
                 pe_start += ext_start;
 
-            if (read_sector(physsect2.sect, dev, pe_start) != 0)
+            if (read_sector(physsect2->sect, dev, pe_start) != 0)
                 break;
 
-            found = analyze_mbr(&physsect2.mbr, pe_start, ext_start, dev, drive);
+            found = analyze_mbr(&physsect2->mbr, pe_start, ext_start, dev, drive);
             if (found == -1)
                 return found;
             else if (found)
@@ -271,10 +408,10 @@ static int analyze_ahdi(const struct rootsector* rs, uint16_t dev, int drive)
         pi_st = ext_st = pi->st;
 
         while ((pi->flg & 0x01) && memcmp(pi->id, "XGM", 3) == 0) {
-            if (read_sector(physsect2.sect, dev, pi_st) != 0)
+            if (read_sector(physsect2->sect, dev, pi_st) != 0)
                 break;
 
-            struct partition_info* ext_pi = &physsect2.rs.part[0];
+            struct partition_info* ext_pi = &physsect2->rs.part[0];
             ext_pi->st += pi_st;
 
             if (analyze_ahdi_partition(ext_pi, dev, drive)) {
@@ -282,7 +419,7 @@ static int analyze_ahdi(const struct rootsector* rs, uint16_t dev, int drive)
                 break;
             }
 
-            pi = &physsect2.rs.part[1];
+            pi = &physsect2->rs.part[1];
             pi_st = ext_st + pi->st;
         }
     }
@@ -308,7 +445,7 @@ static int read_partition_table(void)
             int dev = 2 + drives[i].bus + drives[i].pun;
 
             if (drives[i].bus != current_bus || drives[i].pun != current_pun) {
-                if (read_sector(physsect.sect, dev, 0) == 0) {
+                if (read_sector(physsect->sect, dev, 0) == 0) {
                     current_bus = drives[i].bus;
                     current_pun = drives[i].pun;
                 } else {
@@ -319,10 +456,10 @@ static int read_partition_table(void)
                 }
             }
 
-            if (physsect.mbr.bootsig == 0x55aa)
-                found |= (analyze_mbr(&physsect.mbr, 0, 0, dev, i) == 1);
+            if (physsect->mbr.bootsig == 0x55aa)
+                found |= (analyze_mbr(&physsect->mbr, 0, 0, dev, i) == 1);
             else
-                found |= (analyze_ahdi(&physsect.rs, dev, i) == 1);
+                found |= (analyze_ahdi(&physsect->rs, dev, i) == 1);
         }
     }
 
@@ -330,9 +467,10 @@ static int read_partition_table(void)
 }
 
 
-static void get_mib(uint32_t size, uint32_t* int_num, uint32_t* frac_num)
+// size in bytes, 64-bit: partitions > 4 GiB overflow 32-bit byte math
+static void get_mib(uint64_t size, uint32_t* int_num, uint32_t* frac_num)
 {
-    const unsigned int num = size;
+    const uint64_t num = size;
     const unsigned int den = 1024 * 1024;
     const unsigned int precision = 2;
     const unsigned int base = 10;
@@ -389,7 +527,7 @@ static void print_summary(void)
                     printf(" %s", drives[i].type);
 
                 uint32_t int_num, frac_num;
-                get_mib(MAXPHYSSECTSIZE * drives[i].size, &int_num, &frac_num);
+                get_mib((uint64_t)MAXPHYSSECTSIZE * drives[i].size, &int_num, &frac_num);
                 printf("  %03u.%02u", int_num, frac_num);
                 printf(" %07u-%07u", drives[i].sector_start, drives[i].sector_end);
             } else {
@@ -455,28 +593,154 @@ static int shrink_volume(struct fat16_bs* fat16, uint32_t additional_log_sectors
     return shrink_confirmation == 'y';
 }
 
-static void fix_image_mbr(PHYSSECT sect, uint32_t offset, uint32_t prim_start, uint32_t ext_start, uint16_t dev, int drive)
+static int repair_fat(int src, int dst)
+{
+    printf("Copy FAT #%d over FAT #%d? ", src, dst);
+    char repair_confirmation = 'n';
+    scanf("%c", &repair_confirmation);
+    printf("\r\n");
+    repair_confirmation = tolower(repair_confirmation);
+
+    return repair_confirmation == 'y';
+}
+
+// Streams FAT #src and FAT #dst (1-based) in FAT_BATCH sector reads and compares them
+// longword-wise. With repair set, the differing sectors of each batch are rewritten
+// from src in a single write. Returns the number of differing entries, -1 on a read
+// or write error.
+static int32_t compare_fats(uint16_t dev, uint32_t fat_start, uint32_t fat_sectors, int src, int dst, int repair)
+{
+    uint32_t src_start = fat_start + (src - 1) * fat_sectors;
+    uint32_t dst_start = fat_start + (dst - 1) * fat_sectors;
+    uint32_t differing = 0;
+    uint32_t range_first = 0;
+    int in_range = 0;
+    int printed = 0;
+    int failed = 0;
+
+    for (uint32_t batch = 0; batch < fat_sectors; batch += FAT_BATCH) {
+        uint16_t count = min(fat_sectors - batch, (uint32_t)FAT_BATCH);
+
+        if (read_sectors(fatbuf->sect, dev, src_start + batch, count) != 0
+            || read_sectors(fatbuf2->sect, dev, dst_start + batch, count) != 0) {
+            fprintf(stderr, "->FAT read error (sector %u)\r\n", src_start + batch);
+            return -1;
+        }
+
+        const uint32_t* a = (const uint32_t*)fatbuf->sect;
+        const uint32_t* b = (const uint32_t*)fatbuf2->sect;
+        const uint32_t longs = count * (MAXPHYSSECTSIZE / sizeof(uint32_t));
+        int32_t first_sector = -1;
+        int32_t last_sector = -1;
+
+        for (uint32_t i = 0; i < longs; ++i) {
+            uint32_t entry = (batch * MAXPHYSSECTSIZE) / 2 + i * 2;
+
+            if (a[i] == b[i]) {
+                if (in_range) {
+                    if (printed++ < RANGES_MAX)
+                        printf("->FAT entries %u-%u differ\r\n", range_first, entry - 1);
+                    in_range = 0;
+                }
+                continue;
+            }
+
+            // two entries per longword
+            for (int e = 0; e < 2; ++e) {
+                const uint16_t* a16 = (const uint16_t*)&a[i];
+                const uint16_t* b16 = (const uint16_t*)&b[i];
+                if (a16[e] != b16[e]) {
+                    differing++;
+                    if (!in_range) {
+                        range_first = entry + e;
+                        in_range = 1;
+                    }
+                } else if (in_range) {
+                    if (printed++ < RANGES_MAX)
+                        printf("->FAT entries %u-%u differ\r\n", range_first, entry + e - 1);
+                    in_range = 0;
+                }
+            }
+
+            if (first_sector < 0)
+                first_sector = (i * sizeof(uint32_t)) / MAXPHYSSECTSIZE;
+            last_sector = (i * sizeof(uint32_t)) / MAXPHYSSECTSIZE;
+        }
+
+        if (repair && first_sector >= 0
+            && write_sectors(fatbuf->sect + first_sector * MAXPHYSSECTSIZE, dev,
+                             dst_start + batch + first_sector, last_sector - first_sector + 1) != 0) {
+            fprintf(stderr, "->FAT write error (sector %u)\r\n", dst_start + batch + first_sector);
+            failed = 1;
+        }
+    }
+
+    if (in_range && printed++ < RANGES_MAX)
+        printf("->FAT entries %u-%u differ\r\n", range_first, fat_sectors * MAXPHYSSECTSIZE / 2 - 1);
+    if (printed > RANGES_MAX)
+        printf("->...\r\n");
+
+    return failed ? -1 : (int32_t)differing;
+}
+
+static void check_fat_mirror(uint16_t dev, uint32_t fat_start, uint32_t fat_sectors, int fats)
+{
+    int ref = arg_mirror_source ? arg_mirror_source : 1;
+    if (ref > fats) {
+        fprintf(stderr, "->Skipping FAT repair (no FAT #%d)\r\n", ref);
+        return;
+    }
+
+    for (int i = 1; i <= fats; ++i) {
+        if (i == ref)
+            continue;
+
+        int32_t differing = compare_fats(dev, fat_start, fat_sectors, ref, i, 0);
+        if (differing < 0) {
+            num_warnings++;
+            continue;
+        }
+        if (differing == 0) {
+            printf("FAT #%d and FAT #%d are identical.\r\n", ref, i);
+            continue;
+        }
+
+        printf("->%d FAT entries differ (FAT #%d vs FAT #%d)\r\n", differing, ref, i);
+        num_warnings++;
+
+        if (arg_mirror_source && repair_fat(ref, i)) {
+            if (compare_fats(dev, fat_start, fat_sectors, ref, i, 1) >= 0)
+                printf("FAT #%d updated.\r\n", i);
+            else {
+                fprintf(stderr, "->FAT #%d not updated\r\n", i);
+                num_warnings++;
+            }
+        }
+    }
+}
+
+static void fix_image_mbr(PHYSSECT* sect, uint32_t offset, uint32_t prim_start, uint32_t ext_start, uint16_t dev, int drive)
 {
     // sanity check
-    if (sect.mbr.bootsig != 0x55aa) {
+    if (sect->mbr.bootsig != 0x55aa) {
         fprintf(stderr, "Skipping drive (not a valid MBR)\r\n");
         return;
     }
 
     for (int i = 0; i < 4; ++i) {
-        PARTENTRY* pe = &sect.mbr.entry[i];
+        PARTENTRY* pe = &sect->mbr.entry[i];
         uint32_t pe_start = pe->start;
         swpl(pe_start);
         uint32_t pe_size = pe->size;
         swpl(pe_size);
 
         if (pe_size > 0) {
-            if (read_sector(physsect2.sect, dev, pe_start + offset) != 0) {
+            if (read_sector(physsect2->sect, dev, pe_start + offset) != 0) {
                 continue;
             }
 
             uint32_t int_num, frac_num;
-            get_mib(MAXPHYSSECTSIZE * pe_size, &int_num, &frac_num);
+            get_mib((uint64_t)MAXPHYSSECTSIZE * pe_size, &int_num, &frac_num);
             printf("           %02x   %03u.%02u %07u-%07u\r\n", pe->type, int_num, frac_num,
                 pe_start + offset, pe_start + pe_size + offset - 1);
 
@@ -490,14 +754,15 @@ static void fix_image_mbr(PHYSSECT sect, uint32_t offset, uint32_t prim_start, u
                 continue;
             }
 
-            uint32_t additional_bytes = 0;
+            uint64_t additional_bytes = 0;
 
             int32_t additional_phys_sectors = (pe_start + pe_size + offset) - min((drives[drive].sector_start + drives[drive].size), GIB_SEC);
             if (additional_phys_sectors > 0) {
-                additional_bytes = additional_phys_sectors * MAXPHYSSECTSIZE;
-                printf("->%u sectors (%u bytes) more!\r\n", additional_phys_sectors, additional_bytes);
+                additional_bytes = (uint64_t)additional_phys_sectors * MAXPHYSSECTSIZE;
+                get_mib(additional_bytes, &int_num, &frac_num);
+                printf("->%u sectors (%03u.%02u MiB) more!\r\n", additional_phys_sectors, int_num, frac_num);
 
-                if (shrink_pte(pe, i, additional_phys_sectors) && write_sector(sect.sect, dev, offset) == 0)
+                if (shrink_pte(pe, i, additional_phys_sectors) && write_sector(sect->sect, dev, offset) == 0)
                     printf("MBR (sector %u) updated.\r\n", offset);
             }
 
@@ -506,7 +771,7 @@ static void fix_image_mbr(PHYSSECT sect, uint32_t offset, uint32_t prim_start, u
                 continue;
             }
 
-            struct fat16_bs* fat16 = (struct fat16_bs*)physsect2.sect;
+            struct fat16_bs* fat16 = (struct fat16_bs*)physsect2->sect;
             uint16_t bps = *(uint16_t*)fat16->bps;
             swpw(bps);  /* bytes per sector */
             uint16_t res = *(uint16_t*)fat16->res;
@@ -520,22 +785,25 @@ static void fix_image_mbr(PHYSSECT sect, uint32_t offset, uint32_t prim_start, u
             swpw(spf);  /* sectors per FAT */
 
             char str[8+1] = {};
-            memcpy(str, physsect2.sect+3, 8);
+            memcpy(str, physsect2->sect+3, 8);
             printf("%s/", str);
 
             memcpy(str, fat16->fstype, sizeof(fat16->fstype)-1);
             str[7] = '\0';
-            uint32_t volume_size = sec * bps;
+            uint64_t volume_size = (uint64_t)sec * bps;
             get_mib(volume_size, &int_num, &frac_num);
             printf("%s%03u.%02u %07u-%07u\r\n", str, int_num, frac_num,
-                pe_start + offset, pe_start + (volume_size/MAXPHYSSECTSIZE) + offset - 1);
+                pe_start + offset, pe_start + (uint32_t)(volume_size/MAXPHYSSECTSIZE) + offset - 1);
 
-            uint32_t additional_log_sectors = additional_bytes / bps;
+            if (arg_check_mirror && fat > 1)
+                check_fat_mirror(dev, pe_start + offset + res * (bps / MAXPHYSSECTSIZE), spf * (bps / MAXPHYSSECTSIZE), fat);
+
+            uint32_t additional_log_sectors = (uint32_t)(additional_bytes / bps);
             if (additional_bytes % bps != 0)
                 additional_log_sectors++;
 
-            if (MAXPHYSSECTSIZE * pe_size < sec * bps) {
-                memcpy(str, physsect2.sect+3, 8);
+            if ((uint64_t)MAXPHYSSECTSIZE * pe_size < volume_size) {
+                memcpy(str, physsect2->sect+3, 8);
                 str[8] = '\0';
                 fprintf(stderr, "->Skipping \"%s\" (FAT16>MBR's PTE)\r\n", str);
                 continue;
@@ -549,7 +817,7 @@ static void fix_image_mbr(PHYSSECT sect, uint32_t offset, uint32_t prim_start, u
 
             if (additional_log_sectors > 0
                 && shrink_volume(fat16, additional_log_sectors)
-                && write_sector(physsect2.sect, dev, pe_start + offset) == 0)
+                && write_sector(physsect2->sect, dev, pe_start + offset) == 0)
                 printf("Volume (sector %u) updated.\r\n", pe_start + offset);
 
             printf("\r\n");
@@ -561,12 +829,400 @@ static void fix_image_mbr(PHYSSECT sect, uint32_t offset, uint32_t prim_start, u
             else
                 pe_start += ext_start;
 
-            if (read_sector(physsect2.sect, dev, pe_start + offset) != 0)
+            // each EBR level keeps its own sector, physsect2 is reused for the boot sectors
+            PHYSSECT* ebr = alloc_dma_buffer(1);
+            if (!ebr || read_sector(ebr->sect, dev, pe_start + offset) != 0) {
+                free_dma_buffer(ebr);
+                break;
+            }
+
+            fix_image_mbr(ebr, offset, pe_start, ext_start, dev, drive);
+            free_dma_buffer(ebr);
+        }
+    }
+}
+
+static void scan_range(uint16_t dev, uint32_t sector, uint16_t count)
+{
+    if (read_sectors(scanbuf->sect, dev, sector, count) == 0)
+        return;
+
+    if (count == 1) {
+        if (num_bad < BAD_MAX)
+            bad_sectors[num_bad] = sector;
+        num_bad++;
+        return;
+    }
+
+    // bisect down to the failing sector(s), the good halves cost one read each
+    scan_range(dev, sector, count / 2);
+    scan_range(dev, sector + count / 2, count - count / 2);
+}
+
+static uint16_t get_le16(const UBYTE* p)
+{
+    return p[0] | (p[1] << 8);
+}
+
+static uint32_t get_le32(const UBYTE* p)
+{
+    return p[0] | (p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+// Returns the boot sector of the image volume containing sector, 0 if there is none.
+// Unlike the partition entries of a primary MBR, those of an EBR are relative to the EBR.
+static uint32_t find_image_volume(uint16_t dev, uint32_t offset, uint32_t sector)
+{
+    uint32_t ebr_start = 0;
+    uint32_t ext_start = 0;
+
+    for (int level = 0; level < DRIVES_MAX * 4; ++level) {
+        if (read_sector(physsect2->sect, dev, offset + ebr_start) != 0 || physsect2->mbr.bootsig != 0x55aa)
+            return 0;
+
+        uint32_t next = 0;
+        for (int i = 0; i < 4; ++i) {
+            const PARTENTRY* pe = &physsect2->mbr.entry[i];
+            uint32_t pe_start = get_le32((const UBYTE*)&pe->start);
+            uint32_t pe_size = get_le32((const UBYTE*)&pe->size);
+
+            if (pe->type == 0x05 || pe->type == 0x0f)
+                next = ext_start + pe_start;
+            else if (pe_size > 0
+                     && sector >= offset + ebr_start + pe_start
+                     && sector < offset + ebr_start + pe_start + pe_size)
+                return offset + ebr_start + pe_start;
+        }
+
+        if (next == 0)
+            return 0;
+        if (ext_start == 0)
+            ext_start = next;
+        ebr_start = next;
+    }
+
+    return 0;
+}
+
+// loads the BPB and the first readable FAT of the volume whose boot sector is at start,
+// -2 if it isn't FAT16 (GEMDOS uses FAT12 for small volumes)
+static int load_volume(uint16_t dev, uint32_t start)
+{
+    if (vol.fat && vol.dev == dev && vol.start == start)
+        return 0;
+
+    free_dma_buffer(vol.fat);
+    vol.fat = NULL;
+
+    if (read_sector(physsect2->sect, dev, start) != 0)
+        return -1;
+
+    const struct fat16_bs* fat16 = (const struct fat16_bs*)physsect2->sect;
+    uint16_t bps = get_le16(fat16->bps);
+    uint16_t res = get_le16(fat16->res);
+    uint16_t dir = get_le16(fat16->dir);
+    uint32_t sec = get_le16(fat16->sec) ? get_le16(fat16->sec) : get_le32(fat16->sec2);
+    uint16_t spf = get_le16(fat16->spf);
+
+    if (bps < MAXPHYSSECTSIZE || bps % MAXPHYSSECTSIZE != 0 || fat16->spc == 0 || fat16->fat == 0 || spf == 0)
+        return -1;
+
+    vol.dev = dev;
+    vol.start = start;
+    vol.ratio = bps / MAXPHYSSECTSIZE;
+    vol.spc = fat16->spc;
+    vol.dir = dir;
+    vol.fat_sectors = spf * vol.ratio;
+    vol.fat_start = start + res * vol.ratio;
+    vol.root_start = vol.fat_start + fat16->fat * vol.fat_sectors;
+    // the root directory occupies whole logical sectors
+    vol.data_start = vol.root_start + (dir * 32 + bps - 1) / bps * vol.ratio;
+    vol.end = start + sec * vol.ratio;
+    if (vol.end <= vol.data_start)
+        return -1;
+    vol.clusters = (vol.end - vol.data_start) / (vol.spc * vol.ratio);
+    if (vol.clusters < FAT16_MIN_CLUSTERS || vol.clusters > FAT16_MAX_CLUSTERS)
+        return -2;
+    vol.clusters = min(vol.clusters, vol.fat_sectors * MAXPHYSSECTSIZE / 2 - 2);
+
+    // a bad sector may well be in FAT #1, fall back to the other copies
+    vol.fat = alloc_dma_buffer(vol.fat_sectors);
+    for (int i = 0; vol.fat && i < fat16->fat; ++i) {
+        if (read_sectors(vol.fat->sect, dev, vol.fat_start + i * vol.fat_sectors, vol.fat_sectors) == 0)
+            return 0;
+    }
+
+    free_dma_buffer(vol.fat);
+    vol.fat = NULL;
+    return -1;
+}
+
+static int valid_cluster(uint16_t cluster)
+{
+    return cluster >= 2 && cluster < vol.clusters + 2;
+}
+
+// clusters past the loaded FAT end the chain
+static uint16_t next_cluster(uint16_t cluster)
+{
+    return valid_cluster(cluster) ? get_le16(vol.fat->sect + cluster * 2) : 0xffff;
+}
+
+static int chain_contains(uint16_t first, uint16_t cluster)
+{
+    for (uint32_t n = 0; valid_cluster(first) && n < vol.clusters; ++n) {
+        if (first == cluster)
+            return 1;
+        first = next_cluster(first);
+    }
+
+    return 0;
+}
+
+// n-th physical sector of a directory (first_cluster 0: root), 0 past its end
+static uint32_t dir_sector(uint16_t first_cluster, uint32_t n)
+{
+    if (first_cluster == 0)
+        return n < vol.data_start - vol.root_start ? vol.root_start + n : 0;
+
+    uint32_t cluster_sectors = vol.spc * vol.ratio;
+    uint16_t cluster = first_cluster;
+    for (uint32_t i = n / cluster_sectors; i > 0 && valid_cluster(cluster); --i)
+        cluster = next_cluster(cluster);
+
+    if (!valid_cluster(cluster))
+        return 0;
+
+    return vol.data_start + (cluster - 2) * cluster_sectors + n % cluster_sectors;
+}
+
+// Depth-first search for the entry whose cluster chain contains cluster,
+// its path is appended to path. Every level reads into its own sector buffer.
+static int find_owner(uint16_t dev, uint16_t first_cluster, uint16_t cluster, char* path, int depth)
+{
+    PHYSSECT* sect = alloc_dma_buffer(1);
+    if (!sect)
+        return 0;
+
+    int found = 0;
+    int end = 0;
+    size_t len = strlen(path);
+    uint32_t s;
+
+    for (uint32_t n = 0; !found && !end && (s = dir_sector(first_cluster, n)) != 0; ++n) {
+        if (read_sector(sect->sect, dev, s) != 0)
+            break;
+
+        for (int i = 0; i < MAXPHYSSECTSIZE / 32 && !found; ++i) {
+            const UBYTE* e = sect->sect + i * 32;
+            UBYTE attr = e[11];
+
+            if (e[0] == 0x00) {
+                end = 1;
                 break;
+            }
+            if (e[0] == 0xe5 || e[0] == '.' || (attr & 0x08))   // deleted, dot entries, label and LFN
+                continue;
+
+            char* p = path + len;
+            *p++ = '\\';
+            for (int j = 0; j < 8 && e[j] != ' '; ++j)
+                *p++ = e[j];
+            if (e[8] != ' ') {
+                *p++ = '.';
+                for (int j = 8; j < 11 && e[j] != ' '; ++j)
+                    *p++ = e[j];
+            }
+            *p = '\0';
+
+            uint16_t first = get_le16(e + 26);
+            if (chain_contains(first, cluster))
+                found = 1;
+            else if ((attr & 0x10) && depth < DEPTH_MAX && valid_cluster(first))
+                found = find_owner(dev, first, cluster, path, depth + 1);
+
+            if (!found)
+                path[len] = '\0';
+        }
+    }
+
+    free_dma_buffer(sect);
+    return found;
+}
+
+static void report_bad_sector(uint16_t dev, int drive, uint32_t sector)
+{
+    printf("->Bad sector %07u: ", sector);
+
+    uint32_t start = drives[drive].sector_start;
+    if (read_sector(physsect->sect, dev, start + 1) == 0 && physsect->mbr.bootsig == 0x55aa)
+        start = find_image_volume(dev, start + 1, sector);
 
-            fix_image_mbr(physsect2, offset, pe_start, ext_start, dev, drive);
+    int loaded = start != 0 ? load_volume(dev, start) : -1;
+    if (loaded == -2) {
+        printf("not a FAT16 volume\r\n");
+        return;
+    }
+    if (loaded != 0 || sector >= vol.end) {
+        printf("outside of any volume\r\n");
+        return;
+    }
+
+    if (sector < vol.fat_start) {
+        printf("boot sector\r\n");
+    } else if (sector < vol.root_start) {
+        printf("FAT #%u\r\n", (sector - vol.fat_start) / vol.fat_sectors + 1);
+    } else if (sector < vol.data_start) {
+        printf("root directory\r\n");
+    } else {
+        uint16_t cluster = (sector - vol.data_start) / (vol.spc * vol.ratio) + 2;
+        uint16_t next = next_cluster(cluster);
+        char path[(DEPTH_MAX + 2) * 13 + 1] = {};
+
+        printf("cluster %u, ", cluster);
+        if (!valid_cluster(cluster))
+            printf("past the last cluster\r\n");
+        else if (next == 0x0000)
+            printf("free\r\n");
+        else if (next == 0xfff7)
+            printf("already marked bad\r\n");
+        else if (find_owner(dev, 0, cluster, path, 0))
+            printf("%s\r\n", path);
+        else
+            printf("lost chain\r\n");
+    }
+}
+
+static int record_bsl(int count)
+{
+    printf("Add %d sectors to bad sector list? ", count);
+    char record_confirmation = 'n';
+    scanf("%c", &record_confirmation);
+    printf("\r\n");
+    record_confirmation = tolower(record_confirmation);
+
+    return record_confirmation == 'y';
+}
+
+// The AHDI bad sector list consists of 3-byte big-endian entries. The first two
+// are reserved: bytes 0-2 count the vendor entries, bytes 3-4 the user entries and
+// byte 5 makes all bytes of the list add up to BSL_MAGIC. User entries follow the
+// vendor ones.
+static void record_bad_sectors(uint16_t dev)
+{
+    if (read_sector(physsect->sect, dev, 0) != 0 || physsect->mbr.bootsig == 0x55aa) {
+        fprintf(stderr, "->Not recorded (no AHDI root sector)\r\n");
+        return;
+    }
+
+    uint32_t bsl_st = physsect->rs.bsl_st;
+    uint32_t bsl_cnt = physsect->rs.bsl_cnt;
+    if (bsl_st == 0 || bsl_cnt == 0 || bsl_cnt > 0xffff) {
+        fprintf(stderr, "->Not recorded (no bad sector list)\r\n");
+        return;
+    }
+
+    PHYSSECT* bsl = alloc_dma_buffer(bsl_cnt);
+    if (!bsl || read_sectors(bsl->sect, dev, bsl_st, bsl_cnt) != 0) {
+        fprintf(stderr, "->Not recorded (bad sector list read error)\r\n");
+        free_dma_buffer(bsl);
+        return;
+    }
+
+    UBYTE* p = bsl->sect;
+    uint32_t size = bsl_cnt * MAXPHYSSECTSIZE;
+    uint32_t capacity = size / 3 - 2;
+    uint32_t vendor = ((uint32_t)p[0] << 16) | (p[1] << 8) | p[2];
+    uint32_t user = (p[3] << 8) | p[4];
+
+    UBYTE sum = 0;
+    for (uint32_t i = 0; i < size; ++i)
+        sum += p[i];
+
+    if (sum != BSL_MAGIC || vendor + user > capacity) {
+        fprintf(stderr, "->Not recorded (bad sector list checksum)\r\n");
+        free_dma_buffer(bsl);
+        return;
+    }
+
+    int added = 0;
+    for (int i = 0; i < min(num_bad, BAD_MAX); ++i) {
+        uint32_t sector = bad_sectors[i];
+        int known = 0;
+
+        if (sector > 0xffffff) {
+            fprintf(stderr, "->Sector %u not recorded (> 24 bits)\r\n", sector);
+            continue;
         }
+
+        for (uint32_t j = 2; j < 2 + vendor + user && !known; ++j)
+            known = (((uint32_t)p[j*3] << 16) | (p[j*3+1] << 8) | p[j*3+2]) == sector;
+        if (known)
+            continue;
+
+        if (vendor + user == capacity) {
+            fprintf(stderr, "->Bad sector list full\r\n");
+            break;
+        }
+
+        UBYTE* e = p + (2 + vendor + user) * 3;
+        e[0] = sector >> 16;
+        e[1] = sector >> 8;
+        e[2] = sector;
+        user++;
+        added++;
+    }
+
+    if (added == 0) {
+        printf("Bad sectors already recorded.\r\n");
+    } else if (record_bsl(added)) {
+        p[3] = user >> 8;
+        p[4] = user;
+        p[5] = 0;
+
+        sum = 0;
+        for (uint32_t i = 0; i < size; ++i)
+            sum += p[i];
+        p[5] = BSL_MAGIC - sum;
+
+        if (write_sectors(bsl->sect, dev, bsl_st, bsl_cnt) == 0)
+            printf("Bad sector list (sector %u) updated.\r\n", bsl_st);
+    }
+
+    free_dma_buffer(bsl);
+}
+
+// Read-verify of a whole partition in SCAN_BATCH sector reads
+static void surface_scan(int drive)
+{
+    uint16_t dev = 2 + drives[drive].bus + drives[drive].pun;
+    uint32_t start = drives[drive].sector_start;
+    uint32_t size = drives[drive].size;
+
+    num_bad = 0;
+
+    for (uint32_t done = 0; done < size; done += SCAN_BATCH) {
+        if (done % (SCAN_BATCH * 64) == 0)
+            printf("\rScanning %c: %3u%%", drives[drive].drive, (uint32_t)((uint64_t)done * 100 / size));
+        scan_range(dev, start + done, min(size - done, (uint32_t)SCAN_BATCH));
+    }
+    printf("\rScanning %c: 100%%\r\n", drives[drive].drive);
+
+    if (num_bad == 0) {
+        printf("No bad sectors.\r\n");
+        return;
     }
+
+    printf("->%d bad sectors\r\n", num_bad);
+    num_warnings++;
+
+    for (int i = 0; i < min(num_bad, BAD_MAX); ++i)
+        report_bad_sector(dev, drive, bad_sectors[i]);
+    if (num_bad > BAD_MAX)
+        printf("->...\r\n");
+
+    if (arg_update_bsl)
+        record_bad_sectors(dev);
 }
 
 
@@ -577,6 +1233,8 @@ int main(int argc, const char* argv[])
 
     parse_args(argc, argv);
 
+    alloc_sector_buffers();
+
     read_pun_info();
 
     if (!read_partition_table()) {
@@ -597,14 +1255,14 @@ int main(int argc, const char* argv[])
         if (isalpha(drives[i].drive) && !drives[i].skipped) {
             int dev = 2 + drives[i].bus + drives[i].pun;
 
-            if (read_sector(physsect.sect, dev, drives[i].sector_start + 1) != 0) {
+            if (read_sector(physsect->sect, dev, drives[i].sector_start + 1) != 0) {
                 fprintf(stderr, "Skipping '%c:' drive (root sector failure)\r\n", drives[i].drive);
                 printf("\r\n");
                 drives[i].drive = '\0';
                 continue;
             }
 
-            if (physsect.mbr.bootsig == 0x55aa) {
+            if (physsect->mbr.bootsig == 0x55aa) {
                 printf("Drive %c: contains MS-DOS image:\r\n", drives[i].drive);
                 fix_image_mbr(physsect, drives[i].sector_start + 1, 0, 0, dev, i);
                 printf("\r\n");
@@ -612,6 +1270,22 @@ int main(int argc, const char* argv[])
         }
     }
 
+    if (arg_surface_scan) {
+        for (int i = 2; i < DRIVES_MAX; ++i) {
+            if (isalpha(drives[i].drive) && !drives[i].skipped) {
+                surface_scan(i);
+                printf("\r\n");
+            }
+        }
+    }
+
+    free_dma_buffer(vol.fat);
+    free_dma_buffer(scanbuf);
+    free_dma_buffer(fatbuf2);
+    free_dma_buffer(fatbuf);
+    free_dma_buffer(physsect2);
+    free_dma_buffer(physsect);
+
     printf("Done.\r\n");
     printf("\r\n");
     printf("Press Return to exit.\r\n");
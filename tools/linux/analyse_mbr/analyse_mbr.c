@@ -3,6 +3,8 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "image.h"
+
 typedef uint8_t UBYTE;
 typedef uint16_t UWORD;
 typedef uint32_t ULONG;
@@ -40,25 +42,30 @@ int main(int argc, char* argv[])
     if (argc < 2 || argc > 3)
         return EXIT_FAILURE;
     
-    FILE* f = fopen(argv[1], "rb");
-    if (!f)
+    struct image img;
+    if (image_open(&img, argv[1], 0) != 0)
         return EXIT_FAILURE;
 
-    unsigned long offset = 0;
+    unsigned long long offset = 0;
     if (argc == 3) {
-        offset = strtoul(argv[2], NULL, 0);
-        printf("Offsetting by 0x%lx bytes\n", offset);
-        fseek(f, offset, SEEK_SET);
+        offset = strtoull(argv[2], NULL, 0);
+        printf("Offsetting by 0x%llx bytes\n", offset);
     }
     
-    uint8_t sect[1024 * 1024];
-    fread(sect, sizeof(sect[0]), sizeof(sect)/sizeof(sect[0]), f);
+    uint8_t sect[1024 * 1024] = {};
+    if (offset >= img.size
+        || image_read(&img, sect, img.size - offset < sizeof(sect) ? img.size - offset : sizeof(sect), offset) != 0) {
+        fprintf(stderr, "%s: can't read at offset 0x%llx\n", argv[1], offset);
+        image_close(&img);
+        return EXIT_FAILURE;
+    }
+    image_close(&img);
 
 #if 1
     // atari
     struct rootsector* rs = (struct rootsector*)sect;
 
-    printf("Disk size: %d sectors\n\n", be32(rs->hd_siz));
+    printf("Disk size: %u sectors\n\n", be32(rs->hd_siz));
 
     for (int i = 0; i < 4; ++i) {
         printf("Partition entry #%d:\n", i);
@@ -69,8 +76,8 @@ int main(int argc, char* argv[])
         memcpy(str, rs->part[i].id, 3);
         printf("ID: %s\n", str);
 
-        printf("First sector %d (offset: %08x)\n", be32(rs->part[i].st), be32(rs->part[i].st) * 512);
-        printf("Number of sectors: %d\n", be32(rs->part[i].siz));
+        printf("First sector %u (offset: %08llx)\n", be32(rs->part[i].st), be32(rs->part[i].st) * 512ULL);
+        printf("Number of sectors: %u\n", be32(rs->part[i].siz));
 
         printf("\n");
     }
@@ -90,11 +97,11 @@ int main(int argc, char* argv[])
         printf("Last sector (sector): %d\n", sect[i+0x06] & 0x3f);
         printf("Last sector (cylinder): %d\n", ((sect[i+0x06] & 0xC0000000) << 2) | sect[i+0x07]);
 
-        printf("First sector (LBA): %d (offset: %08x; %08x)\n", *((uint32_t*)&sect[i+0x08]), *((uint32_t*)&sect[i+0x08]) * 512, (*((uint32_t*)&sect[i+0x08]) * 512) + offset);
-        printf("Number of sectors (LBA): %d (offset: %08x; %08x)\n",
-               *((uint32_t*)&sect[i+0x0C]),
-               (*((uint32_t*)&sect[i+0x08]) + *((uint32_t*)&sect[i+0x0C])) * 512,
-               (*((uint32_t*)&sect[i+0x08]) + *((uint32_t*)&sect[i+0x0C])) * 512 + offset
+        printf("First sector (LBA): %u (offset: %08llx; %08llx)\n", le32(&sect[i+0x08]), le32(&sect[i+0x08]) * 512ULL, (le32(&sect[i+0x08]) * 512ULL) + offset);
+        printf("Number of sectors (LBA): %u (offset: %08llx; %08llx)\n",
+               le32(&sect[i+0x0C]),
+               ((unsigned long long)le32(&sect[i+0x08]) + le32(&sect[i+0x0C])) * 512,
+               ((unsigned long long)le32(&sect[i+0x08]) + le32(&sect[i+0x0C])) * 512 + offset
         );
 
         printf("\n");
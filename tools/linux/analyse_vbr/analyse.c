@@ -3,39 +3,36 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "image.h"
+
 static uint16_t be16(const uint8_t* src)
 {
     return (src[0] << 8) | src[1];
 }
 
-static uint16_t le16(const uint8_t* src)
-{
-    return *(uint16_t*)src;
-}
-
-static uint32_t le32(const uint8_t* src)
-{
-    return *(uint32_t*)src;
-}
-
 int main(int argc, char* argv[])
 {
     if (argc < 2 || argc > 3)
         return EXIT_FAILURE;
     
-    FILE* f = fopen(argv[1], "rb");
-    if (!f)
+    struct image img;
+    if (image_open(&img, argv[1], 0) != 0)
         return EXIT_FAILURE;
 
-    unsigned long offset = 0;
+    unsigned long long offset = 0;
     if (argc == 3) {
-        offset = strtoul(argv[2], NULL, 0);
-        printf("Offsetting by 0x%lx bytes\n", offset);
-        fseek(f, offset, SEEK_SET);
+        offset = strtoull(argv[2], NULL, 0);
+        printf("Offsetting by 0x%llx bytes\n", offset);
     }
     
-    uint8_t sect[128 * 1024];
-    fread(sect, sizeof(sect[0]), sizeof(sect)/sizeof(sect[0]), f);
+    uint8_t sect[128 * 1024] = {};
+    if (offset >= img.size
+        || image_read(&img, sect, img.size - offset < sizeof(sect) ? img.size - offset : sizeof(sect), offset) != 0) {
+        fprintf(stderr, "%s: can't read at offset 0x%llx\n", argv[1], offset);
+        image_close(&img);
+        return EXIT_FAILURE;
+    }
+    image_close(&img);
     
     printf("Jump instruction: %02x %02x %02x\n", sect[0], sect[1], sect[2]);
 
@@ -72,11 +69,11 @@ int main(int argc, char* argv[])
 
     //printf("Count of hidden sectors preceding the partition that contains this FAT volume: %d\n", le16(&sect[0x01C]));
 
-    printf("Count of hidden sectors: %d\n", le32(&sect[0x01C]));
+    printf("Count of hidden sectors: %u\n", le32(&sect[0x01C]));
 
     //printf("Total logical sectors including hidden sectors: %d\n", le16(&sect[0x01E]));
 
-    printf("Total logical sectors including hidden sectors: %d\n", le16(&sect[0x020]));
+    printf("Total logical sectors including hidden sectors: %u\n", le32(&sect[0x020]));
 
     printf("Physical drive number: %02x\n", sect[0x024]);
 
@@ -111,12 +108,12 @@ int main(int argc, char* argv[])
         printf("Boot sector (512B) checksum: %04x\n", crc);
     }
 
-    printf("First FAT starts at byte offset: 0x%08lx\n", offset + (numberOfReservedSectors + 0) * bytesPerSector);
+    printf("First FAT starts at byte offset: 0x%08llx\n", offset + (numberOfReservedSectors + 0ULL) * bytesPerSector);
     if (numberOfFats == 2) {
-        printf("Second FAT starts at byte offset: 0x%08lx\n", offset + (numberOfReservedSectors + sectorsPerFat) * bytesPerSector);
+        printf("Second FAT starts at byte offset: 0x%08llx\n", offset + (numberOfReservedSectors + (unsigned long long)sectorsPerFat) * bytesPerSector);
     }
 
-    printf("Data start at byte offset: 0x%08lx\n", offset + (numberOfReservedSectors + numberOfFats*sectorsPerFat) * bytesPerSector);
+    printf("Data start at byte offset: 0x%08llx\n", offset + (numberOfReservedSectors + (unsigned long long)numberOfFats*sectorsPerFat) * bytesPerSector);
     
     return EXIT_SUCCESS;
 }
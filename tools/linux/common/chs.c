@@ -0,0 +1,46 @@
+#include "chs.h"
+
+uint64_t chs_fit(uint64_t size, int* cylinders, int* heads, int* sectors)
+{
+    uint64_t final_size = 0;
+
+    *heads = -1;
+    *cylinders = -1;
+    *sectors = -1;
+
+    for (uint64_t head = 1; head <= 255; ++head) {    // avoid head 255 due to a bug in MS-DOS
+        for (uint64_t cylinder = 1; cylinder <= 1024; ++cylinder) {
+            for (uint64_t sector = 1; sector <= 63; ++sector) {   // sectors start at 1 => 63 sectors max
+                uint64_t test_size = head * cylinder * sector * CHS_BYTES_PER_SECTOR;
+
+                if (test_size > size)
+                    continue;
+
+                if (test_size > final_size) {
+                    final_size = test_size;
+                    *heads     = head;
+                    *cylinders = cylinder;
+                    *sectors   = sector;
+                }
+            }
+        }
+    }
+
+    return final_size;
+}
+
+void chs_encode(uint64_t lba, uint16_t spt, uint16_t heads, uint8_t chs[3])
+{
+    uint64_t cyl = spt && heads ? lba / ((uint64_t)spt * heads) : 0;
+
+    if (spt == 0 || heads == 0 || cyl > 1023) {
+        chs[0] = 254;
+        chs[1] = 0xff;
+        chs[2] = 0xff;
+        return;
+    }
+
+    chs[0] = (lba / spt) % heads;
+    chs[1] = ((lba % spt) + 1) | ((cyl >> 2) & 0xc0);
+    chs[2] = cyl;
+}
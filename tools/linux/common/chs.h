@@ -0,0 +1,15 @@
+#ifndef CHS_H_
+#define CHS_H_
+
+// CHS geometry search, as done by calc_chs
+
+#include <stdint.h>
+
+#define CHS_BYTES_PER_SECTOR 512
+
+// largest C*H*S*512 not exceeding size (in bytes, CHS reaches 8 GB); returns that size
+uint64_t chs_fit(uint64_t size, int* cylinders, int* heads, int* sectors);
+// MBR partition entry encoding of lba, 1023/254/63 if it can't be reached
+void chs_encode(uint64_t lba, uint16_t spt, uint16_t heads, uint8_t chs[3]);
+
+#endif
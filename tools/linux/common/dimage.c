@@ -0,0 +1,235 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "dimage.h"
+#include "image.h"
+
+#define HEADER_SIZE 32
+#define ENTRY_SIZE  16
+
+#define min(a,b) \
+   ({ __typeof__ (a) _a = (a); \
+       __typeof__ (b) _b = (b); \
+     _a < _b ? _a : _b; })
+
+struct dimage {
+    int pack_fd;
+    uint64_t size;
+    uint64_t count;
+    struct dentry* entries;
+    uint64_t* starts;   /* image offset of each entry, for the binary search */
+    char store[PATH_MAX];
+};
+
+static uint64_t le64(const uint8_t* src)
+{
+    return le32(src) | ((uint64_t)le32(src + 4) << 32);
+}
+
+static void set_le64(uint8_t* dst, uint64_t val)
+{
+    set_le32(dst, val);
+    set_le32(dst + 4, val >> 32);
+}
+
+static int pread_all(int fd, void* buf, size_t len, uint64_t offset)
+{
+    uint8_t* p = buf;
+
+    while (len > 0) {
+        ssize_t n = pread(fd, p, len, offset);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        p += n;
+        len -= n;
+        offset += n;
+    }
+
+    return 0;
+}
+
+int dimage_probe(int fd)
+{
+    char magic[8];
+
+    return pread_all(fd, magic, sizeof(magic), 0) == 0 && memcmp(magic, DIMAGE_MAGIC, sizeof(magic)) == 0;
+}
+
+struct dimage* dimage_open(int fd, uint64_t* size)
+{
+    uint8_t header[HEADER_SIZE];
+
+    if (pread_all(fd, header, sizeof(header), 0) != 0 || memcmp(header, DIMAGE_MAGIC, 8) != 0)
+        return NULL;
+
+    uint64_t image_size = le64(&header[8]);
+    uint64_t count = le64(&header[16]);
+    uint32_t path_len = le32(&header[24]);
+
+    struct dimage* d = calloc(1, sizeof(*d));
+    if (!d)
+        return NULL;
+    d->pack_fd = -1;
+
+    if (path_len == 0 || path_len >= sizeof(d->store) || count > image_size) {
+        fprintf(stderr, "Corrupt stored image header\n");
+        goto fail;
+    }
+
+    d->size = image_size;
+    d->count = count;
+    d->entries = calloc(count ? count : 1, sizeof(*d->entries));
+    d->starts = calloc(count ? count : 1, sizeof(*d->starts));
+    uint8_t* raw = malloc(count * ENTRY_SIZE + 1);
+
+    if (!d->entries || !d->starts || !raw
+        || pread_all(fd, d->store, path_len, HEADER_SIZE) != 0
+        || pread_all(fd, raw, count * ENTRY_SIZE, HEADER_SIZE + path_len) != 0) {
+        fprintf(stderr, "Can't read stored image index\n");
+        free(raw);
+        goto fail;
+    }
+
+    uint64_t start = 0;
+    for (uint64_t i = 0; i < count; ++i) {
+        d->entries[i].offset = le64(&raw[i * ENTRY_SIZE]);
+        d->entries[i].length = le32(&raw[i * ENTRY_SIZE + 8]);
+        if (d->entries[i].length == 0)
+            break;
+        d->starts[i] = start;
+        start += d->entries[i].length;
+    }
+    free(raw);
+
+    if (start != image_size) {
+        fprintf(stderr, "Corrupt stored image index\n");
+        goto fail;
+    }
+
+    char path[PATH_MAX + sizeof(DIMAGE_PACK) + 1];
+    snprintf(path, sizeof(path), "%s/%s", d->store, DIMAGE_PACK);
+    d->pack_fd = open(path, O_RDONLY);
+    if (d->pack_fd < 0) {
+        fprintf(stderr, "%s: %s\n", path, strerror(errno));
+        goto fail;
+    }
+
+    *size = image_size;
+    return d;
+
+fail:
+    dimage_close(d);
+    return NULL;
+}
+
+void dimage_close(struct dimage* d)
+{
+    if (!d)
+        return;
+
+    if (d->pack_fd >= 0)
+        close(d->pack_fd);
+    free(d->entries);
+    free(d->starts);
+    free(d);
+}
+
+// last entry starting at or before offset
+static uint64_t find_entry(const struct dimage* d, uint64_t offset)
+{
+    uint64_t lo = 0;
+    uint64_t hi = d->count;
+
+    while (hi - lo > 1) {
+        uint64_t mid = lo + (hi - lo) / 2;
+        if (d->starts[mid] <= offset)
+            lo = mid;
+        else
+            hi = mid;
+    }
+
+    return lo;
+}
+
+// pread() only, so any number of threads may read at once
+int dimage_read(struct dimage* d, void* buf, size_t len, uint64_t offset)
+{
+    uint8_t* p = buf;
+
+    if (offset + len > d->size)
+        return -1;
+
+    for (uint64_t i = find_entry(d, offset); len > 0; ++i) {
+        const struct dentry* e = &d->entries[i];
+        uint64_t pos = offset - d->starts[i];
+        size_t n = min((uint64_t)e->length - pos, (uint64_t)len);
+
+        if (e->offset == DIMAGE_ZERO)
+            memset(p, 0, n);
+        else if (pread_all(d->pack_fd, p, n, e->offset + pos) != 0)
+            return -1;
+
+        p += n;
+        len -= n;
+        offset += n;
+    }
+
+    return 0;
+}
+
+int dimage_save(int fd, const char* store, uint64_t size, const struct dentry* entries, uint64_t count)
+{
+    size_t path_len = strlen(store);
+    size_t len = HEADER_SIZE + path_len + count * ENTRY_SIZE;
+    uint8_t* raw = calloc(1, len);
+    if (!raw)
+        return -1;
+
+    memcpy(raw, DIMAGE_MAGIC, 8);
+    set_le64(&raw[8], size);
+    set_le64(&raw[16], count);
+    set_le32(&raw[24], path_len);
+    memcpy(&raw[HEADER_SIZE], store, path_len);
+
+    uint8_t* p = raw + HEADER_SIZE + path_len;
+    for (uint64_t i = 0; i < count; ++i, p += ENTRY_SIZE) {
+        set_le64(p, entries[i].offset);
+        set_le32(p + 8, entries[i].length);
+    }
+
+    int ret = 0;
+    for (const uint8_t* q = raw; ret == 0 && q < raw + len; ) {
+        ssize_t n = write(fd, q, raw + len - q);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            ret = -1;
+        else
+            q += n;
+    }
+
+    free(raw);
+    return ret;
+}
+
+const char* dimage_store(const struct dimage* d)
+{
+    return d->store;
+}
+
+void dimage_stats(const struct dimage* d, uint64_t* entries, uint64_t* zero_bytes)
+{
+    *entries = d->count;
+    *zero_bytes = 0;
+
+    for (uint64_t i = 0; i < d->count; ++i)
+        if (d->entries[i].offset == DIMAGE_ZERO)
+            *zero_bytes += d->entries[i].length;
+}
@@ -0,0 +1,45 @@
+#ifndef DIMAGE_H_
+#define DIMAGE_H_
+
+// Disk images kept in a deduplicating chunk store (see img_dedup).
+//
+// A store is a directory with two files:
+//   pack   chunk data, append-only
+//   index  per chunk: SHA-256 (32), pack offset (8), length (4), reserved (4)
+//
+// A stored image is a small file referring to its store (little-endian):
+//   header  "ATDIMG01", image size (8), entries (8), store path length (4), reserved (4)
+//   path    absolute store directory
+//   entries pack offset (8), length (4), reserved (4); offset DIMAGE_ZERO is an all-zero run
+//
+// Stored images are read-only, they are randomly accessible through the image layer.
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define DIMAGE_MAGIC "ATDIMG01"
+#define DIMAGE_PACK  "pack"
+#define DIMAGE_INDEX "index"
+#define DIMAGE_ZERO  UINT64_MAX
+
+struct dentry {
+    uint64_t offset;
+    uint32_t length;
+};
+
+struct dimage;
+
+int  dimage_probe(int fd);
+struct dimage* dimage_open(int fd, uint64_t* size);
+void dimage_close(struct dimage* d);
+
+int dimage_read(struct dimage* d, void* buf, size_t len, uint64_t offset);
+
+// writes a stored image referring to store (which must be an absolute path)
+int dimage_save(int fd, const char* store, uint64_t size, const struct dentry* entries, uint64_t count);
+
+const char* dimage_store(const struct dimage* d);
+// entries and bytes in all-zero runs
+void dimage_stats(const struct dimage* d, uint64_t* entries, uint64_t* zero_bytes);
+
+#endif
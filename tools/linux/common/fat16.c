@@ -0,0 +1,445 @@
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "fat16.h"
+
+#define min(a,b) \
+   ({ __typeof__ (a) _a = (a); \
+       __typeof__ (b) _b = (b); \
+     _a < _b ? _a : _b; })
+
+int fat16_decode_bpb(struct fat16_volume* vol, const uint8_t* sect)
+{
+    vol->bps = le16(&sect[0x00B]);
+    vol->spc = sect[0x00D];
+    vol->res = le16(&sect[0x00E]);
+    vol->fats = sect[0x010];
+    vol->dir = le16(&sect[0x011]);
+    vol->sec = le16(&sect[0x013]) ? le16(&sect[0x013]) : le32(&sect[0x020]);
+    vol->spf = le16(&sect[0x016]);
+    vol->hid = le32(&sect[0x01C]);
+
+    if ((vol->bps < 512 || vol->bps > 8192 || (vol->bps & (vol->bps - 1)) != 0)
+        || vol->spc == 0 || (vol->spc & (vol->spc - 1)) != 0
+        || vol->res == 0 || vol->fats == 0 || vol->spf == 0 || vol->dir == 0)
+        return FAT16_BAD_BPB;
+
+    uint32_t root_sectors = (vol->dir * 32 + vol->bps - 1) / vol->bps;
+    uint32_t system_sectors = vol->res + vol->fats * vol->spf + root_sectors;
+    if (vol->sec <= system_sectors)
+        return FAT16_BAD_BPB;
+
+    vol->cluster_size = vol->bps * vol->spc;
+    vol->clusters = (vol->sec - system_sectors) / vol->spc;
+    vol->fat_offset = vol->offset + (uint64_t)vol->res * vol->bps;
+    vol->root_offset = vol->fat_offset + (uint64_t)vol->fats * vol->spf * vol->bps;
+    vol->data_offset = vol->root_offset + (uint64_t)root_sectors * vol->bps;
+
+    if (vol->clusters < FAT16_MIN_CLUSTERS || vol->clusters > FAT16_MAX_CLUSTERS)
+        return FAT16_NOT_FAT16;
+
+    if ((uint64_t)vol->spf * vol->bps < (vol->clusters + 2) * 2)
+        return FAT16_BAD_BPB;
+
+    return 0;
+}
+
+int fat16_open(struct fat16_volume* vol, struct image* img, uint64_t offset)
+{
+    uint8_t sect[SECTOR_SIZE];
+
+    memset(vol, 0, sizeof(*vol));
+    vol->img = img;
+    vol->offset = offset;
+
+    if (image_read(img, sect, sizeof(sect), offset) != 0) {
+        fprintf(stderr, "Can't read boot sector at 0x%08llx\n", (unsigned long long)offset);
+        return -1;
+    }
+
+    switch (fat16_decode_bpb(vol, sect)) {
+        case FAT16_BAD_BPB:
+            fprintf(stderr, "Not a valid BPB at 0x%08llx\n", (unsigned long long)offset);
+            return -1;
+        case FAT16_NOT_FAT16:
+            fprintf(stderr, "Not a FAT16 volume at 0x%08llx (%u clusters)\n", (unsigned long long)offset, vol->clusters);
+            return FAT16_NOT_FAT16;
+    }
+
+    size_t fat_size = (size_t)vol->spf * vol->bps;
+    uint8_t* raw = malloc(fat_size);
+    vol->fat = malloc((vol->clusters + 2) * sizeof(vol->fat[0]));
+    if (!raw || !vol->fat || image_read(img, raw, fat_size, vol->fat_offset) != 0) {
+        fprintf(stderr, "Can't read FAT at 0x%08llx\n", (unsigned long long)vol->fat_offset);
+        free(raw);
+        fat16_close(vol);
+        return -1;
+    }
+
+    for (uint32_t i = 0; i < vol->clusters + 2; ++i)
+        vol->fat[i] = le16(&raw[i * 2]);
+
+    vol->dirty_first = vol->clusters + 2;
+    vol->dirty_last = 0;
+
+    free(raw);
+    return 0;
+}
+
+void fat16_close(struct fat16_volume* vol)
+{
+    free(vol->fat);
+    vol->fat = NULL;
+}
+
+int fat16_flush_fat(struct fat16_volume* vol)
+{
+    if (vol->dirty_first > vol->dirty_last)
+        return 0;
+
+    // whole sectors covering the modified entries
+    uint32_t first_sector = vol->dirty_first * 2 / vol->bps;
+    uint32_t last_sector = vol->dirty_last * 2 / vol->bps;
+    size_t len = (size_t)(last_sector - first_sector + 1) * vol->bps;
+    uint64_t offset = (uint64_t)first_sector * vol->bps;
+
+    uint8_t* raw = malloc(len);
+    if (!raw)
+        return -1;
+
+    // keep whatever lies behind the last cluster entry untouched
+    if (image_read(vol->img, raw, len, vol->fat_offset + offset) != 0) {
+        free(raw);
+        return -1;
+    }
+
+    uint32_t first_entry = first_sector * vol->bps / 2;
+    for (uint32_t i = first_entry; i < vol->clusters + 2 && (i - first_entry) * 2 < len; ++i)
+        set_le16(&raw[(i - first_entry) * 2], vol->fat[i]);
+
+    int ret = 0;
+    for (int i = 0; i < vol->fats && ret == 0; ++i)
+        ret = image_write(vol->img, raw, len, vol->fat_offset + (uint64_t)i * vol->spf * vol->bps + offset);
+
+    if (ret == 0) {
+        vol->dirty_first = vol->clusters + 2;
+        vol->dirty_last = 0;
+    }
+
+    free(raw);
+    return ret;
+}
+
+void fat16_set(struct fat16_volume* vol, uint32_t cluster, uint16_t value)
+{
+    vol->fat[cluster] = value;
+
+    if (cluster < vol->dirty_first)
+        vol->dirty_first = cluster;
+    if (cluster > vol->dirty_last)
+        vol->dirty_last = cluster;
+}
+
+int fat16_valid_cluster(const struct fat16_volume* vol, uint32_t cluster)
+{
+    return cluster >= FAT16_FIRST_CLUSTER && cluster < vol->clusters + 2;
+}
+
+uint64_t fat16_cluster_offset(const struct fat16_volume* vol, uint32_t cluster)
+{
+    return vol->data_offset + (uint64_t)(cluster - FAT16_FIRST_CLUSTER) * vol->cluster_size;
+}
+
+uint32_t fat16_run_length(const struct fat16_volume* vol, uint32_t cluster)
+{
+    uint32_t run = 1;
+
+    while (fat16_valid_cluster(vol, cluster) && vol->fat[cluster] == cluster + 1) {
+        cluster++;
+        run++;
+    }
+
+    return run;
+}
+
+uint32_t fat16_chain_length(const struct fat16_volume* vol, uint32_t cluster)
+{
+    uint32_t length = 0;
+
+    while (fat16_valid_cluster(vol, cluster)) {
+        if (++length > vol->clusters)
+            return 0;   // loop
+
+        uint16_t next = vol->fat[cluster];
+        if (next >= FAT16_EOC)
+            return length;
+        cluster = next;
+    }
+
+    return 0;
+}
+
+uint32_t fat16_free_run(const struct fat16_volume* vol, uint32_t cluster, uint32_t* length)
+{
+    if (cluster < FAT16_FIRST_CLUSTER)
+        cluster = FAT16_FIRST_CLUSTER;
+
+    while (fat16_valid_cluster(vol, cluster) && vol->fat[cluster] != FAT16_FREE)
+        cluster++;
+
+    if (!fat16_valid_cluster(vol, cluster)) {
+        *length = 0;
+        return 0;
+    }
+
+    uint32_t end = cluster;
+    while (fat16_valid_cluster(vol, end) && vol->fat[end] == FAT16_FREE)
+        end++;
+
+    *length = end - cluster;
+    return cluster;
+}
+
+int fat16_alloc(struct fat16_volume* vol, uint32_t count, uint32_t* first)
+{
+    uint32_t length;
+    uint32_t start;
+    uint32_t free_total = 0;
+
+    // first fit for the whole chain
+    for (start = fat16_free_run(vol, 0, &length); start != 0; start = fat16_free_run(vol, start + length, &length)) {
+        if (length >= count)
+            break;
+        free_total += length;
+    }
+
+    if (start == 0) {
+        if (free_total < count)
+            return -1;
+        start = fat16_free_run(vol, 0, &length);
+    }
+
+    // link the runs, lowest first
+    uint32_t prev = 0;
+    *first = start;
+    while (count > 0) {
+        uint32_t run = min(length, count);
+        for (uint32_t i = 0; i < run; ++i) {
+            if (prev)
+                fat16_set(vol, prev, start + i);
+            prev = start + i;
+        }
+        count -= run;
+        if (count > 0)
+            start = fat16_free_run(vol, start + length, &length);
+    }
+    fat16_set(vol, prev, 0xffff);
+
+    return 0;
+}
+
+void fat16_free_chain(struct fat16_volume* vol, uint32_t cluster)
+{
+    // bounded by the number of clusters in case the chain loops
+    for (uint32_t n = 0; n < vol->clusters && fat16_valid_cluster(vol, cluster); ++n) {
+        uint16_t next = vol->fat[cluster];
+        if (next == FAT16_FREE || next == FAT16_BAD)
+            break;
+        fat16_set(vol, cluster, FAT16_FREE);
+        cluster = next;
+    }
+}
+
+int fat16_read_dir(struct fat16_volume* vol, uint32_t cluster, struct fat16_dirent** entries, size_t* count)
+{
+    *entries = NULL;
+    *count = 0;
+
+    if (cluster == 0) {
+        size_t size = vol->dir * sizeof(struct fat16_dirent);
+        *entries = malloc(size);
+        if (!*entries || image_read(vol->img, *entries, size, vol->root_offset) != 0) {
+            free(*entries);
+            *entries = NULL;
+            return -1;
+        }
+        *count = vol->dir;
+        return 0;
+    }
+
+    uint32_t length = fat16_chain_length(vol, cluster);
+    if (length == 0)
+        return -1;
+
+    uint8_t* buf = malloc((size_t)length * vol->cluster_size);
+    if (!buf)
+        return -1;
+
+    // read contiguous runs in one go
+    uint8_t* p = buf;
+    while (length > 0) {
+        uint32_t run = min(fat16_run_length(vol, cluster), length);
+        if (image_read(vol->img, p, (size_t)run * vol->cluster_size, fat16_cluster_offset(vol, cluster)) != 0) {
+            free(buf);
+            return -1;
+        }
+        p += (size_t)run * vol->cluster_size;
+        length -= run;
+        cluster = vol->fat[cluster + run - 1];
+    }
+
+    *entries = (struct fat16_dirent*)buf;
+    *count = (p - buf) / sizeof(struct fat16_dirent);
+    return 0;
+}
+
+int fat16_write_dir(struct fat16_volume* vol, uint32_t cluster, const struct fat16_dirent* entries, size_t count)
+{
+    if (cluster == 0)
+        return image_write(vol->img, entries, min((size_t)vol->dir, count) * sizeof(*entries), vol->root_offset);
+
+    const uint8_t* p = (const uint8_t*)entries;
+    size_t length = count * sizeof(*entries) / vol->cluster_size;
+    while (length > 0) {
+        if (!fat16_valid_cluster(vol, cluster))
+            return -1;
+
+        uint32_t run = min((size_t)fat16_run_length(vol, cluster), length);
+        if (image_write(vol->img, p, (size_t)run * vol->cluster_size, fat16_cluster_offset(vol, cluster)) != 0)
+            return -1;
+        p += (size_t)run * vol->cluster_size;
+        length -= run;
+        cluster = vol->fat[cluster + run - 1];
+    }
+
+    return 0;
+}
+
+uint64_t fat16_dirent_offset(const struct fat16_volume* vol, uint32_t cluster, size_t index)
+{
+    if (cluster == 0)
+        return index < vol->dir ? vol->root_offset + index * sizeof(struct fat16_dirent) : 0;
+
+    size_t per_cluster = vol->cluster_size / sizeof(struct fat16_dirent);
+    for (size_t i = 0; i < index / per_cluster; ++i) {
+        cluster = vol->fat[cluster];
+        if (!fat16_valid_cluster(vol, cluster))
+            return 0;
+    }
+
+    return fat16_cluster_offset(vol, cluster) + (index % per_cluster) * sizeof(struct fat16_dirent);
+}
+
+int fat16_add_dirent(struct fat16_volume* vol, uint32_t cluster, const struct fat16_dirent* de)
+{
+    struct fat16_dirent* entries;
+    size_t count;
+
+    if (fat16_read_dir(vol, cluster, &entries, &count) != 0)
+        return -1;
+
+    size_t index = 0;
+    while (index < count && entries[index].name[0] != 0x00 && entries[index].name[0] != 0xe5)
+        index++;
+    free(entries);
+
+    if (index == count) {
+        if (cluster == 0)
+            return -1;  // root directory is full
+
+        uint32_t last = cluster;
+        while (vol->fat[last] < FAT16_EOC)
+            last = vol->fat[last];
+
+        uint32_t next;
+        if (fat16_alloc(vol, 1, &next) != 0)
+            return -1;
+
+        uint8_t* zero = calloc(1, vol->cluster_size);
+        if (!zero || image_write(vol->img, zero, vol->cluster_size, fat16_cluster_offset(vol, next)) != 0) {
+            free(zero);
+            fat16_free_chain(vol, next);
+            return -1;
+        }
+        free(zero);
+
+        fat16_set(vol, last, next);
+    }
+
+    uint64_t offset = fat16_dirent_offset(vol, cluster, index);
+    if (offset == 0)
+        return -1;
+
+    return image_write(vol->img, de, sizeof(*de), offset);
+}
+
+int fat16_dirent_used(const struct fat16_dirent* de)
+{
+    return de->name[0] != 0x00 && de->name[0] != 0xe5 && de->attr != ATTR_LFN && !(de->attr & ATTR_VOLUME);
+}
+
+void fat16_dirent_name(const struct fat16_dirent* de, char name[8+1+3+1])
+{
+    int n = 0;
+
+    for (int i = 0; i < 8 && de->name[i] != ' '; ++i)
+        name[n++] = (i == 0 && de->name[i] == 0x05) ? 0xe5 : de->name[i];
+
+    if (de->ext[0] != ' ') {
+        name[n++] = '.';
+        for (int i = 0; i < 3 && de->ext[i] != ' '; ++i)
+            name[n++] = de->ext[i];
+    }
+
+    name[n] = '\0';
+}
+
+int fat16_lookup(struct fat16_volume* vol, const char* path, struct fat16_dirent* out)
+{
+    memset(out, 0, sizeof(*out));
+    out->attr = ATTR_DIR;   // root directory, start cluster 0
+
+    while (*path) {
+        while (*path == '/' || *path == '\\')
+            path++;
+        if (!*path)
+            break;
+
+        const char* end = path;
+        while (*end && *end != '/' && *end != '\\')
+            end++;
+
+        if (!(out->attr & ATTR_DIR))
+            return -1;
+
+        struct fat16_dirent* entries;
+        size_t count;
+        if (fat16_read_dir(vol, le16(out->start), &entries, &count) != 0)
+            return -1;
+
+        int found = 0;
+        for (size_t i = 0; i < count && entries[i].name[0] != 0x00; ++i) {
+            if (!fat16_dirent_used(&entries[i]))
+                continue;
+
+            char name[8+1+3+1];
+            fat16_dirent_name(&entries[i], name);
+            if (strlen(name) == (size_t)(end - path) && strncasecmp(name, path, end - path) == 0) {
+                *out = entries[i];
+                found = 1;
+                break;
+            }
+        }
+
+        free(entries);
+        if (!found)
+            return -1;
+
+        path = end;
+    }
+
+    return 0;
+}
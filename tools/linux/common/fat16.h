@@ -0,0 +1,102 @@
+#ifndef FAT16_H_
+#define FAT16_H_
+
+// FAT16 volume layout, decoded from the BPB the same way analyse_vbr does.
+
+#include <stdint.h>
+
+#include "image.h"
+
+#define FAT16_MIN_CLUSTERS  4085
+#define FAT16_MAX_CLUSTERS  65524
+
+#define FAT16_FREE          0x0000
+#define FAT16_BAD           0xfff7
+#define FAT16_EOC           0xfff8  /* anything >= is end of chain */
+#define FAT16_FIRST_CLUSTER 2
+
+#define ATTR_RDONLY  0x01
+#define ATTR_HIDDEN  0x02
+#define ATTR_SYSTEM  0x04
+#define ATTR_VOLUME  0x08
+#define ATTR_DIR     0x10
+#define ATTR_ARCHIVE 0x20
+#define ATTR_LFN     0x0f
+
+struct fat16_dirent {
+    uint8_t name[8];
+    uint8_t ext[3];
+    uint8_t attr;
+    uint8_t reserved[10];
+    uint8_t time[2];    /* little-endian */
+    uint8_t date[2];    /* little-endian */
+    uint8_t start[2];   /* little-endian */
+    uint8_t size[4];    /* little-endian */
+} __attribute__((packed));
+
+struct fat16_volume {
+    struct image* img;
+    uint64_t offset;        /* byte offset of the boot sector in the image */
+
+    uint16_t bps;           /* bytes per sector */
+    uint8_t  spc;           /* sectors per cluster */
+    uint16_t res;           /* number of reserved sectors */
+    uint8_t  fats;          /* number of FATs */
+    uint16_t dir;           /* number of DIR root entries */
+    uint32_t sec;           /* total number of sectors */
+    uint16_t spf;           /* sectors per FAT */
+    uint32_t hid;           /* number of hidden sectors */
+
+    uint32_t cluster_size;  /* in bytes */
+    uint32_t clusters;      /* number of data clusters */
+    uint64_t fat_offset;    /* byte offset of FAT #1 in the image */
+    uint64_t root_offset;   /* byte offset of the root directory in the image */
+    uint64_t data_offset;   /* byte offset of cluster #2 in the image */
+
+    uint16_t* fat;          /* host-endian copy of FAT #1, (clusters + 2) entries */
+    uint32_t dirty_first;   /* range of modified FAT entries, */
+    uint32_t dirty_last;    /* empty if first > last */
+};
+
+#define FAT16_BAD_BPB   -1
+#define FAT16_NOT_FAT16 -2
+
+// decode a boot sector into vol (vol->offset must be set), no I/O; returns 0 for a plausible FAT16 BPB
+int  fat16_decode_bpb(struct fat16_volume* vol, const uint8_t* sect);
+// decode the BPB at offset and load FAT #1; returns 0 on success, FAT16_NOT_FAT16 for a
+// valid BPB with a cluster count outside the FAT16 range (FAT12, small GEMDOS volumes)
+int  fat16_open(struct fat16_volume* vol, struct image* img, uint64_t offset);
+void fat16_close(struct fat16_volume* vol);
+
+// write the modified part of the in-memory FAT into all FAT copies, one write per copy
+int fat16_flush_fat(struct fat16_volume* vol);
+void fat16_set(struct fat16_volume* vol, uint32_t cluster, uint16_t value);
+
+int      fat16_valid_cluster(const struct fat16_volume* vol, uint32_t cluster);
+uint64_t fat16_cluster_offset(const struct fat16_volume* vol, uint32_t cluster);
+// number of physically consecutive clusters in the chain starting at cluster
+uint32_t fat16_run_length(const struct fat16_volume* vol, uint32_t cluster);
+// number of clusters in the chain starting at cluster, 0 if the chain is broken/looping
+uint32_t fat16_chain_length(const struct fat16_volume* vol, uint32_t cluster);
+// first free cluster run at or after cluster, 0 if there is none
+uint32_t fat16_free_run(const struct fat16_volume* vol, uint32_t cluster, uint32_t* length);
+// allocate and link a chain of count clusters, as one contiguous run if possible
+int fat16_alloc(struct fat16_volume* vol, uint32_t count, uint32_t* first);
+// mark the chain starting at cluster free again, e.g. after a failed write into it
+void fat16_free_chain(struct fat16_volume* vol, uint32_t cluster);
+
+// read a whole directory (cluster 0: root directory) into a malloc'ed array
+int fat16_read_dir(struct fat16_volume* vol, uint32_t cluster, struct fat16_dirent** entries, size_t* count);
+// write back a directory read with fat16_read_dir
+int fat16_write_dir(struct fat16_volume* vol, uint32_t cluster, const struct fat16_dirent* entries, size_t count);
+// path components separated by '/' or '\'; "" or "/" is the root directory
+int fat16_lookup(struct fat16_volume* vol, const char* path, struct fat16_dirent* out);
+// byte offset of entry #index of a directory (cluster 0: root directory), 0 if out of range
+uint64_t fat16_dirent_offset(const struct fat16_volume* vol, uint32_t cluster, size_t index);
+// store de in the first unused slot, extending a subdirectory if needed
+int fat16_add_dirent(struct fat16_volume* vol, uint32_t cluster, const struct fat16_dirent* de);
+
+int  fat16_dirent_used(const struct fat16_dirent* de);
+void fat16_dirent_name(const struct fat16_dirent* de, char name[8+1+3+1]);
+
+#endif
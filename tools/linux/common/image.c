@@ -0,0 +1,443 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "dimage.h"
+#include "image.h"
+#include "oimage.h"
+#include "zimage.h"
+
+uint16_t le16(const uint8_t* src)
+{
+    return src[0] | (src[1] << 8);
+}
+
+uint32_t le32(const uint8_t* src)
+{
+    return src[0] | (src[1] << 8) | (src[2] << 16) | ((uint32_t)src[3] << 24);
+}
+
+void set_le16(uint8_t* dst, uint16_t val)
+{
+    dst[0] = val;
+    dst[1] = val >> 8;
+}
+
+void set_le32(uint8_t* dst, uint32_t val)
+{
+    dst[0] = val;
+    dst[1] = val >> 8;
+    dst[2] = val >> 16;
+    dst[3] = val >> 24;
+}
+
+int image_open(struct image* img, const char* path, int writable)
+{
+    memset(img, 0, sizeof(*img));
+
+    img->fd = open(path, writable ? O_RDWR : O_RDONLY);
+    if (img->fd < 0) {
+        fprintf(stderr, "%s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    struct stat st;
+    if (fstat(img->fd, &st) != 0) {
+        fprintf(stderr, "%s: %s\n", path, strerror(errno));
+        close(img->fd);
+        return -1;
+    }
+
+    img->writable = writable;
+    img->size = st.st_size;
+
+    if (zimage_probe(img->fd)) {
+        img->z = zimage_open(img->fd, writable, &img->size);
+        if (!img->z) {
+            fprintf(stderr, "%s: can't open compressed image\n", path);
+            close(img->fd);
+            return -1;
+        }
+    } else if (dimage_probe(img->fd)) {
+        if (writable) {
+            fprintf(stderr, "%s: stored images are read-only\n", path);
+            close(img->fd);
+            return -1;
+        }
+
+        img->d = dimage_open(img->fd, &img->size);
+        if (!img->d) {
+            fprintf(stderr, "%s: can't open stored image\n", path);
+            close(img->fd);
+            return -1;
+        }
+    } else if (oimage_probe(img->fd)) {
+        img->o = oimage_open(img->fd, writable, &img->size);
+        if (!img->o) {
+            fprintf(stderr, "%s: can't open overlay\n", path);
+            close(img->fd);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+int image_create_compressed(struct image* img, const char* path, uint64_t size)
+{
+    memset(img, 0, sizeof(*img));
+
+    img->fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (img->fd < 0) {
+        fprintf(stderr, "%s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    img->z = zimage_create(img->fd, size, ZIMAGE_CHUNK_SIZE);
+    if (!img->z) {
+        fprintf(stderr, "%s: can't create compressed image\n", path);
+        close(img->fd);
+        return -1;
+    }
+
+    img->writable = 1;
+    img->size = size;
+
+    return 0;
+}
+
+int image_flush(struct image* img)
+{
+    if (img->z)
+        return zimage_flush(img->z);
+
+    // on disk rather than in the page cache, img_overlay discards the overlay right after a commit
+    if (img->writable && !img->d)
+        return fdatasync(img->fd);
+
+    return 0;
+}
+
+void image_close(struct image* img)
+{
+    zimage_close(img->z);
+    img->z = NULL;
+    dimage_close(img->d);
+    img->d = NULL;
+    oimage_close(img->o);
+    img->o = NULL;
+
+    if (img->fd >= 0)
+        close(img->fd);
+    img->fd = -1;
+}
+
+int image_read(struct image* img, void* buf, size_t len, uint64_t offset)
+{
+    uint8_t* p = buf;
+
+    if (img->z)
+        return zimage_read(img->z, buf, len, offset);
+    if (img->d)
+        return dimage_read(img->d, buf, len, offset);
+    if (img->o)
+        return oimage_read(img->o, buf, len, offset);
+
+    while (len > 0) {
+        ssize_t n = pread(img->fd, p, len, offset);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+
+        p += n;
+        len -= n;
+        offset += n;
+    }
+
+    return 0;
+}
+
+int image_write(struct image* img, const void* buf, size_t len, uint64_t offset)
+{
+    const uint8_t* p = buf;
+
+    if (img->z)
+        return zimage_write(img->z, buf, len, offset);
+    if (img->d)
+        return -1;
+    if (img->o)
+        return oimage_write(img->o, buf, len, offset);
+
+    while (len > 0) {
+        ssize_t n = pwrite(img->fd, p, len, offset);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+
+        p += n;
+        len -= n;
+        offset += n;
+    }
+
+    if (offset > img->size)
+        img->size = offset;
+
+    return 0;
+}
+
+int image_punch(struct image* img, uint64_t offset, uint64_t len)
+{
+    // zero chunks take no space in compressed images
+    if (img->z)
+        return zimage_zero(img->z, offset, len);
+    if (img->d)
+        return -1;
+    if (img->o)
+        return oimage_zero(img->o, offset, len);
+
+    if (fallocate(img->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, len) != 0) {
+        fprintf(stderr, "Can't punch hole: %s\n", strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+int image_zero(struct image* img, uint64_t offset, uint64_t len)
+{
+    static const uint8_t zero[64 * 1024];
+
+    if (img->z)
+        return zimage_zero(img->z, offset, len);
+    if (img->d)
+        return -1;
+    if (img->o)
+        return oimage_zero(img->o, offset, len);
+
+    while (len > 0) {
+        size_t n = len < sizeof(zero) ? len : sizeof(zero);
+        if (image_write(img, zero, n, offset) != 0)
+            return -1;
+        offset += n;
+        len -= n;
+    }
+
+    return 0;
+}
+
+static int copy_buffered(struct image* img, uint64_t offset, uint64_t len, int out_fd)
+{
+    static uint8_t buf[1024 * 1024];
+
+    while (len > 0) {
+        size_t n = len < sizeof(buf) ? len : sizeof(buf);
+        if (image_read(img, buf, n, offset) != 0)
+            return -1;
+
+        for (size_t done = 0; done < n; ) {
+            ssize_t w = write(out_fd, buf + done, n - done);
+            if (w < 0 && errno == EINTR)
+                continue;
+            if (w <= 0)
+                return -1;
+            done += w;
+        }
+
+        offset += n;
+        len -= n;
+    }
+
+    return 0;
+}
+
+static int copy_mmap(struct image* img, uint64_t offset, uint64_t len, int out_fd)
+{
+    long page = sysconf(_SC_PAGESIZE);
+    uint64_t map_offset = offset & ~(uint64_t)(page - 1);
+    size_t map_len = len + (offset - map_offset);
+
+    uint8_t* map = mmap(NULL, map_len, PROT_READ, MAP_SHARED, img->fd, map_offset);
+    if (map == MAP_FAILED)
+        return -1;
+
+    madvise(map, map_len, MADV_SEQUENTIAL);
+
+    const uint8_t* p = map + (offset - map_offset);
+    int ret = 0;
+    while (len > 0) {
+        ssize_t n = write(out_fd, p, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            ret = -1;
+            break;
+        }
+        p += n;
+        len -= n;
+    }
+
+    munmap(map, map_len);
+    return ret;
+}
+
+int image_copy_to_fd(struct image* img, uint64_t offset, uint64_t len, int out_fd)
+{
+    if (offset + len > img->size)
+        return -1;
+
+    if (img->z || img->d || img->o)
+        return copy_buffered(img, offset, len, out_fd);
+
+    // copy_file_range() keeps the data in the page cache (or even shares extents)
+    loff_t off_in = offset;
+    while (len > 0) {
+        ssize_t n = copy_file_range(img->fd, &off_in, out_fd, NULL, len, 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        len -= n;
+    }
+
+    // sendfile() works for any output since 2.6.33 but not across all kernels/filesystems
+    off_t sf_off = off_in;
+    while (len > 0) {
+        ssize_t n = sendfile(out_fd, img->fd, &sf_off, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        len -= n;
+    }
+
+    if (len == 0)
+        return 0;
+
+    return copy_mmap(img, sf_off, len, out_fd);
+}
+
+static int is_zero(const uint8_t* buf, size_t len)
+{
+    return len == 0 || (buf[0] == 0 && memcmp(buf, buf + 1, len - 1) == 0);
+}
+
+// a hole where the filesystem supports one (not exFAT/vfat), written zeroes otherwise
+static int clone_zero(struct image* dst, uint64_t offset, uint64_t len)
+{
+    if (dst->z || dst->o)
+        return image_punch(dst, offset, len);
+
+    if (!dst->d && fallocate(dst->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, len) == 0)
+        return 0;
+    if (!dst->d && errno != EOPNOTSUPP) {
+        fprintf(stderr, "Can't punch hole: %s\n", strerror(errno));
+        return -1;
+    }
+
+    return image_zero(dst, offset, len);
+}
+
+// through the image layer, all-zero blocks are punched
+static int clone_buffered(struct image* dst, uint64_t dst_offset, struct image* src, uint64_t src_offset, uint64_t len)
+{
+    static uint8_t buf[1024 * 1024];
+
+    while (len > 0) {
+        size_t n = len < sizeof(buf) ? len : sizeof(buf);
+        if (image_read(src, buf, n, src_offset) != 0)
+            return -1;
+
+        if (is_zero(buf, n) ? clone_zero(dst, dst_offset, n) : image_write(dst, buf, n, dst_offset))
+            return -1;
+
+        src_offset += n;
+        dst_offset += n;
+        len -= n;
+    }
+
+    return 0;
+}
+
+static int clone_data(struct image* dst, uint64_t dst_offset, struct image* src, uint64_t src_offset, uint64_t len)
+{
+    struct stat st;
+
+    // shared extents for the part that is block aligned on both sides
+    if (fstat(dst->fd, &st) == 0 && st.st_blksize > 0 && (src_offset - dst_offset) % st.st_blksize == 0) {
+        uint64_t head = (st.st_blksize - src_offset % st.st_blksize) % st.st_blksize;
+        uint64_t body = len > head ? (len - head) / st.st_blksize * st.st_blksize : 0;
+        struct file_clone_range range = {
+            .src_fd = src->fd,
+            .src_offset = src_offset + head,
+            .src_length = body,
+            .dest_offset = dst_offset + head
+        };
+
+        if (body > 0 && ioctl(dst->fd, FICLONERANGE, &range) == 0) {
+            if (clone_data(dst, dst_offset, src, src_offset, head) != 0)
+                return -1;
+            return clone_data(dst, dst_offset + head + body, src, src_offset + head + body, len - head - body);
+        }
+    }
+
+    loff_t off_in = src_offset;
+    loff_t off_out = dst_offset;
+    while (len > 0) {
+        ssize_t n = copy_file_range(src->fd, &off_in, dst->fd, &off_out, len, 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        len -= n;
+    }
+
+    if ((uint64_t)off_out > dst->size)
+        dst->size = off_out;
+
+    return len == 0 ? 0 : clone_buffered(dst, off_out, src, off_in, len);
+}
+
+int image_clone(struct image* dst, uint64_t dst_offset, struct image* src, uint64_t src_offset, uint64_t len)
+{
+    if (src->z || src->d || src->o || dst->z || dst->d || dst->o)
+        return clone_buffered(dst, dst_offset, src, src_offset, len);
+
+    // data extents are cloned/copied, holes are punched
+    uint64_t end = src_offset + len;
+    while (src_offset < end) {
+        off_t data = lseek(src->fd, src_offset, SEEK_DATA);
+        if (data < 0)
+            data = errno == ENXIO ? end : src_offset;   // ENXIO: only a hole is left
+        if ((uint64_t)data > end)
+            data = end;
+
+        if ((uint64_t)data > src_offset) {
+            if (clone_zero(dst, dst_offset, data - src_offset) != 0)
+                return -1;
+            dst_offset += data - src_offset;
+            src_offset = data;
+            continue;
+        }
+
+        off_t hole = lseek(src->fd, src_offset, SEEK_HOLE);
+        if (hole < 0 || (uint64_t)hole > end)
+            hole = end;
+
+        if (clone_data(dst, dst_offset, src, src_offset, hole - src_offset) != 0)
+            return -1;
+        dst_offset += hole - src_offset;
+        src_offset = hole;
+    }
+
+    return 0;
+}
@@ -0,0 +1,53 @@
+#ifndef IMAGE_H_
+#define IMAGE_H_
+
+// Host-side access to (multi-GB) disk images. All offsets are 64-bit byte offsets.
+// Compressed images (see zimage.h), read-only stored images (see dimage.h) and
+// copy-on-write overlays (see oimage.h) are recognised and handled transparently.
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SECTOR_SIZE 512
+
+struct zimage;
+struct dimage;
+struct oimage;
+
+struct image {
+    int fd;
+    int writable;
+    uint64_t size;      /* in bytes */
+    struct zimage* z;   /* NULL for raw images */
+    struct dimage* d;   /* NULL unless stored in a dedup store */
+    struct oimage* o;   /* NULL unless an overlay over another image */
+};
+
+// byte order of on-disk structures
+uint16_t le16(const uint8_t* src);
+uint32_t le32(const uint8_t* src);
+void set_le16(uint8_t* dst, uint16_t val);
+void set_le32(uint8_t* dst, uint32_t val);
+
+int  image_open(struct image* img, const char* path, int writable);
+// new compressed image of the given size, all zeroes
+int  image_create_compressed(struct image* img, const char* path, uint64_t size);
+// write out a compressed image's chunks and index and sync writable images to disk
+int  image_flush(struct image* img);
+void image_close(struct image* img);
+
+// return 0 on success, -1 on error (including short reads past the end)
+int image_read(struct image* img, void* buf, size_t len, uint64_t offset);
+int image_write(struct image* img, const void* buf, size_t len, uint64_t offset);
+
+// deallocate (punch a hole) or overwrite a byte range with zeroes
+int image_punch(struct image* img, uint64_t offset, uint64_t len);
+int image_zero(struct image* img, uint64_t offset, uint64_t len);
+
+// copy a byte range into out_fd in the kernel (copy_file_range/sendfile) if possible
+int image_copy_to_fd(struct image* img, uint64_t offset, uint64_t len, int out_fd);
+// copy a byte range between images, sharing extents (FICLONERANGE) or copying in the
+// kernel (copy_file_range) between raw images; holes in src become holes in dst
+int image_clone(struct image* dst, uint64_t dst_offset, struct image* src, uint64_t src_offset, uint64_t len);
+
+#endif
@@ -0,0 +1,418 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "image.h"
+#include "oimage.h"
+
+#define FIXED_SIZE 48
+#define PAGE_SIZE  4096
+
+#define min(a,b) \
+   ({ __typeof__ (a) _a = (a); \
+       __typeof__ (b) _b = (b); \
+     _a < _b ? _a : _b; })
+
+struct oimage {
+    int fd;
+    int writable;
+    uint64_t size;
+    uint64_t sectors;
+    uint64_t data_offset;
+    uint32_t flags;
+    uint8_t* bitmap;
+    size_t bitmap_len;
+    struct image base;
+    char path[PATH_MAX];
+    pthread_mutex_t lock;
+};
+
+static uint64_t le64(const uint8_t* src)
+{
+    return le32(src) | ((uint64_t)le32(src + 4) << 32);
+}
+
+static void set_le64(uint8_t* dst, uint64_t val)
+{
+    set_le32(dst, val);
+    set_le32(dst + 4, val >> 32);
+}
+
+static int pread_all(int fd, void* buf, size_t len, uint64_t offset)
+{
+    uint8_t* p = buf;
+
+    while (len > 0) {
+        ssize_t n = pread(fd, p, len, offset);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        p += n;
+        len -= n;
+        offset += n;
+    }
+
+    return 0;
+}
+
+static int pwrite_all(int fd, const void* buf, size_t len, uint64_t offset)
+{
+    const uint8_t* p = buf;
+
+    while (len > 0) {
+        ssize_t n = pwrite(fd, p, len, offset);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        p += n;
+        len -= n;
+        offset += n;
+    }
+
+    return 0;
+}
+
+static size_t bitmap_len(uint64_t size)
+{
+    uint64_t sectors = (size + SECTOR_SIZE - 1) / SECTOR_SIZE;
+    return ((sectors + 7) / 8 + PAGE_SIZE - 1) / PAGE_SIZE * PAGE_SIZE;
+}
+
+// header for base as it is now; the rest of the file is (re)made sparse
+static int write_header(int fd, const char* base, uint64_t size)
+{
+    struct stat st;
+    if (stat(base, &st) != 0) {
+        fprintf(stderr, "%s: %s\n", base, strerror(errno));
+        return -1;
+    }
+
+    size_t path_len = strlen(base);
+    if (path_len > OIMAGE_HEADER_SIZE - FIXED_SIZE)
+        return -1;
+
+    uint8_t header[OIMAGE_HEADER_SIZE] = {};
+    memcpy(header, OIMAGE_MAGIC, 8);
+    set_le64(&header[8], size);
+    set_le64(&header[16], st.st_size);
+    set_le64(&header[24], (uint64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec);
+    set_le32(&header[32], path_len);
+    memcpy(&header[FIXED_SIZE], base, path_len);
+
+    uint64_t file_size = OIMAGE_HEADER_SIZE + bitmap_len(size) + size;
+    if (pwrite_all(fd, header, sizeof(header), 0) != 0
+        || ftruncate(fd, OIMAGE_HEADER_SIZE) != 0 || ftruncate(fd, file_size) != 0)
+        return -1;
+
+    return 0;
+}
+
+int oimage_probe(int fd)
+{
+    char magic[8];
+
+    return pread_all(fd, magic, sizeof(magic), 0) == 0 && memcmp(magic, OIMAGE_MAGIC, sizeof(magic)) == 0;
+}
+
+int oimage_create(int fd, const char* base)
+{
+    struct image img;
+
+    if (image_open(&img, base, 0) != 0)
+        return -1;
+
+    uint64_t size = img.size;
+    image_close(&img);
+
+    return write_header(fd, base, size);
+}
+
+struct oimage* oimage_open(int fd, int writable, uint64_t* size)
+{
+    uint8_t header[OIMAGE_HEADER_SIZE];
+
+    if (pread_all(fd, header, sizeof(header), 0) != 0 || memcmp(header, OIMAGE_MAGIC, 8) != 0)
+        return NULL;
+
+    struct oimage* o = calloc(1, sizeof(*o));
+    if (!o)
+        return NULL;
+    o->fd = fd;
+    o->writable = writable;
+    o->base.fd = -1;
+    pthread_mutex_init(&o->lock, NULL);
+
+    uint32_t path_len = le32(&header[32]);
+    if (path_len == 0 || path_len > OIMAGE_HEADER_SIZE - FIXED_SIZE || path_len >= sizeof(o->path)) {
+        fprintf(stderr, "Corrupt overlay header\n");
+        goto fail;
+    }
+    memcpy(o->path, &header[FIXED_SIZE], path_len);
+
+    o->size = le64(&header[8]);
+    o->sectors = (o->size + SECTOR_SIZE - 1) / SECTOR_SIZE;
+    o->bitmap_len = bitmap_len(o->size);
+    o->data_offset = OIMAGE_HEADER_SIZE + o->bitmap_len;
+    o->flags = le32(&header[36]);
+
+    struct stat st;
+    if (stat(o->path, &st) != 0) {
+        fprintf(stderr, "%s: %s\n", o->path, strerror(errno));
+        goto fail;
+    }
+
+    // an interrupted commit has changed the base already, the overlay still holds all of it
+    if (!(o->flags & OIMAGE_COMMITTING) && ((uint64_t)st.st_size != le64(&header[16])
+        || (uint64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec != le64(&header[24]))) {
+        fprintf(stderr, "%s: base image has changed since the overlay was made\n", o->path);
+        goto fail;
+    }
+
+    o->bitmap = malloc(o->bitmap_len);
+    if (!o->bitmap || pread_all(fd, o->bitmap, o->bitmap_len, OIMAGE_HEADER_SIZE) != 0) {
+        fprintf(stderr, "Can't read overlay bitmap\n");
+        goto fail;
+    }
+
+    if (image_open(&o->base, o->path, 0) != 0) {
+        o->base.fd = -1;
+        goto fail;
+    }
+
+    if (o->base.size != o->size) {
+        fprintf(stderr, "%s: base image size doesn't match the overlay\n", o->path);
+        goto fail;
+    }
+
+    *size = o->size;
+    return o;
+
+fail:
+    oimage_close(o);
+    return NULL;
+}
+
+void oimage_close(struct oimage* o)
+{
+    if (!o)
+        return;
+
+    if (o->base.fd >= 0)
+        image_close(&o->base);
+    pthread_mutex_destroy(&o->lock);
+    free(o->bitmap);
+    free(o);
+}
+
+static int test(const struct oimage* o, uint64_t sector)
+{
+    return o->bitmap[sector / 8] & (1 << (sector % 8));
+}
+
+// set the bits of sectors first..last and store the bitmap bytes holding them
+static int mark(struct oimage* o, uint64_t first, uint64_t last)
+{
+    for (uint64_t sector = first; sector <= last; ++sector)
+        o->bitmap[sector / 8] |= 1 << (sector % 8);
+
+    return pwrite_all(o->fd, &o->bitmap[first / 8], last / 8 - first / 8 + 1, OIMAGE_HEADER_SIZE + first / 8);
+}
+
+// make a partially written sector complete in the overlay
+static int copy_up(struct oimage* o, uint64_t sector)
+{
+    uint8_t buf[SECTOR_SIZE];
+    size_t len = min((uint64_t)SECTOR_SIZE, o->size - sector * SECTOR_SIZE);
+
+    if (test(o, sector))
+        return 0;
+
+    if (image_read(&o->base, buf, len, sector * SECTOR_SIZE) != 0)
+        return -1;
+    return pwrite_all(o->fd, buf, len, o->data_offset + sector * SECTOR_SIZE);
+}
+
+int oimage_read(struct oimage* o, void* buf, size_t len, uint64_t offset)
+{
+    uint8_t* p = buf;
+    int ret = 0;
+
+    if (offset + len > o->size)
+        return -1;
+
+    pthread_mutex_lock(&o->lock);
+
+    // runs of sectors from the same side
+    while (len > 0 && ret == 0) {
+        uint64_t sector = offset / SECTOR_SIZE;
+        int in = test(o, sector);
+        uint64_t end = sector + 1;
+        while (end * SECTOR_SIZE < offset + len && !test(o, end) == !in)
+            end++;
+
+        size_t n = min(end * SECTOR_SIZE - offset, (uint64_t)len);
+        if (in)
+            ret = pread_all(o->fd, p, n, o->data_offset + offset);
+        else
+            ret = image_read(&o->base, p, n, offset);
+
+        p += n;
+        len -= n;
+        offset += n;
+    }
+
+    pthread_mutex_unlock(&o->lock);
+    return ret;
+}
+
+int oimage_write(struct oimage* o, const void* buf, size_t len, uint64_t offset)
+{
+    if (!o->writable || offset + len > o->size)
+        return -1;
+    if (len == 0)
+        return 0;
+
+    uint64_t first = offset / SECTOR_SIZE;
+    uint64_t last = (offset + len - 1) / SECTOR_SIZE;
+
+    pthread_mutex_lock(&o->lock);
+
+    int ret = 0;
+    if (offset % SECTOR_SIZE != 0)
+        ret = copy_up(o, first);
+    if (ret == 0 && (offset + len) % SECTOR_SIZE != 0 && offset + len < o->size)
+        ret = copy_up(o, last);
+
+    // data before the bitmap, a sector is never marked without its contents
+    if (ret == 0)
+        ret = pwrite_all(o->fd, buf, len, o->data_offset + offset);
+    if (ret == 0)
+        ret = mark(o, first, last);
+
+    pthread_mutex_unlock(&o->lock);
+    return ret;
+}
+
+int oimage_zero(struct oimage* o, uint64_t offset, uint64_t len)
+{
+    static const uint8_t zero[64 * 1024];
+
+    if (!o->writable || offset + len > o->size)
+        return -1;
+
+    // partial sectors at both ends
+    uint64_t head = min((SECTOR_SIZE - offset % SECTOR_SIZE) % SECTOR_SIZE, len);
+    if (head > 0 && oimage_write(o, zero, head, offset) != 0)
+        return -1;
+    offset += head;
+    len -= head;
+
+    uint64_t tail = len % SECTOR_SIZE;
+    if (tail > 0 && oimage_write(o, zero, tail, offset + len - tail) != 0)
+        return -1;
+    len -= tail;
+
+    if (len == 0)
+        return 0;
+
+    pthread_mutex_lock(&o->lock);
+
+    // whole sectors: a hole in the data reads as zeroes
+    int ret = 0;
+    if (fallocate(o->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, o->data_offset + offset, len) != 0) {
+        for (uint64_t done = 0; ret == 0 && done < len; done += sizeof(zero))
+            ret = pwrite_all(o->fd, zero, min((uint64_t)sizeof(zero), len - done), o->data_offset + offset + done);
+    }
+    if (ret == 0)
+        ret = mark(o, offset / SECTOR_SIZE, (offset + len) / SECTOR_SIZE - 1);
+
+    pthread_mutex_unlock(&o->lock);
+    return ret;
+}
+
+int oimage_next_run(const struct oimage* o, uint64_t* sector, uint64_t* count)
+{
+    uint64_t first = *sector;
+
+    while (first < o->sectors && !test(o, first)) {
+        // skip clean bytes of the bitmap in one go
+        if (first % 8 == 0 && o->bitmap[first / 8] == 0)
+            first += 8;
+        else
+            first++;
+    }
+
+    if (first >= o->sectors)
+        return -1;
+
+    uint64_t end = first + 1;
+    while (end < o->sectors && test(o, end))
+        end++;
+
+    *sector = first;
+    *count = end - first;
+    return 0;
+}
+
+int oimage_begin_commit(struct oimage* o)
+{
+    uint8_t flags[4];
+
+    if (!o->writable)
+        return -1;
+
+    // on disk before the first write to the base
+    set_le32(flags, o->flags | OIMAGE_COMMITTING);
+    if (pwrite_all(o->fd, flags, sizeof(flags), 36) != 0 || fdatasync(o->fd) != 0)
+        return -1;
+
+    o->flags |= OIMAGE_COMMITTING;
+    return 0;
+}
+
+int oimage_committing(const struct oimage* o)
+{
+    return (o->flags & OIMAGE_COMMITTING) != 0;
+}
+
+int oimage_discard(struct oimage* o)
+{
+    if (!o->writable)
+        return -1;
+
+    pthread_mutex_lock(&o->lock);
+
+    // the base may have been changed by a commit, start over from its current state
+    image_close(&o->base);
+    int ret = write_header(o->fd, o->path, o->size);
+    if (ret == 0 && image_open(&o->base, o->path, 0) != 0) {
+        o->base.fd = -1;
+        ret = -1;
+    }
+    if (ret == 0) {
+        memset(o->bitmap, 0, o->bitmap_len);
+        o->flags = 0;
+    }
+
+    pthread_mutex_unlock(&o->lock);
+    return ret;
+}
+
+const char* oimage_base(const struct oimage* o)
+{
+    return o->path;
+}
+
+struct image* oimage_base_image(struct oimage* o)
+{
+    return &o->base;
+}
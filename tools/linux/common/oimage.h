@@ -0,0 +1,47 @@
+#ifndef OIMAGE_H_
+#define OIMAGE_H_
+
+// Copy-on-write overlays over another disk image (see img_overlay).
+//
+// Layout (little-endian):
+//   header  "ATOIMG01", image size (8), base size (8), base mtime (8, ns),
+//           base path length (4), flags (4), base path (absolute), padded to OIMAGE_HEADER_SIZE
+//   bitmap  one bit per sector, set if the sector lives in the overlay
+//   data    sector n at the (page aligned) end of the bitmap + n * 512, a sparse file
+//
+// The base image is only ever read; the overlay refuses to open once the base has
+// changed, unless it was being committed (OIMAGE_COMMITTING). Writes to sectors not in
+// the overlay yet copy the rest of the sector up first.
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define OIMAGE_MAGIC       "ATOIMG01"
+#define OIMAGE_HEADER_SIZE 4096
+
+#define OIMAGE_COMMITTING  0x01
+
+struct oimage;
+
+int  oimage_probe(int fd);
+struct oimage* oimage_open(int fd, int writable, uint64_t* size);
+// new empty overlay over base (which must be an absolute path)
+int  oimage_create(int fd, const char* base);
+void oimage_close(struct oimage* o);
+
+int oimage_read(struct oimage* o, void* buf, size_t len, uint64_t offset);
+int oimage_write(struct oimage* o, const void* buf, size_t len, uint64_t offset);
+int oimage_zero(struct oimage* o, uint64_t offset, uint64_t len);
+
+// first run of overlay sectors at or after *sector; returns -1 if there is none
+int oimage_next_run(const struct oimage* o, uint64_t* sector, uint64_t* count);
+// the base is about to be written: keep accepting it until oimage_discard
+int oimage_begin_commit(struct oimage* o);
+int oimage_committing(const struct oimage* o);
+// drop all sectors and take the base as it is now
+int oimage_discard(struct oimage* o);
+
+const char* oimage_base(const struct oimage* o);
+struct image* oimage_base_image(struct oimage* o);
+
+#endif
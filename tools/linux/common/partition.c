@@ -0,0 +1,194 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "fat16.h"
+#include "partition.h"
+
+#define EBR_MAX 128
+
+uint32_t be32(const uint8_t* src)
+{
+    return ((uint32_t)src[0] << 24) | (src[1] << 16) | (src[2] << 8) | src[3];
+}
+
+static int add(struct partition* parts, int count, int max, const struct partition* part)
+{
+    if (count >= max)
+        return count;
+
+    parts[count] = *part;
+    return count + 1;
+}
+
+static int is_extended(uint8_t type)
+{
+    // 0x05: Extended partition with CHS addressing
+    // 0x0f: Extended partition with LBA
+    return type == 0x05 || type == 0x0f;
+}
+
+int partition_valid_mbr(const uint8_t* sect, uint64_t limit)
+{
+    if (sect[0x1fe] != 0x55 || sect[0x1ff] != 0xaa)
+        return 0;
+
+    int used = 0;
+    for (int i = 0; i < 4; ++i) {
+        const uint8_t* pe = &sect[0x1be + i * 0x10];
+        if (pe[0] != 0x00 && pe[0] != 0x80)
+            return 0;
+        if (pe[4] == 0x00)
+            continue;
+        if (limit && (uint64_t)le32(&pe[8]) + le32(&pe[12]) > limit)
+            return 0;
+        used++;
+    }
+
+    return used > 0;
+}
+
+// offset: sector the MBR's LBA addresses are relative to
+static int walk_mbr(struct image* img, uint64_t offset, int image, struct partition* parts, int count, int max)
+{
+    uint8_t sect[SECTOR_SIZE];
+
+    if (image_read(img, sect, sizeof(sect), offset * SECTOR_SIZE) != 0)
+        return count;
+
+    uint64_t ext_start = 0;
+    for (int i = 0; i < 4; ++i) {
+        const uint8_t* pe = &sect[0x1be + i * 0x10];
+        struct partition part = {};
+
+        part.type = pe[4];
+        part.start = offset + le32(&pe[8]);
+        part.size = le32(&pe[12]);
+        part.image = image;
+        part.pte = offset * SECTOR_SIZE + 0x1be + i * 0x10;
+
+        if (part.type == 0x00 || part.size == 0)
+            continue;
+
+        if (!is_extended(part.type)) {
+            count = add(parts, count, max, &part);
+            continue;
+        }
+
+        // EBR chain: entry #0 relative to the EBR, entry #1 relative to the extended partition
+        ext_start = part.start;
+        uint64_t ebr = ext_start;
+        for (int n = 0; n < EBR_MAX && ebr != 0; ++n) {
+            uint8_t ebr_sect[SECTOR_SIZE];
+            if (image_read(img, ebr_sect, sizeof(ebr_sect), ebr * SECTOR_SIZE) != 0
+                || ebr_sect[0x1fe] != 0x55 || ebr_sect[0x1ff] != 0xaa)
+                break;
+
+            const uint8_t* lpe = &ebr_sect[0x1be];
+            struct partition logical = {};
+            logical.type = lpe[4];
+            logical.start = ebr + le32(&lpe[8]);
+            logical.size = le32(&lpe[12]);
+            logical.image = image;
+            logical.pte = ebr * SECTOR_SIZE + 0x1be;
+            if (logical.type != 0x00 && logical.size != 0)
+                count = add(parts, count, max, &logical);
+
+            const uint8_t* next = &ebr_sect[0x1be + 0x10];
+            ebr = is_extended(next[4]) ? ext_start + le32(&next[8]) : 0;
+        }
+    }
+
+    return count;
+}
+
+static int add_ahdi(struct image* img, struct partition* part, struct partition* parts, int count, int max)
+{
+    uint8_t sect[SECTOR_SIZE];
+
+    // ATonce image: MBR right behind the Atari partition's first sector
+    if (image_read(img, sect, sizeof(sect), (part->start + 1) * SECTOR_SIZE) == 0
+        && partition_valid_mbr(sect, part->size - 1)) {
+        part->container = 1;
+        count = add(parts, count, max, part);
+        return walk_mbr(img, part->start + 1, 1, parts, count, max);
+    }
+
+    return add(parts, count, max, part);
+}
+
+static int walk_ahdi(struct image* img, const uint8_t* rs, struct partition* parts, int count, int max)
+{
+    for (int i = 0; i < 4; ++i) {
+        // struct rootsector: part[4] at 0x1c6, 12 bytes each, big-endian
+        const uint8_t* pi = &rs[0x1c6 + i * 12];
+        if (!(pi[0] & 0x01))
+            continue;
+
+        struct partition part = {};
+        memcpy(part.id, &pi[1], 3);
+        part.start = be32(&pi[4]);
+        part.size = be32(&pi[8]);
+        part.pte = 0x1c6 + i * 12;
+
+        if (memcmp(part.id, "XGM", 3) != 0) {
+            if (part.size != 0)
+                count = add_ahdi(img, &part, parts, count, max);
+            continue;
+        }
+
+        // XGM chain: part[0] relative to this root sector, part[1] relative to the first XGM
+        uint64_t ext_st = part.start;
+        uint64_t pi_st = ext_st;
+        for (int n = 0; n < EBR_MAX; ++n) {
+            uint8_t ext[SECTOR_SIZE];
+            if (image_read(img, ext, sizeof(ext), pi_st * SECTOR_SIZE) != 0)
+                break;
+
+            const uint8_t* epi = &ext[0x1c6];
+            struct partition logical = {};
+            memcpy(logical.id, &epi[1], 3);
+            logical.start = pi_st + be32(&epi[4]);
+            logical.size = be32(&epi[8]);
+            logical.pte = pi_st * SECTOR_SIZE + 0x1c6;
+            if ((epi[0] & 0x01) && logical.size != 0)
+                count = add_ahdi(img, &logical, parts, count, max);
+
+            const uint8_t* next = &ext[0x1c6 + 12];
+            if (!(next[0] & 0x01) || memcmp(&next[1], "XGM", 3) != 0)
+                break;
+            pi_st = ext_st + be32(&next[4]);
+        }
+    }
+
+    return count;
+}
+
+int partition_walk(struct image* img, struct partition* parts, int max)
+{
+    uint8_t sect[SECTOR_SIZE];
+
+    if (image_read(img, sect, sizeof(sect), 0) != 0)
+        return 0;
+
+    if (partition_valid_mbr(sect, 0))
+        return walk_mbr(img, 0, 0, parts, 0, max);
+
+    return walk_ahdi(img, sect, parts, 0, max);
+}
+
+int partition_is_fat(const struct partition* part)
+{
+    if (part->id[0])
+        return (memcmp(part->id, "GEM", 3) == 0 || memcmp(part->id, "BGM", 3) == 0) && !part->container;
+
+    // 0x04: FAT16 < 32 MB, 0x06: FAT16B, 0x0e: FAT16B with LBA
+    return part->type == 0x04 || part->type == 0x06 || part->type == 0x0e;
+}
+
+void partition_name(const struct partition* part, char name[3+1])
+{
+    if (part->id[0])
+        memcpy(name, part->id, 4);
+    else
+        snprintf(name, 4, "%02x", part->type);
+}
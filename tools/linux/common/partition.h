@@ -0,0 +1,32 @@
+#ifndef PARTITION_H_
+#define PARTITION_H_
+
+// Partition walk over AHDI root sectors, MBRs/EBRs and ATonce images
+// (an MS-DOS disk image starting one sector into an Atari partition), as atn_fix does it.
+
+#include <stdint.h>
+
+#include "image.h"
+
+#define PARTITIONS_MAX 64
+
+struct partition {
+    uint64_t start;     /* first sector */
+    uint64_t size;      /* in sectors */
+    uint8_t  type;      /* MBR partition type, 0 for AHDI */
+    char     id[3+1];   /* "GEM", "BGM", ... for AHDI, "" for MBR */
+    int      image;     /* inside an ATonce image */
+    int      container; /* Atari partition holding an ATonce image */
+    uint64_t pte;       /* byte offset of the partition table entry */
+};
+
+uint32_t be32(const uint8_t* src);
+
+// 0x55AA plus sane partition entries that end within limit sectors (0: no limit)
+int partition_valid_mbr(const uint8_t* sect, uint64_t limit);
+// returns the number of partitions found
+int partition_walk(struct image* img, struct partition* parts, int max);
+int partition_is_fat(const struct partition* part);
+void partition_name(const struct partition* part, char name[3+1]);
+
+#endif
@@ -0,0 +1,13 @@
+#ifndef SHA256_H_
+#define SHA256_H_
+
+// SHA-256 (FIPS 180-4), used to identify chunks in the dedup store
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SHA256_SIZE 32
+
+void sha256(const void* data, size_t len, uint8_t digest[SHA256_SIZE]);
+
+#endif
@@ -0,0 +1,620 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "image.h"
+#include "zimage.h"
+
+#define HEADER_SIZE 40
+#define ENTRY_SIZE  16
+#define CACHE_SLOTS 16
+#define FLAG_STORED 0x01
+
+#define min(a,b) \
+   ({ __typeof__ (a) _a = (a); \
+       __typeof__ (b) _b = (b); \
+     _a < _b ? _a : _b; })
+
+struct zentry {
+    uint64_t offset;
+    uint32_t length;
+    uint32_t flags;
+};
+
+struct zextent {
+    uint64_t offset;
+    uint64_t length;
+};
+
+// byte ranges of the file, sorted and merged
+struct zspace {
+    struct zextent* e;
+    size_t count;
+    size_t max;
+};
+
+struct zslot {
+    uint64_t chunk;     /* UINT64_MAX: unused */
+    uint64_t used;      /* LRU tick */
+    int dirty;
+    uint8_t* data;
+};
+
+struct zimage {
+    int fd;
+    int writable;
+    uint32_t chunk_size;
+    uint64_t size;
+    uint64_t chunks;
+    uint64_t end;       /* where the next chunk gets appended */
+    int index_dirty;
+    struct zentry* index;
+    struct zextent index_at;  /* the index the header points at */
+    struct zspace free;       /* unused by that index, may be overwritten */
+    struct zspace released;   /* replaced since, free once the header has moved on */
+
+    pthread_mutex_t lock;
+    uint64_t tick;
+    struct zslot cache[CACHE_SLOTS];
+    uint8_t* zbuf;      /* compression buffer */
+    uLong zbuf_size;
+};
+
+static uint64_t le64(const uint8_t* src)
+{
+    return le32(src) | ((uint64_t)le32(src + 4) << 32);
+}
+
+static void set_le64(uint8_t* dst, uint64_t val)
+{
+    set_le32(dst, val);
+    set_le32(dst + 4, val >> 32);
+}
+
+static int pread_all(int fd, void* buf, size_t len, uint64_t offset)
+{
+    uint8_t* p = buf;
+
+    while (len > 0) {
+        ssize_t n = pread(fd, p, len, offset);
+        if (n <= 0)
+            return -1;
+        p += n;
+        len -= n;
+        offset += n;
+    }
+
+    return 0;
+}
+
+static int pwrite_all(int fd, const void* buf, size_t len, uint64_t offset)
+{
+    const uint8_t* p = buf;
+
+    while (len > 0) {
+        ssize_t n = pwrite(fd, p, len, offset);
+        if (n <= 0)
+            return -1;
+        p += n;
+        len -= n;
+        offset += n;
+    }
+
+    return 0;
+}
+
+// out of memory only loses the space
+static void space_add(struct zspace* s, uint64_t offset, uint64_t length)
+{
+    if (length == 0)
+        return;
+
+    size_t i = 0;
+    while (i < s->count && s->e[i].offset < offset)
+        i++;
+
+    // merge with the neighbours
+    int before = i > 0 && s->e[i - 1].offset + s->e[i - 1].length == offset;
+    int after = i < s->count && offset + length == s->e[i].offset;
+    if (before && after) {
+        s->e[i - 1].length += length + s->e[i].length;
+        memmove(&s->e[i], &s->e[i + 1], (s->count - i - 1) * sizeof(*s->e));
+        s->count--;
+        return;
+    }
+    if (before) {
+        s->e[i - 1].length += length;
+        return;
+    }
+    if (after) {
+        s->e[i].offset = offset;
+        s->e[i].length += length;
+        return;
+    }
+
+    if (s->count == s->max) {
+        size_t max = s->max ? s->max * 2 : 64;
+        struct zextent* e = realloc(s->e, max * sizeof(*e));
+        if (!e)
+            return;
+        s->e = e;
+        s->max = max;
+    }
+
+    memmove(&s->e[i + 1], &s->e[i], (s->count - i) * sizeof(*s->e));
+    s->e[i].offset = offset;
+    s->e[i].length = length;
+    s->count++;
+}
+
+// first fit in the free space, else at the end of the file
+static uint64_t space_take(struct zimage* z, uint64_t length)
+{
+    for (size_t i = 0; i < z->free.count; ++i) {
+        struct zextent* e = &z->free.e[i];
+        if (e->length < length)
+            continue;
+
+        uint64_t offset = e->offset;
+        e->offset += length;
+        e->length -= length;
+        if (e->length == 0) {
+            memmove(e, e + 1, (z->free.count - i - 1) * sizeof(*e));
+            z->free.count--;
+        }
+        return offset;
+    }
+
+    uint64_t offset = z->end;
+    z->end += length;
+    return offset;
+}
+
+static int compare_extents(const void* a, const void* b)
+{
+    const struct zextent* x = a;
+    const struct zextent* y = b;
+
+    return x->offset < y->offset ? -1 : x->offset > y->offset;
+}
+
+// the gaps between the chunks and the index: replaced chunks, old indexes, interrupted flushes
+static int find_free(struct zimage* z)
+{
+    struct zextent* used = malloc((z->chunks + 1) * sizeof(*used));
+    if (!used)
+        return -1;
+
+    size_t count = 0;
+    for (uint64_t i = 0; i < z->chunks; ++i) {
+        if (z->index[i].length > 0) {
+            used[count].offset = z->index[i].offset;
+            used[count].length = z->index[i].length;
+            count++;
+        }
+    }
+    used[count++] = z->index_at;
+    qsort(used, count, sizeof(*used), compare_extents);
+
+    uint64_t at = HEADER_SIZE;
+    for (size_t i = 0; i < count; ++i) {
+        if (used[i].offset > at)
+            space_add(&z->free, at, used[i].offset - at);
+        at = used[i].offset + used[i].length > at ? used[i].offset + used[i].length : at;
+    }
+    if (z->end > at)
+        space_add(&z->free, at, z->end - at);
+
+    free(used);
+    return 0;
+}
+
+int zimage_probe(int fd)
+{
+    char magic[8];
+
+    return pread_all(fd, magic, sizeof(magic), 0) == 0 && memcmp(magic, ZIMAGE_MAGIC, sizeof(magic)) == 0;
+}
+
+static struct zimage* alloc_zimage(int fd, int writable, uint32_t chunk_size, uint64_t size)
+{
+    struct zimage* z = calloc(1, sizeof(*z));
+    if (!z)
+        return NULL;
+
+    z->fd = fd;
+    z->writable = writable;
+    z->chunk_size = chunk_size;
+    z->size = size;
+    z->chunks = (size + chunk_size - 1) / chunk_size;
+    z->zbuf_size = compressBound(chunk_size);
+    z->index = calloc(z->chunks ? z->chunks : 1, sizeof(struct zentry));
+    z->zbuf = malloc(z->zbuf_size);
+    pthread_mutex_init(&z->lock, NULL);
+
+    for (int i = 0; i < CACHE_SLOTS; ++i) {
+        z->cache[i].chunk = UINT64_MAX;
+        z->cache[i].data = malloc(chunk_size);
+        if (!z->cache[i].data)
+            goto fail;
+    }
+
+    if (!z->index || !z->zbuf)
+        goto fail;
+
+    return z;
+
+fail:
+    zimage_close(z);
+    return NULL;
+}
+
+struct zimage* zimage_open(int fd, int writable, uint64_t* size)
+{
+    uint8_t header[HEADER_SIZE];
+
+    if (pread_all(fd, header, sizeof(header), 0) != 0 || memcmp(header, ZIMAGE_MAGIC, 8) != 0)
+        return NULL;
+
+    uint32_t chunk_size = le32(&header[8]);
+    uint64_t image_size = le64(&header[16]);
+    uint64_t index_offset = le64(&header[24]);
+    uint64_t chunks = le64(&header[32]);
+
+    if (chunk_size < SECTOR_SIZE || chunk_size % SECTOR_SIZE != 0
+        || chunks != (image_size + chunk_size - 1) / chunk_size) {
+        fprintf(stderr, "Corrupt compressed image header\n");
+        return NULL;
+    }
+
+    struct zimage* z = alloc_zimage(fd, writable, chunk_size, image_size);
+    if (!z)
+        return NULL;
+
+    uint8_t* raw = malloc(chunks * ENTRY_SIZE + 1);
+    if (!raw || pread_all(fd, raw, chunks * ENTRY_SIZE, index_offset) != 0) {
+        fprintf(stderr, "Can't read compressed image index\n");
+        free(raw);
+        zimage_close(z);
+        return NULL;
+    }
+
+    for (uint64_t i = 0; i < chunks; ++i) {
+        z->index[i].offset = le64(&raw[i * ENTRY_SIZE]);
+        z->index[i].length = le32(&raw[i * ENTRY_SIZE + 8]);
+        z->index[i].flags = le32(&raw[i * ENTRY_SIZE + 12]);
+    }
+    free(raw);
+
+    struct stat st;
+    fstat(fd, &st);
+    z->end = st.st_size;
+    z->index_at.offset = index_offset;
+    z->index_at.length = chunks * ENTRY_SIZE;
+
+    if (writable && find_free(z) != 0) {
+        zimage_close(z);
+        return NULL;
+    }
+
+    *size = image_size;
+    return z;
+}
+
+struct zimage* zimage_create(int fd, uint64_t size, uint32_t chunk_size)
+{
+    if (ftruncate(fd, 0) != 0)
+        return NULL;
+
+    struct zimage* z = alloc_zimage(fd, 1, chunk_size, size);
+    if (!z)
+        return NULL;
+
+    // all chunks start out as zero chunks
+    z->end = HEADER_SIZE;
+    z->index_dirty = 1;
+
+    return z;
+}
+
+static int load_chunk(struct zimage* z, uint64_t chunk, uint8_t* data)
+{
+    const struct zentry* e = &z->index[chunk];
+
+    if (e->length == 0) {
+        memset(data, 0, z->chunk_size);
+        return 0;
+    }
+
+    if (e->flags & FLAG_STORED)
+        return e->length == z->chunk_size ? pread_all(z->fd, data, z->chunk_size, e->offset) : -1;
+
+    if (e->length > z->zbuf_size || pread_all(z->fd, z->zbuf, e->length, e->offset) != 0)
+        return -1;
+
+    uLongf len = z->chunk_size;
+    if (uncompress(data, &len, z->zbuf, e->length) != Z_OK || len != z->chunk_size) {
+        fprintf(stderr, "Corrupt chunk #%llu\n", (unsigned long long)chunk);
+        return -1;
+    }
+
+    return 0;
+}
+
+static int is_zero(const uint8_t* data, size_t len)
+{
+    const uint64_t* p = (const uint64_t*)data;
+
+    for (size_t i = 0; i < len / sizeof(*p); ++i)
+        if (p[i])
+            return 0;
+
+    return 1;
+}
+
+static int store_chunk(struct zimage* z, uint64_t chunk, const uint8_t* data)
+{
+    struct zentry* e = &z->index[chunk];
+
+    z->index_dirty = 1;
+    space_add(&z->released, e->offset, e->length);
+
+    if (is_zero(data, z->chunk_size)) {
+        e->offset = 0;
+        e->length = 0;
+        e->flags = 0;
+        return 0;
+    }
+
+    uLongf len = z->zbuf_size;
+    const uint8_t* src = z->zbuf;
+    e->flags = 0;
+    if (compress2(z->zbuf, &len, data, z->chunk_size, Z_BEST_SPEED) != Z_OK || len >= z->chunk_size) {
+        src = data;
+        len = z->chunk_size;
+        e->flags = FLAG_STORED;
+    }
+
+    uint64_t offset = space_take(z, len);
+    if (pwrite_all(z->fd, src, len, offset) != 0)
+        return -1;
+
+    e->offset = offset;
+    e->length = len;
+
+    return 0;
+}
+
+static struct zslot* get_slot(struct zimage* z, uint64_t chunk, int load)
+{
+    struct zslot* victim = &z->cache[0];
+
+    for (int i = 0; i < CACHE_SLOTS; ++i) {
+        struct zslot* slot = &z->cache[i];
+        if (slot->chunk == chunk) {
+            slot->used = ++z->tick;
+            return slot;
+        }
+        if (slot->used < victim->used)
+            victim = slot;
+    }
+
+    if (victim->dirty && store_chunk(z, victim->chunk, victim->data) != 0)
+        return NULL;
+
+    victim->chunk = UINT64_MAX;
+    victim->dirty = 0;
+
+    if (load && load_chunk(z, chunk, victim->data) != 0)
+        return NULL;
+
+    victim->chunk = chunk;
+    victim->used = ++z->tick;
+    return victim;
+}
+
+int zimage_read(struct zimage* z, void* buf, size_t len, uint64_t offset)
+{
+    uint8_t* p = buf;
+    int ret = 0;
+
+    if (offset + len > z->size)
+        return -1;
+
+    pthread_mutex_lock(&z->lock);
+    while (len > 0) {
+        uint64_t chunk = offset / z->chunk_size;
+        uint32_t pos = offset % z->chunk_size;
+        size_t n = min((size_t)(z->chunk_size - pos), len);
+
+        struct zslot* slot = get_slot(z, chunk, 1);
+        if (!slot) {
+            ret = -1;
+            break;
+        }
+
+        memcpy(p, slot->data + pos, n);
+        p += n;
+        len -= n;
+        offset += n;
+    }
+    pthread_mutex_unlock(&z->lock);
+
+    return ret;
+}
+
+int zimage_write(struct zimage* z, const void* buf, size_t len, uint64_t offset)
+{
+    const uint8_t* p = buf;
+    int ret = 0;
+
+    if (!z->writable || offset + len > z->size)
+        return -1;
+
+    pthread_mutex_lock(&z->lock);
+    while (len > 0) {
+        uint64_t chunk = offset / z->chunk_size;
+        uint32_t pos = offset % z->chunk_size;
+        size_t n = min((size_t)(z->chunk_size - pos), len);
+
+        // a chunk that is overwritten completely needn't be decompressed first
+        struct zslot* slot = get_slot(z, chunk, n != z->chunk_size);
+        if (!slot) {
+            ret = -1;
+            break;
+        }
+
+        memcpy(slot->data + pos, p, n);
+        slot->dirty = 1;
+        p += n;
+        len -= n;
+        offset += n;
+    }
+    pthread_mutex_unlock(&z->lock);
+
+    return ret;
+}
+
+int zimage_zero(struct zimage* z, uint64_t offset, uint64_t len)
+{
+    static const uint8_t zero[SECTOR_SIZE];
+
+    if (!z->writable || offset + len > z->size)
+        return -1;
+
+    while (len > 0) {
+        uint64_t chunk = offset / z->chunk_size;
+        uint32_t pos = offset % z->chunk_size;
+        uint64_t n = min((uint64_t)(z->chunk_size - pos), len);
+
+        if (n == z->chunk_size) {
+            // whole chunk: drop it from the cache and turn it into a zero chunk
+            pthread_mutex_lock(&z->lock);
+            for (int i = 0; i < CACHE_SLOTS; ++i) {
+                if (z->cache[i].chunk == chunk) {
+                    z->cache[i].chunk = UINT64_MAX;
+                    z->cache[i].dirty = 0;
+                    z->cache[i].used = 0;
+                }
+            }
+            space_add(&z->released, z->index[chunk].offset, z->index[chunk].length);
+            z->index[chunk].offset = 0;
+            z->index[chunk].length = 0;
+            z->index[chunk].flags = 0;
+            z->index_dirty = 1;
+            pthread_mutex_unlock(&z->lock);
+        } else {
+            for (uint64_t done = 0; done < n; ) {
+                size_t part = min((uint64_t)sizeof(zero), n - done);
+                if (zimage_write(z, zero, part, offset + done) != 0)
+                    return -1;
+                done += part;
+            }
+        }
+
+        offset += n;
+        len -= n;
+    }
+
+    return 0;
+}
+
+int zimage_flush(struct zimage* z)
+{
+    int ret = 0;
+
+    pthread_mutex_lock(&z->lock);
+
+    for (int i = 0; i < CACHE_SLOTS && ret == 0; ++i) {
+        struct zslot* slot = &z->cache[i];
+        if (slot->dirty) {
+            ret = store_chunk(z, slot->chunk, slot->data);
+            slot->dirty = 0;
+        }
+    }
+
+    if (ret == 0 && z->index_dirty) {
+        uint8_t* raw = malloc(z->chunks * ENTRY_SIZE + 1);
+        uint8_t header[HEADER_SIZE] = {};
+
+        if (!raw) {
+            ret = -1;
+        } else {
+            for (uint64_t i = 0; i < z->chunks; ++i) {
+                set_le64(&raw[i * ENTRY_SIZE], z->index[i].offset);
+                set_le32(&raw[i * ENTRY_SIZE + 8], z->index[i].length);
+                set_le32(&raw[i * ENTRY_SIZE + 12], z->index[i].flags);
+            }
+
+            struct zextent index_at = { space_take(z, z->chunks * ENTRY_SIZE), z->chunks * ENTRY_SIZE };
+
+            memcpy(header, ZIMAGE_MAGIC, 8);
+            set_le32(&header[8], z->chunk_size);
+            set_le64(&header[16], z->size);
+            set_le64(&header[24], index_at.offset);
+            set_le64(&header[32], z->chunks);
+
+            // new data and index only in space the old index doesn't use, header last:
+            // the old index stays valid until then
+            ret = pwrite_all(z->fd, raw, index_at.length, index_at.offset);
+            if (ret == 0)
+                ret = fdatasync(z->fd);
+            if (ret == 0)
+                ret = pwrite_all(z->fd, header, sizeof(header), 0);
+            if (ret == 0) {
+                z->index_dirty = 0;
+                space_add(&z->free, z->index_at.offset, z->index_at.length);
+                z->index_at = index_at;
+                for (size_t i = 0; i < z->released.count; ++i)
+                    space_add(&z->free, z->released.e[i].offset, z->released.e[i].length);
+                z->released.count = 0;
+
+                // nothing to keep at the end of the file
+                struct zextent* last = z->free.count ? &z->free.e[z->free.count - 1] : NULL;
+                if (last && last->offset + last->length >= z->end && ftruncate(z->fd, last->offset) == 0) {
+                    z->end = last->offset;
+                    z->free.count--;
+                }
+            }
+            free(raw);
+        }
+    }
+
+    pthread_mutex_unlock(&z->lock);
+    return ret;
+}
+
+void zimage_close(struct zimage* z)
+{
+    if (!z)
+        return;
+
+    if (z->writable && zimage_flush(z) != 0)
+        fprintf(stderr, "Can't write compressed image\n");
+
+    for (int i = 0; i < CACHE_SLOTS; ++i)
+        free(z->cache[i].data);
+    free(z->index);
+    free(z->free.e);
+    free(z->released.e);
+    free(z->zbuf);
+    pthread_mutex_destroy(&z->lock);
+    free(z);
+}
+
+void zimage_stats(struct zimage* z, uint64_t* chunks, uint64_t* zero_chunks, uint64_t* stored_bytes)
+{
+    *chunks = z->chunks;
+    *zero_chunks = 0;
+    *stored_bytes = 0;
+
+    for (uint64_t i = 0; i < z->chunks; ++i) {
+        if (z->index[i].length == 0)
+            (*zero_chunks)++;
+        *stored_bytes += z->index[i].length;
+    }
+}
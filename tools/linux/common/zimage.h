@@ -0,0 +1,35 @@
+#ifndef ZIMAGE_H_
+#define ZIMAGE_H_
+
+// Chunked, randomly accessible compressed disk images.
+//
+// Layout (little-endian):
+//   header  "ATZIMG01", chunk size (4), reserved (4), image size (8), index offset (8), chunks (8)
+//   chunks  zlib streams (or stored as is if they don't compress), in any order
+//   index   per chunk: file offset (8), length (4), flags (4); length 0 is an all-zero chunk
+//
+// Modified chunks and a new index are written on flush, into space the current index
+// doesn't use (replaced chunks, old indexes) or appended; the header is updated last.
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define ZIMAGE_MAGIC      "ATZIMG01"
+#define ZIMAGE_CHUNK_SIZE (64 * 1024)
+
+struct zimage;
+
+int  zimage_probe(int fd);
+struct zimage* zimage_open(int fd, int writable, uint64_t* size);
+struct zimage* zimage_create(int fd, uint64_t size, uint32_t chunk_size);
+int  zimage_flush(struct zimage* z);
+void zimage_close(struct zimage* z);
+
+int zimage_read(struct zimage* z, void* buf, size_t len, uint64_t offset);
+int zimage_write(struct zimage* z, const void* buf, size_t len, uint64_t offset);
+int zimage_zero(struct zimage* z, uint64_t offset, uint64_t len);
+
+// chunks stored / all-zero, bytes used by chunk data
+void zimage_stats(struct zimage* z, uint64_t* chunks, uint64_t* zero_chunks, uint64_t* stored_bytes);
+
+#endif
@@ -0,0 +1,545 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "fat16.h"
+#include "partition.h"
+
+#define MOVE_SIZE (4 * 1024 * 1024)
+#define ROOT ((uint32_t)-1)
+#define HOLES 64
+
+#define min(a,b) \
+   ({ __typeof__ (a) _a = (a); \
+       __typeof__ (b) _b = (b); \
+     _a < _b ? _a : _b; })
+
+// a file or directory with at least one cluster
+struct object {
+    uint32_t start;     /* current first cluster */
+    uint32_t length;    /* in clusters */
+    uint32_t target;    /* first cluster after defragmentation */
+    uint32_t parent;    /* object index of the directory, ROOT for the root directory */
+    int      dir;
+};
+
+struct defrag {
+    struct fat16_volume vol;
+    int dry_run;
+
+    struct object* objects;
+    uint32_t count;
+
+    uint32_t* owner;    /* cluster -> object index + 1, 0 if unused */
+    uint32_t* source;   /* target cluster -> original cluster it receives, 0 if none */
+    uint32_t* where;    /* original cluster -> cluster currently holding its data */
+    uint32_t* holds;    /* cluster -> original cluster whose data it holds, 0 if none */
+
+    uint8_t* buf_a;
+    uint8_t* buf_b;
+
+    uint32_t fragmented;
+    uint32_t split;     /* still fragmented by bad clusters afterwards */
+    uint32_t moves;
+    uint64_t bytes;
+    uint32_t end;       /* last used cluster after defragmentation */
+};
+
+static void print_help(const char* name)
+{
+    fprintf(stderr, "Usage: %s [-n] <disk image> [offset]\n", name);
+    fprintf(stderr, "\n");
+    fprintf(stderr, "Makes all files and directories of the FAT16 volumes\n");
+    fprintf(stderr, "(including those inside ATonce images) contiguous and\n");
+    fprintf(stderr, "packs them towards the start of each volume, keeping\n");
+    fprintf(stderr, "their order on disk. <offset> restricts this to the\n");
+    fprintf(stderr, "volume whose boot sector is at that byte offset.\n");
+    fprintf(stderr, "Interrupting it leaves the volume inconsistent.\n");
+    fprintf(stderr, "  -n: only report what would be done\n");
+}
+
+static int add_object(struct defrag* d, uint32_t start, uint32_t parent, int dir)
+{
+    struct fat16_volume* vol = &d->vol;
+
+    uint32_t length = fat16_chain_length(vol, start);
+    if (length == 0) {
+        fprintf(stderr, "Broken cluster chain at cluster %u\n", start);
+        return -1;
+    }
+
+    // claim the chain, a second claim means cross-linked files
+    uint32_t runs = 0;
+    for (uint32_t cluster = start; cluster < FAT16_EOC; cluster = vol->fat[cluster]) {
+        if (d->owner[cluster] != 0) {
+            fprintf(stderr, "Cluster %u is cross-linked\n", cluster);
+            return -1;
+        }
+        d->owner[cluster] = d->count + 1;
+        if (vol->fat[cluster] != cluster + 1)
+            runs++;
+    }
+
+    if (runs > 1)
+        d->fragmented++;
+
+    struct object* obj = &d->objects[d->count++];
+    obj->start = start;
+    obj->length = length;
+    obj->parent = parent;
+    obj->dir = dir;
+    return 0;
+}
+
+// collect all files and directories, breadth first; the objects array doubles as the queue
+static int collect(struct defrag* d)
+{
+    struct fat16_volume* vol = &d->vol;
+
+    for (uint32_t i = ROOT; i == ROOT || i < d->count; ++i) {
+        if (i != ROOT && !d->objects[i].dir)
+            continue;
+
+        struct fat16_dirent* entries;
+        size_t count;
+        if (fat16_read_dir(vol, i == ROOT ? 0 : d->objects[i].start, &entries, &count) != 0) {
+            fprintf(stderr, "Can't read directory\n");
+            return -1;
+        }
+
+        int ret = 0;
+        for (size_t j = 0; j < count && entries[j].name[0] != 0x00 && ret == 0; ++j) {
+            uint32_t start = le16(entries[j].start);
+            if (!fat16_dirent_used(&entries[j]) || entries[j].name[0] == '.' || start == 0)
+                continue;
+
+            if (!fat16_valid_cluster(vol, start)) {
+                fprintf(stderr, "Invalid start cluster %u\n", start);
+                ret = -1;
+            } else {
+                ret = add_object(d, start, i, entries[j].attr & ATTR_DIR);
+            }
+        }
+
+        free(entries);
+        if (ret != 0)
+            return -1;
+    }
+
+    uint32_t lost = 0;
+    for (uint32_t cluster = FAT16_FIRST_CLUSTER; cluster < vol->clusters + 2; ++cluster) {
+        if (vol->fat[cluster] != FAT16_FREE && vol->fat[cluster] != FAT16_BAD && d->owner[cluster] == 0)
+            lost++;
+    }
+
+    if (lost > 0) {
+        fprintf(stderr, "%u lost clusters, check the volume first\n", lost);
+        return -1;
+    }
+
+    return 0;
+}
+
+// first run of length clusters without a bad one at or after cluster, 0 if there is none
+static uint32_t fit(const struct fat16_volume* vol, uint32_t cluster, uint32_t length)
+{
+    uint32_t n = 0;
+
+    while (n < length && cluster + n < vol->clusters + 2) {
+        if (vol->fat[cluster + n] == FAT16_BAD) {
+            cluster += n + 1;
+            n = 0;
+        } else {
+            n++;
+        }
+    }
+
+    return n == length ? cluster : 0;
+}
+
+static uint32_t good_clusters(const struct fat16_volume* vol, uint32_t cluster)
+{
+    uint32_t count = 0;
+
+    for (; cluster < vol->clusters + 2; ++cluster)
+        if (vol->fat[cluster] != FAT16_BAD)
+            count++;
+
+    return count;
+}
+
+// assign the new locations: everything in its current order (so a
+// packed prefix stays where it is), back to back, skipping bad clusters
+static void plan(struct defrag* d)
+{
+    struct fat16_volume* vol = &d->vol;
+    uint32_t next = FAT16_FIRST_CLUSTER;
+
+    // left in front of bad clusters, filled with later objects that fit
+    uint32_t hole_start[HOLES];
+    uint32_t hole_length[HOLES];
+    int holes = 0;
+
+    uint32_t remaining = 0;
+    for (uint32_t i = 0; i < d->count; ++i)
+        remaining += d->objects[i].length;
+
+    d->end = 0;
+    for (uint32_t start = FAT16_FIRST_CLUSTER; start < vol->clusters + 2; ++start) {
+        if (d->owner[start] == 0 || d->objects[d->owner[start] - 1].start != start)
+            continue;
+
+        struct object* obj = &d->objects[d->owner[start] - 1];
+        uint32_t cluster = start;
+        remaining -= obj->length;
+
+        int hole = 0;
+        while (hole < holes && hole_length[hole] < obj->length)
+            hole++;
+        if (hole < holes) {
+            obj->target = hole_start[hole];
+            for (uint32_t n = 0; n < obj->length; ++n) {
+                d->source[hole_start[hole] + n] = cluster;
+                cluster = vol->fat[cluster];
+            }
+            hole_start[hole] += obj->length;
+            hole_length[hole] -= obj->length;
+            continue;
+        }
+
+        // an object that would straddle a bad cluster starts behind it instead,
+        // unless that leaves too little room for the rest
+        while (vol->fat[next] == FAT16_BAD)
+            next++;
+        uint32_t at = fit(vol, next, obj->length);
+        if (at != next) {
+            if (at != 0 && good_clusters(vol, at) >= remaining + obj->length) {
+                uint32_t length = 0;
+                while (vol->fat[next + length] != FAT16_BAD)
+                    length++;
+                if (holes < HOLES && length > 0) {
+                    hole_start[holes] = next;
+                    hole_length[holes++] = length;
+                }
+                next = at;
+            } else {
+                d->split++;
+            }
+        }
+
+        for (uint32_t n = 0; n < obj->length; ++n) {
+            while (vol->fat[next] == FAT16_BAD)
+                next++;
+            if (n == 0)
+                obj->target = next;
+            d->source[next] = cluster;
+            d->end = next++;
+            cluster = vol->fat[cluster];
+        }
+    }
+}
+
+static int copy_clusters(struct defrag* d, uint8_t* buf, uint32_t from, uint32_t count, int write)
+{
+    struct fat16_volume* vol = &d->vol;
+    size_t len = (size_t)count * vol->cluster_size;
+    uint64_t offset = fat16_cluster_offset(vol, from);
+
+    if (d->dry_run)
+        return 0;
+
+    if (write ? image_write(vol->img, buf, len, offset) : image_read(vol->img, buf, len, offset)) {
+        fprintf(stderr, "Can't %s clusters %u-%u\n", write ? "write" : "read", from, from + count - 1);
+        return -1;
+    }
+
+    return 0;
+}
+
+// Fill the target clusters in ascending order. The data for a run of
+// targets is moved there in one go and whatever occupied those clusters
+// swaps places with it; it has not reached its target yet and will be
+// moved again later. Everything below the current target is final,
+// except the clusters left out in front of bad ones, so the source lies
+// above it or in one of those. When the gap up to a source above is
+// free, the run may overlap its source and is simply shifted down.
+static int move_data(struct defrag* d)
+{
+    struct fat16_volume* vol = &d->vol;
+    uint32_t max = MOVE_SIZE / vol->cluster_size;
+
+    for (uint32_t cluster = FAT16_FIRST_CLUSTER; cluster < vol->clusters + 2; ++cluster) {
+        d->where[cluster] = cluster;
+        d->holds[cluster] = d->owner[cluster] ? cluster : 0;
+    }
+
+    for (uint32_t p = FAT16_FIRST_CLUSTER; p <= d->end; ) {
+        if (d->source[p] == 0 || d->where[d->source[p]] == p) {
+            p++;
+            continue;
+        }
+
+        // a source below may only be swapped, without overlapping the targets
+        uint32_t w = d->where[d->source[p]];
+        int below = w < p;
+        uint32_t gap = below ? p - w : w - p;
+
+        int shift = !below;
+        for (uint32_t i = 0; i < min(gap, max) && p + i < vol->clusters + 2 && shift; ++i)
+            shift = d->holds[p + i] == 0;
+
+        uint32_t n = 1;
+        while (n < max && (shift || n < gap) && p + n <= d->end
+            && d->source[p + n] != 0 && d->where[d->source[p + n]] == w + n)
+            n++;
+
+        // only the occupied part of the destination needs to be saved
+        uint32_t first = n;
+        uint32_t last = 0;
+        for (uint32_t i = 0; i < n && !shift; ++i) {
+            if (d->holds[p + i]) {
+                first = min(first, i);
+                last = i;
+            }
+        }
+
+        if (first < n && copy_clusters(d, d->buf_a, p + first, last - first + 1, 0) != 0)
+            return -1;
+        if (copy_clusters(d, d->buf_b, w, n, 0) != 0 || copy_clusters(d, d->buf_b, p, n, 1) != 0)
+            return -1;
+        if (first < n && copy_clusters(d, d->buf_a, w + first, last - first + 1, 1) != 0)
+            return -1;
+
+        d->moves++;
+        d->bytes += (uint64_t)n * vol->cluster_size;
+        if (first < n)
+            d->bytes += (uint64_t)(last - first + 1) * vol->cluster_size;
+
+        for (uint32_t i = 0; i < n; ++i) {
+            uint32_t evicted = shift ? 0 : d->holds[p + i];
+            if (evicted)
+                d->where[evicted] = w + i;
+            d->holds[w + i] = evicted;
+        }
+        for (uint32_t i = 0; i < n; ++i) {
+            d->holds[p + i] = d->source[p + i];
+            d->where[d->source[p + i]] = p + i;
+        }
+
+        p += n;
+    }
+
+    return 0;
+}
+
+// chain every object along its targets and free everything else
+static void rebuild_fat(struct defrag* d)
+{
+    struct fat16_volume* vol = &d->vol;
+
+    for (uint32_t cluster = FAT16_FIRST_CLUSTER; cluster < vol->clusters + 2; ++cluster) {
+        uint32_t next = FAT16_FREE;
+        if (vol->fat[cluster] == FAT16_BAD)
+            continue;
+
+        if (d->source[cluster] != 0) {
+            next = 0xffff;
+            uint32_t obj = d->owner[d->source[cluster]];
+            for (uint32_t c = cluster + 1; c <= d->end; ++c) {
+                if (d->source[c] != 0) {
+                    if (d->owner[d->source[c]] == obj)
+                        next = c;
+                    break;
+                }
+            }
+        }
+
+        if (vol->fat[cluster] != next)
+            fat16_set(vol, cluster, next);
+    }
+}
+
+static int update_dir(struct defrag* d, uint32_t dir)
+{
+    struct fat16_volume* vol = &d->vol;
+    uint32_t start = dir == ROOT ? 0 : d->objects[dir].target;
+    uint32_t parent = dir == ROOT || d->objects[dir].parent == ROOT ? 0 : d->objects[d->objects[dir].parent].target;
+
+    struct fat16_dirent* entries;
+    size_t count;
+    if (fat16_read_dir(vol, start, &entries, &count) != 0) {
+        fprintf(stderr, "Can't read directory\n");
+        return -1;
+    }
+
+    int changed = 0;
+    for (size_t j = 0; j < count && entries[j].name[0] != 0x00; ++j) {
+        uint32_t value = le16(entries[j].start);
+
+        if (dir != ROOT && memcmp(entries[j].name, ".       ", 8) == 0)
+            value = start;
+        else if (dir != ROOT && memcmp(entries[j].name, "..      ", 8) == 0)
+            value = parent;
+        else if (fat16_dirent_used(&entries[j]) && value != 0 && d->owner[value] != 0)
+            value = d->objects[d->owner[value] - 1].target;
+
+        if (value != le16(entries[j].start)) {
+            set_le16(entries[j].start, value);
+            changed = 1;
+        }
+    }
+
+    int ret = 0;
+    if (changed && fat16_write_dir(vol, start, entries, count) != 0) {
+        fprintf(stderr, "Can't write directory\n");
+        ret = -1;
+    }
+
+    free(entries);
+    return ret;
+}
+
+static int defrag_volume(struct defrag* d)
+{
+    struct fat16_volume* vol = &d->vol;
+    size_t size = (vol->clusters + 2) * sizeof(uint32_t);
+
+    d->objects = malloc((vol->clusters + 2) * sizeof(d->objects[0]));
+    d->owner = calloc(1, size);
+    d->source = calloc(1, size);
+    d->where = calloc(1, size);
+    d->holds = calloc(1, size);
+    d->buf_a = malloc(MOVE_SIZE);
+    d->buf_b = malloc(MOVE_SIZE);
+    if (!d->objects || !d->owner || !d->source || !d->where || !d->holds || !d->buf_a || !d->buf_b) {
+        fprintf(stderr, "Out of memory\n");
+        return -1;
+    }
+
+    if (collect(d) != 0)
+        return -1;
+
+    plan(d);
+
+    if (move_data(d) != 0)
+        return -1;
+
+    if (d->dry_run || d->moves == 0)
+        return 0;
+
+    // the directory contents are in their new place, so is the FAT in memory
+    rebuild_fat(d);
+
+    // the start clusters in the directories still refer to the old locations
+    int ret = update_dir(d, ROOT);
+    for (uint32_t i = 0; i < d->count && ret == 0; ++i) {
+        if (d->objects[i].dir)
+            ret = update_dir(d, i);
+    }
+
+    if (ret == 0 && fat16_flush_fat(vol) != 0) {
+        fprintf(stderr, "Can't write FAT\n");
+        ret = -1;
+    }
+
+    return ret;
+}
+
+static void free_defrag(struct defrag* d)
+{
+    free(d->objects);
+    free(d->owner);
+    free(d->source);
+    free(d->where);
+    free(d->holds);
+    free(d->buf_a);
+    free(d->buf_b);
+    fat16_close(&d->vol);
+}
+
+int main(int argc, char* argv[])
+{
+    int dry_run = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n")) != -1) {
+        switch (opt) {
+            case 'n':
+                dry_run = 1;
+                break;
+            default:
+                print_help(argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+
+    if (optind != argc - 1 && optind != argc - 2) {
+        print_help(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    int all = optind == argc - 1;
+    uint64_t offset = all ? 0 : strtoull(argv[optind + 1], NULL, 0);
+
+    struct image img;
+    if (image_open(&img, argv[optind], !dry_run) != 0)
+        return EXIT_FAILURE;
+
+    struct partition parts[PARTITIONS_MAX];
+    int count = partition_walk(&img, parts, PARTITIONS_MAX);
+
+    int ret = EXIT_SUCCESS;
+    int found = 0;
+
+    printf("Type Start      Sectors    Objects  Fragmented Moves    Bytes      Last sector\n");
+    printf("-------------------------------------------------------------------------------\n");
+    for (int i = 0; i < count; ++i) {
+        if (!partition_is_fat(&parts[i]) || (!all && parts[i].start * SECTOR_SIZE != offset))
+            continue;
+
+        found++;
+
+        char name[3+1];
+        partition_name(&parts[i], name);
+
+        struct defrag d = {};
+        d.dry_run = dry_run;
+        int open = fat16_open(&d.vol, &img, parts[i].start * SECTOR_SIZE);
+        if (open == FAT16_NOT_FAT16) {
+            printf("%-4s %-10llu %-10llu skipped, not FAT16\n", name, (unsigned long long)parts[i].start, (unsigned long long)parts[i].size);
+            continue;
+        }
+        if (open != 0 || defrag_volume(&d) != 0) {
+            printf("%-4s %-10llu %-10llu failed\n", name, (unsigned long long)parts[i].start, (unsigned long long)parts[i].size);
+            free_defrag(&d);
+            ret = EXIT_FAILURE;
+            continue;
+        }
+
+        // relative to the partition, where atn_fix could cut it off
+        uint64_t last = (fat16_cluster_offset(&d.vol, d.end + 1) - d.vol.offset) / SECTOR_SIZE - 1;
+        if (d.count == 0)
+            last = (d.vol.data_offset - d.vol.offset) / SECTOR_SIZE - 1;
+
+        printf("%-4s %-10llu %-10llu %-8u %-10u %-8u %-10llu %llu\n", name,
+            (unsigned long long)parts[i].start, (unsigned long long)parts[i].size,
+            d.count, d.fragmented, d.moves, (unsigned long long)d.bytes, (unsigned long long)last);
+        if (d.split > 0)
+            printf("     %u object(s) stay fragmented around bad clusters, there is no room behind them\n", d.split);
+        free_defrag(&d);
+    }
+
+    if (found == 0) {
+        fprintf(stderr, "No FAT16 volumes found\n");
+        ret = EXIT_FAILURE;
+    }
+
+    if (image_flush(&img) != 0) {
+        fprintf(stderr, "Can't write %s\n", argv[optind]);
+        ret = EXIT_FAILURE;
+    }
+    image_close(&img);
+    return ret;
+}
@@ -0,0 +1,224 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "fat16.h"
+
+#define DEPTH_MAX 32
+
+#define min(a,b) \
+   ({ __typeof__ (a) _a = (a); \
+       __typeof__ (b) _b = (b); \
+     _a < _b ? _a : _b; })
+
+static void print_help(const char* name)
+{
+    fprintf(stderr, "Usage: %s <disk image> <offset> ls [path]\n", name);
+    fprintf(stderr, "       %s <disk image> <offset> get <path> <destination>\n", name);
+    fprintf(stderr, "\n");
+    fprintf(stderr, "<offset> is the byte offset of the FAT16 boot sector\n");
+    fprintf(stderr, "(as printed by create_msdos_img.sh); <path> may be a\n");
+    fprintf(stderr, "file or a directory which is extracted recursively.\n");
+}
+
+static time_t dos_time(const struct fat16_dirent* de)
+{
+    uint16_t date = le16(de->date);
+    uint16_t time = le16(de->time);
+
+    struct tm tm = {};
+    tm.tm_year  = ((date >> 9) & 0x7f) + 80;
+    tm.tm_mon   = ((date >> 5) & 0x0f) - 1;
+    tm.tm_mday  = date & 0x1f;
+    tm.tm_hour  = (time >> 11) & 0x1f;
+    tm.tm_min   = (time >> 5) & 0x3f;
+    tm.tm_sec   = (time & 0x1f) * 2;
+    tm.tm_isdst = -1;
+
+    return mktime(&tm);
+}
+
+static uint32_t count_runs(const struct fat16_volume* vol, uint32_t cluster)
+{
+    uint32_t runs = 0;
+    uint32_t length = fat16_chain_length(vol, cluster);
+
+    while (length > 0) {
+        uint32_t run = min(fat16_run_length(vol, cluster), length);
+        length -= run;
+        cluster = vol->fat[cluster + run - 1];
+        runs++;
+    }
+
+    return runs;
+}
+
+static int list_dir(struct fat16_volume* vol, const struct fat16_dirent* dir)
+{
+    struct fat16_dirent* entries;
+    size_t count;
+
+    if (fat16_read_dir(vol, le16(dir->start), &entries, &count) != 0) {
+        fprintf(stderr, "Can't read directory\n");
+        return -1;
+    }
+
+    for (size_t i = 0; i < count && entries[i].name[0] != 0x00; ++i) {
+        const struct fat16_dirent* de = &entries[i];
+        if (!fat16_dirent_used(de))
+            continue;
+
+        char name[8+1+3+1];
+        fat16_dirent_name(de, name);
+
+        char date[16+1];
+        time_t t = dos_time(de);
+        strftime(date, sizeof(date), "%Y-%m-%d %H:%M", localtime(&t));
+
+        if (de->attr & ATTR_DIR)
+            printf("%-12s      <DIR> %s", name, date);
+        else
+            printf("%-12s %10u %s", name, le32(de->size), date);
+
+        uint16_t start = le16(de->start);
+        if (fat16_valid_cluster(vol, start))
+            printf("  cluster %5u (%u run%s)", start, count_runs(vol, start), count_runs(vol, start) == 1 ? "" : "s");
+        printf("\n");
+    }
+
+    free(entries);
+    return 0;
+}
+
+static int extract_file(struct fat16_volume* vol, const struct fat16_dirent* de, const char* dest)
+{
+    int fd = open(dest, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        fprintf(stderr, "%s: %s\n", dest, strerror(errno));
+        return -1;
+    }
+
+    uint32_t remaining = le32(de->size);
+    uint32_t cluster = le16(de->start);
+    uint32_t length = remaining ? fat16_chain_length(vol, cluster) : 0;
+
+    if (remaining > (uint64_t)length * vol->cluster_size) {
+        fprintf(stderr, "%s: broken cluster chain\n", dest);
+        close(fd);
+        return -1;
+    }
+
+    // one copy per contiguous cluster run, straight from the image into the file
+    while (remaining > 0) {
+        uint32_t run = fat16_run_length(vol, cluster);
+        uint32_t len = min((uint64_t)run * vol->cluster_size, (uint64_t)remaining);
+
+        if (image_copy_to_fd(vol->img, fat16_cluster_offset(vol, cluster), len, fd) != 0) {
+            fprintf(stderr, "%s: %s\n", dest, strerror(errno));
+            close(fd);
+            return -1;
+        }
+
+        remaining -= len;
+        cluster = vol->fat[cluster + run - 1];
+    }
+
+    close(fd);
+
+    struct timeval tv[2] = {};
+    tv[0].tv_sec = tv[1].tv_sec = dos_time(de);
+    utimes(dest, tv);
+
+    return 0;
+}
+
+static int extract(struct fat16_volume* vol, const struct fat16_dirent* de, const char* dest, int depth)
+{
+    if (!(de->attr & ATTR_DIR))
+        return extract_file(vol, de, dest);
+
+    if (depth > DEPTH_MAX) {
+        fprintf(stderr, "%s: directories nested too deep\n", dest);
+        return -1;
+    }
+
+    if (mkdir(dest, 0755) != 0 && errno != EEXIST) {
+        fprintf(stderr, "%s: %s\n", dest, strerror(errno));
+        return -1;
+    }
+
+    struct fat16_dirent* entries;
+    size_t count;
+    if (fat16_read_dir(vol, le16(de->start), &entries, &count) != 0) {
+        fprintf(stderr, "%s: can't read directory\n", dest);
+        return -1;
+    }
+
+    int ret = 0;
+    for (size_t i = 0; i < count && entries[i].name[0] != 0x00; ++i) {
+        if (!fat16_dirent_used(&entries[i]) || entries[i].name[0] == '.')
+            continue;
+
+        char name[8+1+3+1];
+        fat16_dirent_name(&entries[i], name);
+
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), "%s/%s", dest, name);
+        printf("%s\n", path);
+
+        ret |= extract(vol, &entries[i], path, depth + 1);
+    }
+
+    free(entries);
+    return ret;
+}
+
+int main(int argc, char* argv[])
+{
+    if (argc < 4) {
+        print_help(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    int cmd_ls = strcmp(argv[3], "ls") == 0 && argc <= 5;
+    int cmd_get = strcmp(argv[3], "get") == 0 && argc == 6;
+    if (!cmd_ls && !cmd_get) {
+        print_help(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    struct image img;
+    if (image_open(&img, argv[1], 0) != 0)
+        return EXIT_FAILURE;
+
+    uint64_t offset = strtoull(argv[2], NULL, 0);
+
+    struct fat16_volume vol;
+    if (fat16_open(&vol, &img, offset) != 0) {
+        image_close(&img);
+        return EXIT_FAILURE;
+    }
+
+    const char* path = argc >= 5 ? argv[4] : "/";
+    struct fat16_dirent de;
+    int ret = fat16_lookup(&vol, path, &de);
+    if (ret != 0)
+        fprintf(stderr, "%s: not found\n", path);
+    else if (cmd_ls)
+        ret = (de.attr & ATTR_DIR) ? list_dir(&vol, &de) : -1;
+    else
+        ret = extract(&vol, &de, argv[5], 0);
+
+    fat16_close(&vol);
+    image_close(&img);
+
+    return ret == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,630 @@
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "chs.h"
+#include "fat16.h"
+
+#define GRAIN        34     // sectors per track of mkdosfs -g 64/34, see cfdisk/alignment.patch
+#define HEADS        64
+#define FATS         2
+#define SPC_MAX      64     // 32 KiB clusters, the largest MS-DOS handles
+#define ROOT_ENTRIES 512
+#define MIX_MAX      16
+#define TOLERANCE    1.01   // amplification within 1% of the best counts as equal, then the smaller FAT wins
+#define BENCH_FILES  4096
+#define BENCH_FILL   0.5
+#define BENCH_DIR    64     // files per subdirectory
+#define BUFFERS      20     // BUFFERS= of CONFIG.SYS, sectors DOS caches for the FAT and directories
+
+// mkfs.fat's own FAT16 limits, slightly tighter than what fat16.h accepts
+#define MKFS_MIN_CLUSTERS 4086
+#define MKFS_MAX_CLUSTERS 65520
+
+#define DEFAULT_MIX "2k:40,16k:30,128k:20,1m:10"
+
+#define min(a,b) \
+   ({ __typeof__ (a) _a = (a); \
+       __typeof__ (b) _b = (b); \
+     _a < _b ? _a : _b; })
+
+struct mix {
+    uint64_t size;      /* bytes */
+    double weight;      /* share of the files */
+};
+
+struct layout {
+    int spc;
+    uint32_t res;
+    uint32_t dir;
+    uint32_t root_sectors;
+    uint32_t spf;
+    uint32_t clusters;
+    uint64_t data_start;    /* absolute, i.e. including hidden sectors */
+    int valid;
+
+    double ampl;        /* predicted bytes read per byte of file data */
+    double crossings;   /* predicted track (grain) crossings per file */
+};
+
+static struct mix mix[MIX_MAX];
+static int num_mix;
+
+static void print_help(const char* name)
+{
+    fprintf(stderr, "Usage: %s [-h hidden] [-r root entries] [-m mix] [-b|-o] <sectors>\n", name);
+    fprintf(stderr, "\n");
+    fprintf(stderr, "Chooses sectors per cluster, reserved sectors and root\n");
+    fprintf(stderr, "directory size of a FAT16 volume of <sectors> 512 byte\n");
+    fprintf(stderr, "sectors for mkdosfs -a -g %d/%d -h <hidden>, so that the\n", HEADS, GRAIN);
+    fprintf(stderr, "data area starts on a %d sector boundary and the predicted\n", GRAIN);
+    fprintf(stderr, "read amplification for the file size mix is lowest (the\n");
+    fprintf(stderr, "smallest FAT among those within 1%% of it).\n");
+    fprintf(stderr, "  -m: file size mix as size:share,... (default %s)\n", DEFAULT_MIX);
+    fprintf(stderr, "  -b: also measure on generated, aged volumes, reading the\n");
+    fprintf(stderr, "      files the way DOS does with BUFFERS=%d\n", BUFFERS);
+    fprintf(stderr, "  -o: only print the mkdosfs options\n");
+}
+
+static uint64_t parse_size(const char* s, char** end)
+{
+    uint64_t size = strtoull(s, end, 0);
+
+    switch (**end) {
+        case 'k': case 'K': size *= 1024; (*end)++; break;
+        case 'm': case 'M': size *= 1024 * 1024; (*end)++; break;
+    }
+
+    return size;
+}
+
+static int parse_mix(const char* s)
+{
+    num_mix = 0;
+    double total = 0;
+
+    while (*s && num_mix < MIX_MAX) {
+        char* end;
+        mix[num_mix].size = parse_size(s, &end);
+        if (*end != ':' || mix[num_mix].size == 0)
+            return -1;
+
+        mix[num_mix].weight = strtod(end + 1, &end);
+        if (mix[num_mix].weight <= 0 || (*end != ',' && *end != '\0'))
+            return -1;
+
+        total += mix[num_mix].weight;
+        num_mix++;
+        s = *end ? end + 1 : end;
+    }
+
+    for (int i = 0; i < num_mix; ++i)
+        mix[i].weight /= total;
+
+    return num_mix > 0 ? 0 : -1;
+}
+
+// the way mkfs.fat sizes the FAT (dosfstools setup_tables(), no alignment with -a)
+static void compute_layout(struct layout* l, uint64_t sectors, uint64_t hidden, int spc, uint32_t res, uint32_t dir)
+{
+    memset(l, 0, sizeof(*l));
+    l->spc = spc;
+    l->res = res;
+    l->dir = dir;
+    l->root_sectors = (dir * 32 + SECTOR_SIZE - 1) / SECTOR_SIZE;
+
+    if (sectors <= res + l->root_sectors)
+        return;
+
+    uint64_t fatdata = sectors - res - l->root_sectors;
+    uint64_t clusters = (fatdata * SECTOR_SIZE + FATS * 4) / (spc * SECTOR_SIZE + FATS * 2);
+    l->spf = ((clusters + 2) * 2 + SECTOR_SIZE - 1) / SECTOR_SIZE;
+
+    if (fatdata <= (uint64_t)FATS * l->spf)
+        return;
+
+    uint64_t max_clusters = (fatdata - FATS * l->spf) / spc;
+    if (clusters > max_clusters)
+        clusters = max_clusters;
+
+    l->clusters = clusters;
+    l->data_start = hidden + res + FATS * l->spf + l->root_sectors;
+    l->valid = clusters >= MKFS_MIN_CLUSTERS && clusters <= MKFS_MAX_CLUSTERS;
+}
+
+// Smallest extra space that puts the data area on the grain. Root directory
+// sectors are preferred over reserved ones, they at least hold entries.
+static int align_layout(struct layout* l, uint64_t sectors, uint64_t hidden, int spc, uint32_t dir)
+{
+    for (uint32_t extra = 0; extra < 2 * GRAIN; ++extra) {
+        for (uint32_t pad = extra + 1; pad-- > 0; ) {
+            compute_layout(l, sectors, hidden, spc, 1 + extra - pad, dir + pad * (SECTOR_SIZE / 32));
+            if (l->valid && l->data_start % GRAIN == 0)
+                return 0;
+        }
+    }
+
+    compute_layout(l, sectors, hidden, spc, 1, dir);
+    return -1;
+}
+
+// track boundaries strictly inside a run of len sectors starting at sector start
+static uint64_t grain_crossings(uint64_t start, uint64_t len)
+{
+    return len ? (start + len - 1) / GRAIN - start / GRAIN : 0;
+}
+
+// Expected cost of reading the files of the mix one after the other, each allocated
+// contiguously at a random cluster, the way DOS does (see read_file()): the sectors a
+// file covers, not the slack of its last cluster, plus the FAT and directory sectors
+// missing from BUFFERS. Those are read in order, so a FAT sector serves 256 clusters
+// and a directory sector 16 files before it is needed no more.
+static void predict(struct layout* l)
+{
+    uint64_t cluster_size = (uint64_t)l->spc * SECTOR_SIZE;
+    // cluster start positions repeat modulo the grain
+    int period = GRAIN;
+    double read = 0;
+    double useful = 0;
+
+    l->crossings = 0;
+
+    for (int i = 0; i < num_mix; ++i) {
+        uint64_t n = (mix[i].size + cluster_size - 1) / cluster_size;
+        uint64_t sectors = (mix[i].size + SECTOR_SIZE - 1) / SECTOR_SIZE;
+        double fat = (double)n * 2 / SECTOR_SIZE;
+        double dir = 32.0 / SECTOR_SIZE;
+        double crossings = 0;
+
+        for (int k = 0; k < period; ++k)
+            crossings += grain_crossings(l->data_start + (uint64_t)k * l->spc, sectors);
+        crossings /= period;
+
+        read += mix[i].weight * (sectors + fat + dir) * SECTOR_SIZE;
+        useful += mix[i].weight * mix[i].size;
+        l->crossings += mix[i].weight * crossings;
+    }
+
+    l->ampl = read / useful;
+}
+
+// next size of the mix, in exact proportions so the benchmark measures the mix the prediction assumes
+static uint64_t next_size(uint32_t* counts, int files)
+{
+    int next = 0;
+    double behind = -1e9;
+
+    for (int i = 0; i < num_mix; ++i) {
+        double d = mix[i].weight * (files + 1) - counts[i];
+        if (d > behind) {
+            behind = d;
+            next = i;
+        }
+    }
+
+    counts[next]++;
+    return mix[next].size;
+}
+
+static int format_volume(struct image* img, const struct layout* l, uint64_t sectors, uint64_t hidden)
+{
+    uint8_t sect[SECTOR_SIZE] = { 0xeb, 0x3c, 0x90, 'M', 'S', 'D', 'O', 'S', '5', '.', '0' };
+
+    set_le16(&sect[0x00b], SECTOR_SIZE);
+    sect[0x00d] = l->spc;
+    set_le16(&sect[0x00e], l->res);
+    sect[0x010] = FATS;
+    set_le16(&sect[0x011], l->dir);
+    if (sectors < 65536)
+        set_le16(&sect[0x013], sectors);
+    else
+        set_le32(&sect[0x020], sectors);
+    sect[0x015] = 0xf8;
+    set_le16(&sect[0x016], l->spf);
+    set_le16(&sect[0x018], GRAIN);
+    set_le16(&sect[0x01a], HEADS);
+    set_le32(&sect[0x01c], hidden);
+    sect[0x1fe] = 0x55;
+    sect[0x1ff] = 0xaa;
+
+    uint8_t media[4] = { 0xf8, 0xff, 0xff, 0xff };
+    int ret = image_write(img, sect, sizeof(sect), 0);
+    for (int i = 0; i < FATS && ret == 0; ++i)
+        ret = image_write(img, media, sizeof(media), ((uint64_t)l->res + (uint64_t)i * l->spf) * SECTOR_SIZE);
+
+    return ret;
+}
+
+// DOS's BUFFERS: an LRU cache of whole sectors, used for the FAT and directories only
+struct buffers {
+    uint64_t offset[BUFFERS];
+    uint64_t used[BUFFERS];   /* 0: empty */
+    uint64_t tick;
+    uint64_t misses;
+};
+
+struct bench_file {
+    uint32_t dir;       /* first cluster of its directory */
+    uint32_t dir_index; /* entry of that directory in the root directory */
+    uint32_t index;     /* entry in its directory */
+    uint32_t first;
+    uint64_t size;      /* 0: deleted */
+};
+
+static int buffered_read(struct image* img, struct buffers* b, uint64_t offset)
+{
+    int victim = 0;
+
+    for (int i = 0; i < BUFFERS; ++i) {
+        if (b->used[i] && b->offset[i] == offset) {
+            b->used[i] = ++b->tick;
+            return 0;
+        }
+        if (b->used[i] < b->used[victim])
+            victim = i;
+    }
+
+    uint8_t sect[SECTOR_SIZE];
+    b->offset[victim] = offset;
+    b->used[victim] = ++b->tick;
+    b->misses++;
+    return image_read(img, sect, sizeof(sect), offset);
+}
+
+static uint64_t fat_sector_offset(const struct fat16_volume* vol, uint32_t cluster)
+{
+    return vol->fat_offset + (uint64_t)cluster * 2 / SECTOR_SIZE * SECTOR_SIZE;
+}
+
+// DOS searches a directory sector by sector up to the entry, along its chain
+static int scan_dir(struct fat16_volume* vol, struct buffers* b, uint32_t cluster, uint32_t index)
+{
+    uint32_t per_cluster = vol->cluster_size / SECTOR_SIZE;
+    int ret = 0;
+
+    for (uint32_t s = 0; s <= index / (SECTOR_SIZE / 32) && ret == 0; ++s) {
+        if (cluster == 0) {
+            ret = buffered_read(vol->img, b, vol->root_offset + (uint64_t)s * SECTOR_SIZE);
+            continue;
+        }
+
+        if (s > 0 && s % per_cluster == 0) {
+            ret = buffered_read(vol->img, b, fat_sector_offset(vol, cluster));
+            cluster = vol->fat[cluster];
+        }
+        if (ret == 0)
+            ret = buffered_read(vol->img, b, fat16_cluster_offset(vol, cluster) + (uint64_t)(s % per_cluster) * SECTOR_SIZE);
+    }
+
+    return ret;
+}
+
+// Open and read a file: its directory's entry in the root directory, its own entry,
+// then the data sectors it covers (not the slack of its last cluster) straight into
+// the buffer, looking up every next cluster in the FAT.
+static int read_file(struct fat16_volume* vol, struct buffers* b, const struct bench_file* f, uint64_t hidden,
+    uint8_t* buf, uint64_t* sectors, uint64_t* crossed)
+{
+    int ret = scan_dir(vol, b, 0, f->dir_index);
+    if (ret == 0)
+        ret = scan_dir(vol, b, f->dir, f->index);
+
+    uint64_t left = (f->size + SECTOR_SIZE - 1) / SECTOR_SIZE;
+    uint64_t run_start = 0;
+    uint64_t run_len = 0;
+
+    for (uint32_t c = f->first; left > 0 && ret == 0; ) {
+        uint64_t offset = fat16_cluster_offset(vol, c);
+        uint64_t n = min(left, (uint64_t)vol->spc);
+        ret = image_read(vol->img, buf, n * SECTOR_SIZE, offset);
+        *sectors += n;
+        left -= n;
+
+        // track crossings per contiguous run, including those between its clusters
+        uint64_t sector = hidden + offset / SECTOR_SIZE;
+        if (run_len > 0 && run_start + run_len == sector) {
+            run_len += n;
+        } else {
+            *crossed += grain_crossings(run_start, run_len);
+            run_start = sector;
+            run_len = n;
+        }
+
+        if (left > 0 && ret == 0) {
+            ret = buffered_read(vol->img, b, fat_sector_offset(vol, c));
+            c = vol->fat[c];
+            if (ret == 0 && !fat16_valid_cluster(vol, c))
+                ret = -1;
+        }
+    }
+    *crossed += grain_crossings(run_start, run_len);
+
+    return ret;
+}
+
+static void set_dirent(struct fat16_dirent* de, const char* name, const char* ext, uint8_t attr, uint32_t start, uint64_t size)
+{
+    memset(de, 0, sizeof(*de));
+    memset(de->name, ' ', sizeof(de->name) + sizeof(de->ext));
+    memcpy(de->name, name, strlen(name));
+    memcpy(de->ext, ext, strlen(ext));
+    de->attr = attr;
+    set_le16(de->start, start);
+    set_le32(de->size, size);
+}
+
+// new subdirectory of the root directory with "." and ".."
+static int add_dir(struct fat16_volume* vol, uint32_t serial, uint8_t* buf, uint32_t* cluster)
+{
+    if (fat16_alloc(vol, 1, cluster) != 0)
+        return -1;
+
+    struct fat16_dirent* entries = (struct fat16_dirent*)buf;
+    memset(buf, 0, vol->cluster_size);
+    set_dirent(&entries[0], ".", "", ATTR_DIR, *cluster, 0);
+    set_dirent(&entries[1], "..", "", ATTR_DIR, 0, 0);
+
+    char name[8+1];
+    snprintf(name, sizeof(name), "D%07u", serial);
+    struct fat16_dirent de;
+    set_dirent(&de, name, "", ATTR_DIR, *cluster, 0);
+
+    if (image_write(vol->img, buf, vol->cluster_size, fat16_cluster_offset(vol, *cluster)) != 0
+        || fat16_add_dirent(vol, 0, &de) != 0) {
+        fat16_free_chain(vol, *cluster);
+        return -1;
+    }
+
+    return 0;
+}
+
+// file at the end of f's directory, or in f's (deleted) slot if replace is set
+static int add_file(struct fat16_volume* vol, struct bench_file* f, uint32_t serial, uint64_t size, int replace)
+{
+    uint32_t n = (size + vol->cluster_size - 1) / vol->cluster_size;
+    if (fat16_alloc(vol, n, &f->first) != 0)
+        return -1;
+
+    char name[8+1];
+    snprintf(name, sizeof(name), "F%07u", serial);
+    struct fat16_dirent de;
+    set_dirent(&de, name, "BIN", ATTR_ARCHIVE, f->first, size);
+
+    int ret = replace ? image_write(vol->img, &de, sizeof(de), fat16_dirent_offset(vol, f->dir, f->index))
+        : fat16_add_dirent(vol, f->dir, &de);
+    if (ret != 0) {
+        fat16_free_chain(vol, f->first);
+        return -1;
+    }
+
+    f->size = size;
+    return 0;
+}
+
+// Builds a volume of the layout that has been in use for a while: files of the mix
+// in subdirectories up to the fill level, then every third one replaced by a new
+// file of the mix (first fit, so these fragment). Then reads all files back in
+// directory order from a cold start the way DOS does and counts the sectors that
+// were transferred from the disk, with the FAT and directories going through BUFFERS.
+// Unlike predict(), this sees real allocation, partial last clusters and cache hits.
+static int benchmark(const struct layout* l, uint64_t sectors, uint64_t hidden, double* ampl, double* crossings)
+{
+    char path[] = "/tmp/fat_geomXXXXXX";
+    int fd = mkstemp(path);
+    if (fd < 0) {
+        fprintf(stderr, "Can't create benchmark image: %s\n", strerror(errno));
+        return -1;
+    }
+    close(fd);
+
+    struct image img;
+    int ret = image_open(&img, path, 1);
+    unlink(path);
+    if (ret != 0)
+        return -1;
+
+    struct bench_file* files = malloc(BENCH_FILES * sizeof(*files));
+    uint8_t* buf = malloc((size_t)l->spc * SECTOR_SIZE);
+    struct fat16_volume vol;
+    uint32_t count = 0;
+
+    uint32_t counts[MIX_MAX] = {};
+    ret = !files || !buf || ftruncate(img.fd, sectors * SECTOR_SIZE) != 0
+        || format_volume(&img, l, sectors, hidden) != 0 ? -1 : 0;
+    img.size = sectors * SECTOR_SIZE;
+
+    if (ret == 0 && (ret = fat16_open(&vol, &img, 0)) == 0) {
+        uint64_t used = 0;
+        uint32_t dir = 0;
+        uint32_t dirs = 0;
+
+        while (count < BENCH_FILES && used < vol.clusters * BENCH_FILL) {
+            if (count % BENCH_DIR == 0) {
+                if (dirs == l->dir || add_dir(&vol, dirs, buf, &dir) != 0)
+                    break;
+                dirs++;
+            }
+
+            struct bench_file* f = &files[count];
+            f->dir = dir;
+            f->dir_index = dirs - 1;
+            f->index = 2 + count % BENCH_DIR;
+            uint64_t size = next_size(counts, count);
+            if (add_file(&vol, f, count, size, 0) != 0)
+                break;
+            used += (size + vol.cluster_size - 1) / vol.cluster_size;
+            count++;
+        }
+
+        for (uint32_t i = 0; i < count; i += 3) {
+            fat16_free_chain(&vol, files[i].first);
+            files[i].size = 0;
+        }
+        for (uint32_t i = 0; i < count; i += 3) {
+            if (add_file(&vol, &files[i], count + i, next_size(counts, count + i / 3), 1) != 0) {
+                uint8_t deleted = 0xe5;
+                image_write(&img, &deleted, 1, fat16_dirent_offset(&vol, files[i].dir, files[i].index));
+            }
+        }
+
+        ret = fat16_flush_fat(&vol);
+        fat16_close(&vol);
+    }
+
+    uint64_t useful = 0;
+    uint64_t transferred = 0;
+    uint64_t crossed = 0;
+    uint32_t read = 0;
+
+    // fresh FAT from the image, like a cold start
+    if (ret == 0 && (ret = fat16_open(&vol, &img, 0)) == 0) {
+        struct buffers b = {};
+
+        for (uint32_t i = 0; i < count && ret == 0; ++i) {
+            if (files[i].size == 0)
+                continue;
+            ret = read_file(&vol, &b, &files[i], hidden, buf, &transferred, &crossed);
+            useful += files[i].size;
+            read++;
+        }
+        transferred += b.misses;
+        fat16_close(&vol);
+    }
+
+    if (ret == 0 && read > 0) {
+        *ampl = (double)transferred * SECTOR_SIZE / useful;
+        *crossings = (double)crossed / read;
+    }
+
+    free(buf);
+    free(files);
+    image_close(&img);
+    return ret == 0 && read > 0 ? 0 : -1;
+}
+
+int main(int argc, char* argv[])
+{
+    uint64_t hidden = 0;
+    uint32_t dir = ROOT_ENTRIES;
+    int bench = 0;
+    int options_only = 0;
+    int opt;
+
+    if (parse_mix(DEFAULT_MIX) != 0)
+        return EXIT_FAILURE;
+
+    while ((opt = getopt(argc, argv, "h:r:m:bo")) != -1) {
+        switch (opt) {
+            case 'h':
+                hidden = strtoull(optarg, NULL, 0);
+                break;
+            case 'r':
+                // whole directory sectors
+                dir = (strtoul(optarg, NULL, 0) + 15) & ~15UL;
+                break;
+            case 'm':
+                if (parse_mix(optarg) != 0) {
+                    fprintf(stderr, "Invalid file size mix: %s\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'b':
+                bench = 1;
+                break;
+            case 'o':
+                options_only = 1;
+                break;
+            default:
+                print_help(argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+
+    if (optind != argc - 1 || dir == 0) {
+        print_help(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    uint64_t sectors = strtoull(argv[optind], NULL, 0);
+    if (sectors == 0) {
+        fprintf(stderr, "%s can't be converted to a number\n", argv[optind]);
+        return EXIT_FAILURE;
+    }
+
+    struct layout layouts[8];
+    int num_layouts = 0;
+    int best = -1;
+
+    for (int spc = 1; spc <= SPC_MAX; spc *= 2) {
+        struct layout* l = &layouts[num_layouts++];
+        align_layout(l, sectors, hidden, spc, dir);
+        if (!l->valid)
+            continue;
+
+        predict(l);
+        if (best < 0 || l->ampl < layouts[best].ampl)
+            best = l - layouts;
+    }
+
+    if (best < 0) {
+        fprintf(stderr, "No FAT16 layout fits %llu sectors\n", (unsigned long long)sectors);
+        return EXIT_FAILURE;
+    }
+
+    // smallest FAT among the (nearly) best
+    double limit = layouts[best].ampl * TOLERANCE;
+    for (int i = 0; i < num_layouts; ++i) {
+        if (layouts[i].valid && layouts[i].ampl <= limit && layouts[i].spf < layouts[best].spf)
+            best = i;
+    }
+
+    const struct layout* b = &layouts[best];
+    if (options_only) {
+        printf("-F 16 -s %d -R %u -r %u -f %d\n", b->spc, b->res, b->dir, FATS);
+        return EXIT_SUCCESS;
+    }
+
+    int c, h, s;
+    uint64_t chs_size = chs_fit(sectors * SECTOR_SIZE, &c, &h, &s);
+    printf("Volume: %llu sectors, hidden %llu, CHS fit C: %d, H: %d, S: %d (%llu sectors)\n",
+        (unsigned long long)sectors, (unsigned long long)hidden, c, h, s, (unsigned long long)(chs_size / SECTOR_SIZE));
+    printf("File size mix:");
+    for (int i = 0; i < num_mix; ++i)
+        printf(" %llu:%.0f%%", (unsigned long long)mix[i].size, mix[i].weight * 100);
+    printf("\n\n");
+
+    printf("  Cluster Res Root  FAT   Clusters Data    Ampl   Cross%s\n", bench ? "  Measured" : "");
+    printf("----------------------------------------------------------------------\n");
+    for (int i = 0; i < num_layouts; ++i) {
+        const struct layout* l = &layouts[i];
+        printf("%c %-7u ", i == best ? '*' : ' ', l->spc * SECTOR_SIZE);
+        if (!l->valid) {
+            printf("no FAT16 layout (%u clusters)\n", l->clusters);
+            continue;
+        }
+
+        printf("%-3u %-5u %-5u %-8u %-7llu %-6.3f %-6.3f", l->res, l->dir, l->spf, l->clusters,
+            (unsigned long long)l->data_start, l->ampl, l->crossings);
+
+        double ampl, crossings;
+        if (bench) {
+            if (benchmark(l, sectors, hidden, &ampl, &crossings) == 0)
+                printf(" %.3f %.3f", ampl, crossings);
+            else
+                printf(" failed");
+        }
+        printf("\n");
+    }
+
+    printf("\n");
+    printf("Ampl: bytes read per byte of file data, Cross: track crossings per file\n");
+    if (bench)
+        printf("Measured: the same, reading an aged generated volume the way DOS does (see -b)\n");
+    printf("mkdosfs -a -g %d/%d -h %llu -F 16 -s %d -R %u -r %u -f %d\n", HEADS, GRAIN, (unsigned long long)hidden,
+        b->spc, b->res, b->dir, FATS);
+
+    return EXIT_SUCCESS;
+}
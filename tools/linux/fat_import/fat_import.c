@@ -0,0 +1,350 @@
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "fat16.h"
+
+#define DEPTH_MAX 32
+#define CHUNK_SIZE (1024 * 1024)
+
+#define min(a,b) \
+   ({ __typeof__ (a) _a = (a); \
+       __typeof__ (b) _b = (b); \
+     _a < _b ? _a : _b; })
+
+static uint8_t* chunk;
+static size_t chunk_size;
+
+static void print_help(const char* name)
+{
+    fprintf(stderr, "Usage: %s <disk image> <offset> <source> [destination]\n", name);
+    fprintf(stderr, "\n");
+    fprintf(stderr, "<offset> is the byte offset of the FAT16 boot sector\n");
+    fprintf(stderr, "(as printed by create_msdos_img.sh); <source> may be a\n");
+    fprintf(stderr, "file or a directory which is imported recursively into\n");
+    fprintf(stderr, "the existing <destination> directory (default: root).\n");
+}
+
+// 8.3, upper case, no conversion of long names
+static int make_short_name(const char* name, struct fat16_dirent* de)
+{
+    static const char invalid[] = "\"*+,./:;<=>?[\\]|";
+
+    memset(de->name, ' ', sizeof(de->name));
+    memset(de->ext, ' ', sizeof(de->ext));
+
+    const char* dot = strrchr(name, '.');
+    size_t base_len = dot ? (size_t)(dot - name) : strlen(name);
+    size_t ext_len = dot ? strlen(dot + 1) : 0;
+
+    if (base_len == 0 || base_len > sizeof(de->name) || ext_len > sizeof(de->ext))
+        return -1;
+
+    for (size_t i = 0; i < base_len + (dot ? 1 + ext_len : 0); ++i) {
+        unsigned char c = name[i];
+        if (&name[i] == dot)
+            continue;
+        if (c <= ' ' || c >= 0x7f || strchr(invalid, c))
+            return -1;
+    }
+
+    for (size_t i = 0; i < base_len; ++i)
+        de->name[i] = toupper((unsigned char)name[i]);
+    for (size_t i = 0; i < ext_len; ++i)
+        de->ext[i] = toupper((unsigned char)dot[1 + i]);
+    if (de->name[0] == 0xe5)
+        de->name[0] = 0x05;
+
+    return 0;
+}
+
+static void set_dos_time(struct fat16_dirent* de, time_t t)
+{
+    struct tm* tm = localtime(&t);
+    int year = tm->tm_year - 80;
+    if (year < 0)
+        year = 0;
+
+    set_le16(de->date, (year << 9) | ((tm->tm_mon + 1) << 5) | tm->tm_mday);
+    set_le16(de->time, (tm->tm_hour << 11) | (tm->tm_min << 5) | (tm->tm_sec / 2));
+}
+
+static int exists(struct fat16_volume* vol, uint32_t dir_cluster, const struct fat16_dirent* de)
+{
+    struct fat16_dirent* entries;
+    size_t count;
+    int found = 0;
+
+    if (fat16_read_dir(vol, dir_cluster, &entries, &count) != 0)
+        return -1;
+
+    for (size_t i = 0; i < count && entries[i].name[0] != 0x00 && !found; ++i)
+        found = fat16_dirent_used(&entries[i])
+            && memcmp(entries[i].name, de->name, sizeof(de->name) + sizeof(de->ext)) == 0;
+
+    free(entries);
+    return found;
+}
+
+// stream the file in chunks of whole clusters, one write per contiguous run piece
+static int write_data(struct fat16_volume* vol, int fd, uint32_t cluster, uint32_t size)
+{
+    while (size > 0) {
+        uint32_t run = fat16_run_length(vol, cluster);
+        uint64_t offset = fat16_cluster_offset(vol, cluster);
+        uint64_t run_bytes = min((uint64_t)run * vol->cluster_size, (uint64_t)size + vol->cluster_size - 1) / vol->cluster_size * vol->cluster_size;
+
+        while (run_bytes > 0 && size > 0) {
+            size_t len = min((uint64_t)chunk_size, run_bytes);
+            size_t want = min((uint32_t)len, size);
+            size_t got = 0;
+
+            while (got < want) {
+                ssize_t n = read(fd, chunk + got, want - got);
+                if (n < 0 && errno == EINTR)
+                    continue;
+                if (n <= 0)
+                    return -1;
+                got += n;
+            }
+            // zero the slack of the last cluster
+            memset(chunk + got, 0, len - got);
+
+            if (image_write(vol->img, chunk, len, offset) != 0)
+                return -1;
+
+            offset += len;
+            run_bytes -= len;
+            size -= got;
+        }
+
+        cluster = vol->fat[cluster + run - 1];
+    }
+
+    return 0;
+}
+
+static int import_file(struct fat16_volume* vol, uint32_t dir_cluster, struct fat16_dirent* de, const char* path, const struct stat* st)
+{
+    if (st->st_size > UINT32_MAX) {
+        fprintf(stderr, "%s: too big for FAT16\n", path);
+        return -1;
+    }
+
+    uint32_t size = st->st_size;
+    uint32_t count = (size + vol->cluster_size - 1) / vol->cluster_size;
+    uint32_t first = 0;
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "%s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    if (count > 0 && fat16_alloc(vol, count, &first) != 0) {
+        fprintf(stderr, "%s: volume full\n", path);
+        close(fd);
+        return -1;
+    }
+
+    if (count > 0 && write_data(vol, fd, first, size) != 0) {
+        fprintf(stderr, "%s: write failed\n", path);
+        fat16_free_chain(vol, first);
+        close(fd);
+        return -1;
+    }
+    close(fd);
+
+    de->attr = ATTR_ARCHIVE;
+    set_le16(de->start, first);
+    set_le32(de->size, size);
+
+    if (fat16_add_dirent(vol, dir_cluster, de) != 0) {
+        fprintf(stderr, "%s: directory full\n", path);
+        if (count > 0)
+            fat16_free_chain(vol, first);
+        return -1;
+    }
+
+    if (count > 1 && fat16_run_length(vol, first) < count)
+        printf("%s (%u clusters, fragmented)\n", path, count);
+    else
+        printf("%s (%u clusters)\n", path, count);
+
+    return 0;
+}
+
+static int import(struct fat16_volume* vol, uint32_t dir_cluster, const char* path, int depth);
+
+static int import_dir(struct fat16_volume* vol, uint32_t dir_cluster, struct fat16_dirent* de, const char* path, int depth)
+{
+    if (depth > DEPTH_MAX) {
+        fprintf(stderr, "%s: directories nested too deep\n", path);
+        return -1;
+    }
+
+    uint32_t cluster;
+    if (fat16_alloc(vol, 1, &cluster) != 0) {
+        fprintf(stderr, "%s: volume full\n", path);
+        return -1;
+    }
+
+    de->attr = ATTR_DIR;
+    set_le16(de->start, cluster);
+    set_le32(de->size, 0);
+
+    // "." and ".." followed by zeroes
+    memset(chunk, 0, vol->cluster_size);
+    struct fat16_dirent* dots = (struct fat16_dirent*)chunk;
+    dots[0] = *de;
+    memcpy(dots[0].name, ".          ", sizeof(de->name) + sizeof(de->ext));
+    set_le16(dots[0].start, cluster);
+    dots[1] = *de;
+    memcpy(dots[1].name, "..         ", sizeof(de->name) + sizeof(de->ext));
+    set_le16(dots[1].start, dir_cluster);
+
+    if (image_write(vol->img, chunk, vol->cluster_size, fat16_cluster_offset(vol, cluster)) != 0) {
+        fprintf(stderr, "%s: write failed\n", path);
+        fat16_free_chain(vol, cluster);
+        return -1;
+    }
+
+    if (fat16_add_dirent(vol, dir_cluster, de) != 0) {
+        fprintf(stderr, "%s: directory full\n", path);
+        fat16_free_chain(vol, cluster);
+        return -1;
+    }
+    printf("%s/\n", path);
+
+    DIR* dir = opendir(path);
+    if (!dir) {
+        fprintf(stderr, "%s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    int ret = 0;
+    struct dirent* e;
+    while ((e = readdir(dir)) != NULL) {
+        if (strcmp(e->d_name, ".") == 0 || strcmp(e->d_name, "..") == 0)
+            continue;
+
+        char child[PATH_MAX];
+        snprintf(child, sizeof(child), "%s/%s", path, e->d_name);
+        ret |= import(vol, cluster, child, depth + 1);
+    }
+
+    closedir(dir);
+    return ret;
+}
+
+static int import(struct fat16_volume* vol, uint32_t dir_cluster, const char* path, int depth)
+{
+    struct stat st;
+    if (stat(path, &st) != 0) {
+        fprintf(stderr, "%s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    const char* name = strrchr(path, '/');
+    name = name ? name + 1 : path;
+
+    struct fat16_dirent de = {};
+    if (make_short_name(name, &de) != 0) {
+        fprintf(stderr, "%s: not a valid 8.3 name, skipping\n", path);
+        return -1;
+    }
+    set_dos_time(&de, st.st_mtime);
+
+    switch (exists(vol, dir_cluster, &de)) {
+        case 0:
+            break;
+        case 1:
+            fprintf(stderr, "%s: already exists, skipping\n", path);
+            return -1;
+        default:
+            fprintf(stderr, "%s: can't read destination directory\n", path);
+            return -1;
+    }
+
+    if (S_ISDIR(st.st_mode))
+        return import_dir(vol, dir_cluster, &de, path, depth);
+    else if (S_ISREG(st.st_mode))
+        return import_file(vol, dir_cluster, &de, path, &st);
+
+    fprintf(stderr, "%s: not a regular file, skipping\n", path);
+    return -1;
+}
+
+int main(int argc, char* argv[])
+{
+    if (argc < 4 || argc > 5) {
+        print_help(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    struct image img;
+    if (image_open(&img, argv[1], 1) != 0)
+        return EXIT_FAILURE;
+
+    uint64_t offset = strtoull(argv[2], NULL, 0);
+
+    struct fat16_volume vol;
+    if (fat16_open(&vol, &img, offset) != 0) {
+        image_close(&img);
+        return EXIT_FAILURE;
+    }
+
+    const char* dest = argc == 5 ? argv[4] : "/";
+    struct fat16_dirent dir;
+    if (fat16_lookup(&vol, dest, &dir) != 0 || !(dir.attr & ATTR_DIR)) {
+        fprintf(stderr, "%s: no such directory\n", dest);
+        fat16_close(&vol);
+        image_close(&img);
+        return EXIT_FAILURE;
+    }
+
+    // whole clusters, so every write covers complete clusters
+    chunk_size = CHUNK_SIZE / vol.cluster_size * vol.cluster_size;
+    if (chunk_size == 0)
+        chunk_size = vol.cluster_size;
+    if (posix_memalign((void**)&chunk, 4096, chunk_size) != 0) {
+        fat16_close(&vol);
+        image_close(&img);
+        return EXIT_FAILURE;
+    }
+
+    // strip trailing slashes, the last component becomes the DOS name
+    char source[PATH_MAX];
+    snprintf(source, sizeof(source), "%s", argv[3]);
+    for (size_t len = strlen(source); len > 1 && source[len - 1] == '/'; --len)
+        source[len - 1] = '\0';
+
+    int ret = import(&vol, le16(dir.start), source, 0);
+
+    // one batched update of all FAT copies, also after a failure: whatever was
+    // imported stays, chains of failed files have been freed again
+    if (fat16_flush_fat(&vol) != 0) {
+        fprintf(stderr, "Can't write FAT\n");
+        ret = -1;
+    }
+
+    free(chunk);
+    fat16_close(&vol);
+    if (image_flush(&img) != 0) {
+        fprintf(stderr, "Can't write %s\n", argv[1]);
+        ret = -1;
+    }
+    image_close(&img);
+
+    return ret == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
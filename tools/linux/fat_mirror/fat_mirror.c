@@ -0,0 +1,259 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "fat16.h"
+#include "partition.h"
+
+#define CHUNK_SIZE  (64 * 1024)
+#define BLOCK_SIZE  64          /* memcmp() granularity before looking at single entries */
+#define RANGES_MAX  32          /* printed per FAT copy */
+#define GAP_MAX     16          /* sectors; closer differing spans are written in one go */
+
+struct span {
+    uint32_t first;             /* FAT sectors */
+    uint32_t last;
+};
+
+static uint8_t chunk_a[CHUNK_SIZE];
+static uint8_t chunk_b[CHUNK_SIZE];
+
+static void print_help(const char* name)
+{
+    fprintf(stderr, "Usage: %s [-r <n>] <disk image> [offset]\n", name);
+    fprintf(stderr, "\n");
+    fprintf(stderr, "Compares the FAT copies of the FAT16 volume at byte\n");
+    fprintf(stderr, "<offset> or of all volumes found in the partition tables.\n");
+    fprintf(stderr, "  -r <n>: repair, copy FAT #n over the other copies\n");
+}
+
+static void print_range(uint32_t first, uint32_t last, int* printed)
+{
+    if (*printed < RANGES_MAX)
+        printf("  entries %u-%u differ\n", first, last);
+    else if (*printed == RANGES_MAX)
+        printf("  ...\n");
+    (*printed)++;
+}
+
+static void add_span(struct span* spans, uint32_t* count, uint32_t sector)
+{
+    if (*count > 0 && sector <= spans[*count - 1].last + GAP_MAX) {
+        spans[*count - 1].last = sector;
+        return;
+    }
+
+    spans[*count].first = sector;
+    spans[*count].last = sector;
+    (*count)++;
+}
+
+// compare FAT #src (0-based) with FAT #dst, collecting the differing FAT sectors
+static int compare(struct fat16_volume* vol, int src, int dst, struct span* spans, uint32_t* span_count, uint32_t* differing)
+{
+    uint64_t fat_size = (uint64_t)vol->spf * vol->bps;
+    uint64_t src_offset = vol->fat_offset + src * fat_size;
+    uint64_t dst_offset = vol->fat_offset + dst * fat_size;
+    uint32_t entries = vol->clusters + 2;
+    uint64_t used = (uint64_t)entries * 2;
+
+    uint32_t range_first = 0;
+    int in_range = 0;
+    int printed = 0;
+
+    *span_count = 0;
+    *differing = 0;
+
+    for (uint64_t pos = 0; pos < used; pos += CHUNK_SIZE) {
+        size_t len = used - pos < CHUNK_SIZE ? used - pos : CHUNK_SIZE;
+
+        if (image_read(vol->img, chunk_a, len, src_offset + pos) != 0
+            || image_read(vol->img, chunk_b, len, dst_offset + pos) != 0)
+            return -1;
+
+        for (size_t block = 0; block < len; block += BLOCK_SIZE) {
+            size_t block_len = len - block < BLOCK_SIZE ? len - block : BLOCK_SIZE;
+
+            // memcmp() is vectorised by libc, only look closer at blocks that differ
+            if (memcmp(chunk_a + block, chunk_b + block, block_len) == 0) {
+                if (in_range) {
+                    print_range(range_first, (pos + block) / 2 - 1, &printed);
+                    in_range = 0;
+                }
+                continue;
+            }
+
+            for (size_t i = block; i < block + block_len; i += 2) {
+                uint32_t entry = (pos + i) / 2;
+
+                if (le16(&chunk_a[i]) != le16(&chunk_b[i])) {
+                    (*differing)++;
+                    add_span(spans, span_count, (pos + i) / vol->bps);
+                    if (!in_range) {
+                        range_first = entry;
+                        in_range = 1;
+                    }
+                } else if (in_range) {
+                    print_range(range_first, entry - 1, &printed);
+                    in_range = 0;
+                }
+            }
+        }
+    }
+
+    if (in_range)
+        print_range(range_first, entries - 1, &printed);
+
+    return 0;
+}
+
+// one write per coalesced span
+static int repair(struct fat16_volume* vol, int src, int dst, const struct span* spans, uint32_t span_count)
+{
+    uint64_t fat_size = (uint64_t)vol->spf * vol->bps;
+    uint8_t* buf = malloc(fat_size);
+    if (!buf)
+        return -1;
+
+    int ret = 0;
+    for (uint32_t i = 0; i < span_count && ret == 0; ++i) {
+        uint64_t offset = (uint64_t)spans[i].first * vol->bps;
+        size_t len = (size_t)(spans[i].last - spans[i].first + 1) * vol->bps;
+
+        ret = image_read(vol->img, buf, len, vol->fat_offset + src * fat_size + offset);
+        if (ret == 0)
+            ret = image_write(vol->img, buf, len, vol->fat_offset + dst * fat_size + offset);
+    }
+
+    free(buf);
+    return ret;
+}
+
+static int check_volume(struct image* img, uint64_t offset, int source)
+{
+    struct fat16_volume vol;
+
+    int open = fat16_open(&vol, img, offset);
+    if (open != 0)
+        return open;
+
+    printf("Volume at 0x%08llx: %u FATs of %u sectors, %u clusters\n",
+        (unsigned long long)offset, vol.fats, vol.spf, vol.clusters);
+
+    if (source > vol.fats) {
+        fprintf(stderr, "There is no FAT #%d\n", source);
+        fat16_close(&vol);
+        return -1;
+    }
+
+    struct span* spans = malloc(vol.spf * sizeof(*spans));
+    if (!spans) {
+        fat16_close(&vol);
+        return -1;
+    }
+
+    // FAT #1 is the reference unless another copy is the repair source
+    int ref = source > 0 ? source - 1 : 0;
+    int ret = 0;
+    int mismatch = 0;
+    for (int i = 0; i < vol.fats && ret == 0; ++i) {
+        if (i == ref)
+            continue;
+
+        uint32_t span_count, differing;
+        printf("FAT #%d vs. FAT #%d:\n", ref + 1, i + 1);
+        ret = compare(&vol, ref, i, spans, &span_count, &differing);
+        if (ret != 0) {
+            fprintf(stderr, "Can't read FAT\n");
+            break;
+        }
+
+        if (differing == 0) {
+            printf("  identical\n");
+            continue;
+        }
+
+        printf("  %u entries in %u sector span(s) differ\n", differing, span_count);
+        if (source > 0) {
+            ret = repair(&vol, ref, i, spans, span_count);
+            if (ret == 0)
+                printf("  FAT #%d updated from FAT #%d.\n", i + 1, ref + 1);
+            else
+                fprintf(stderr, "Can't write FAT #%d\n", i + 1);
+        } else {
+            // report the other copies as well
+            mismatch = 1;
+        }
+    }
+
+    free(spans);
+    fat16_close(&vol);
+    printf("\n");
+    return ret == 0 ? mismatch : ret;
+}
+
+int main(int argc, char* argv[])
+{
+    int source = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "r:")) != -1) {
+        switch (opt) {
+            case 'r':
+                source = atoi(optarg);
+                if (source < 1) {
+                    print_help(argv[0]);
+                    return EXIT_FAILURE;
+                }
+                break;
+            default:
+                print_help(argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+
+    if (optind != argc - 1 && optind != argc - 2) {
+        print_help(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    struct image img;
+    if (image_open(&img, argv[optind], source > 0) != 0)
+        return EXIT_FAILURE;
+
+    int ret = 0;
+    if (optind == argc - 2) {
+        ret = check_volume(&img, strtoull(argv[optind + 1], NULL, 0), source);
+    } else {
+        struct partition parts[PARTITIONS_MAX];
+        int count = partition_walk(&img, parts, PARTITIONS_MAX);
+        int checked = 0;
+
+        for (int i = 0; i < count; ++i) {
+            if (partition_is_fat(&parts[i])) {
+                // FAT12 and small GEMDOS volumes are left alone
+                int r = check_volume(&img, parts[i].start * SECTOR_SIZE, source);
+                if (r == FAT16_NOT_FAT16)
+                    continue;
+                ret |= r;
+                checked++;
+            }
+        }
+
+        if (checked == 0) {
+            fprintf(stderr, "No FAT16 volumes found\n");
+            ret = -1;
+        }
+    }
+
+    if (image_flush(&img) != 0) {
+        fprintf(stderr, "Can't write %s\n", argv[optind]);
+        ret = -1;
+    }
+    image_close(&img);
+
+    // 0: all FATs agree (or were repaired), 1: mismatch found, 2: error
+    return ret < 0 ? 2 : ret;
+}
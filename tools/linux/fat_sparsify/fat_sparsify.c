@@ -0,0 +1,178 @@
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "fat16.h"
+#include "partition.h"
+
+enum mode {
+    MODE_PUNCH,
+    MODE_ZERO,
+    MODE_DRY_RUN
+};
+
+struct job {
+    pthread_t thread;
+    struct image* img;
+    const struct partition* part;
+    enum mode mode;
+
+    int ok;
+    int skipped;    /* FAT12 or a GEMDOS volume too small for FAT16 */
+    uint32_t clusters;
+    uint32_t free_clusters;
+    uint32_t free_runs;
+    uint64_t bytes;
+};
+
+static void print_help(const char* name)
+{
+    fprintf(stderr, "Usage: %s [-z|-n] <disk image>\n", name);
+    fprintf(stderr, "\n");
+    fprintf(stderr, "Deallocates the free clusters of all FAT16 volumes\n");
+    fprintf(stderr, "(including those inside ATonce images) so the disk\n");
+    fprintf(stderr, "image becomes sparse.\n");
+    fprintf(stderr, "  -z: overwrite free clusters with zeroes instead\n");
+    fprintf(stderr, "  -n: only report what would be done\n");
+}
+
+static void* sparsify(void* arg)
+{
+    struct job* job = arg;
+    struct fat16_volume vol;
+
+    int ret = fat16_open(&vol, job->img, job->part->start * SECTOR_SIZE);
+    if (ret != 0) {
+        job->skipped = ret == FAT16_NOT_FAT16;
+        return NULL;
+    }
+
+    job->ok = 1;
+    job->clusters = vol.clusters;
+
+    uint32_t length;
+    for (uint32_t cluster = fat16_free_run(&vol, 0, &length); cluster != 0; cluster = fat16_free_run(&vol, cluster + length, &length)) {
+        uint64_t offset = fat16_cluster_offset(&vol, cluster);
+        uint64_t len = (uint64_t)length * vol.cluster_size;
+
+        // never touch anything behind the partition
+        uint64_t part_end = (job->part->start + job->part->size) * SECTOR_SIZE;
+        if (offset >= part_end)
+            break;
+        if (offset + len > part_end)
+            len = part_end - offset;
+
+        ret = 0;
+        if (job->mode == MODE_PUNCH)
+            ret = image_punch(job->img, offset, len);
+        else if (job->mode == MODE_ZERO)
+            ret = image_zero(job->img, offset, len);
+
+        if (ret != 0) {
+            job->ok = 0;
+            break;
+        }
+
+        job->free_clusters += length;
+        job->free_runs++;
+        job->bytes += len;
+    }
+
+    fat16_close(&vol);
+    return NULL;
+}
+
+int main(int argc, char* argv[])
+{
+    enum mode mode = MODE_PUNCH;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "zn")) != -1) {
+        switch (opt) {
+            case 'z':
+                mode = MODE_ZERO;
+                break;
+            case 'n':
+                mode = MODE_DRY_RUN;
+                break;
+            default:
+                print_help(argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+
+    if (optind != argc - 1) {
+        print_help(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    struct image img;
+    if (image_open(&img, argv[optind], mode != MODE_DRY_RUN) != 0)
+        return EXIT_FAILURE;
+
+    struct partition parts[PARTITIONS_MAX];
+    int count = partition_walk(&img, parts, PARTITIONS_MAX);
+
+    struct job jobs[PARTITIONS_MAX] = {};
+    int started = 0;
+
+    // one thread per volume, they only share the (thread-safe) pread/pwrite/fallocate calls
+    for (int i = 0; i < count; ++i) {
+        if (!partition_is_fat(&parts[i]))
+            continue;
+
+        jobs[i].img = &img;
+        jobs[i].part = &parts[i];
+        jobs[i].mode = mode;
+        if (pthread_create(&jobs[i].thread, NULL, sparsify, &jobs[i]) == 0)
+            started++;
+        else
+            jobs[i].part = NULL;
+    }
+
+    if (started == 0) {
+        fprintf(stderr, "No FAT16 volumes found\n");
+        image_close(&img);
+        return EXIT_FAILURE;
+    }
+
+    int ret = EXIT_SUCCESS;
+    uint64_t total = 0;
+
+    printf("Type Start      Sectors    Clusters Free     Runs     Bytes\n");
+    printf("----------------------------------------------------------------------\n");
+    for (int i = 0; i < count; ++i) {
+        if (!jobs[i].part)
+            continue;
+
+        pthread_join(jobs[i].thread, NULL);
+
+        char name[3+1];
+        partition_name(&parts[i], name);
+        printf("%-4s %-10llu %-10llu ", name, (unsigned long long)parts[i].start, (unsigned long long)parts[i].size);
+        if (jobs[i].ok) {
+            printf("%-8u %-8u %-8u %llu\n", jobs[i].clusters, jobs[i].free_clusters, jobs[i].free_runs,
+                (unsigned long long)jobs[i].bytes);
+            total += jobs[i].bytes;
+        } else if (jobs[i].skipped) {
+            printf("skipped, not FAT16\n");
+        } else {
+            printf("failed\n");
+            ret = EXIT_FAILURE;
+        }
+    }
+
+    printf("\n");
+    printf("%llu bytes %s\n", (unsigned long long)total,
+        mode == MODE_PUNCH ? "deallocated" : mode == MODE_ZERO ? "zeroed" : "free");
+
+    if (image_flush(&img) != 0) {
+        fprintf(stderr, "Can't write %s\n", argv[optind]);
+        ret = EXIT_FAILURE;
+    }
+    image_close(&img);
+    return ret;
+}
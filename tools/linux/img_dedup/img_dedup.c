@@ -0,0 +1,693 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "dimage.h"
+#include "image.h"
+#include "sha256.h"
+
+#define SEGMENT_SIZE (16 * 1024 * 1024)    // per thread; segment starts are forced chunk boundaries
+#define THREADS_MAX  16
+#define CDC_MIN      (4 * 1024)
+#define CDC_MAX      (64 * 1024)
+#define CDC_BITS     14                    // 16 KiB average chunk
+#define RUN_MAX      (1024 * 1024 * 1024)  // longest merged entry
+#define RECORD_SIZE  48
+
+#define min(a,b) \
+   ({ __typeof__ (a) _a = (a); \
+       __typeof__ (b) _b = (b); \
+     _a < _b ? _a : _b; })
+
+struct chunk {
+    uint32_t pos;       /* within the segment */
+    uint32_t length;
+    int zero;
+    uint8_t hash[SHA256_SIZE];
+};
+
+// image to store; put overlays a file over part of it
+struct source {
+    struct image* img;
+    int patch_fd;       /* -1: none */
+    uint64_t patch_offset;
+    uint64_t patch_len;
+};
+
+struct segment {
+    const struct source* src;
+    struct image* img;  /* restore only */
+    int out_fd;
+    uint64_t offset;
+    size_t len;
+    uint8_t* data;
+    struct chunk* chunks;
+    size_t count;
+    int ret;
+};
+
+struct slot {
+    uint8_t hash[SHA256_SIZE];
+    uint64_t offset;
+    uint32_t length;
+    int used;
+};
+
+struct store {
+    char path[PATH_MAX];
+    int pack_fd;
+    int index_fd;
+    uint64_t pack_end;
+    uint64_t index_end;
+
+    struct slot* table; /* open addressing, never more than half full */
+    uint64_t capacity;
+    uint64_t count;
+
+    uint8_t* pending;   /* index records not written yet */
+    uint64_t pending_count;
+    uint64_t pending_bytes;
+};
+
+static uint64_t gear[256];
+
+static void print_help(const char* name)
+{
+    fprintf(stderr, "Usage: %s c <store> <disk image> <stored image>\n", name);
+    fprintf(stderr, "       %s x <stored image> <disk image>\n", name);
+    fprintf(stderr, "       %s i <store|stored image>\n", name);
+    fprintf(stderr, "       %s put <stored image> <sector> <file>\n", name);
+    fprintf(stderr, "\n");
+    fprintf(stderr, "c stores a (raw, compressed or stored) disk image in the\n");
+    fprintf(stderr, "dedup store directory, x restores it as a sparse raw image,\n");
+    fprintf(stderr, "i shows statistics, put replaces a range of 512 byte sectors.\n");
+    fprintf(stderr, "Stored images can be read directly by all image tools.\n");
+}
+
+static void init_gear(void)
+{
+    // splitmix64 with a fixed seed: chunk boundaries must not change between runs
+    uint64_t x = 0x41544f4e43450000ULL;
+
+    for (int i = 0; i < 256; ++i) {
+        uint64_t z = (x += 0x9e3779b97f4a7c15ULL);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        gear[i] = z ^ (z >> 31);
+    }
+}
+
+// gear hash over the bytes behind CDC_MIN, the top CDC_BITS decide the cut
+static size_t cut_point(const uint8_t* data, size_t len)
+{
+    if (len <= CDC_MIN)
+        return len;
+
+    size_t end = min(len, (size_t)CDC_MAX);
+    uint64_t h = 0;
+
+    for (size_t i = CDC_MIN; i < end; ++i) {
+        h = (h << 1) + gear[data[i]];
+        if ((h >> (64 - CDC_BITS)) == 0)
+            return i + 1;
+    }
+
+    return end;
+}
+
+static int is_zero(const uint8_t* data, size_t len)
+{
+    for (size_t i = 0; i < len; ++i)
+        if (data[i])
+            return 0;
+
+    return 1;
+}
+
+static int read_source(const struct source* src, uint8_t* buf, size_t len, uint64_t offset)
+{
+    if (image_read(src->img, buf, len, offset) != 0)
+        return -1;
+
+    if (src->patch_fd < 0 || offset >= src->patch_offset + src->patch_len || offset + len <= src->patch_offset)
+        return 0;
+
+    uint64_t from = offset > src->patch_offset ? offset : src->patch_offset;
+    uint64_t to = min(offset + len, src->patch_offset + src->patch_len);
+    uint8_t* p = buf + (from - offset);
+
+    for (uint64_t pos = from - src->patch_offset; from < to; ) {
+        ssize_t n = pread(src->patch_fd, p, to - from, pos);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        p += n;
+        from += n;
+        pos += n;
+    }
+
+    return 0;
+}
+
+static void* chunk_segment(void* arg)
+{
+    struct segment* s = arg;
+
+    s->count = 0;
+    s->ret = read_source(s->src, s->data, s->len, s->offset);
+
+    for (size_t pos = 0; s->ret == 0 && pos < s->len; ) {
+        struct chunk* c = &s->chunks[s->count++];
+        c->pos = pos;
+        c->length = cut_point(s->data + pos, s->len - pos);
+        c->zero = is_zero(s->data + pos, c->length);
+        if (!c->zero)
+            sha256(s->data + pos, c->length, c->hash);
+        pos += c->length;
+    }
+
+    return NULL;
+}
+
+static struct slot* find_slot(struct slot* table, uint64_t capacity, const uint8_t* hash)
+{
+    uint64_t key;
+    memcpy(&key, hash, sizeof(key));
+
+    for (uint64_t i = key & (capacity - 1); ; i = (i + 1) & (capacity - 1)) {
+        if (!table[i].used || memcmp(table[i].hash, hash, SHA256_SIZE) == 0)
+            return &table[i];
+    }
+}
+
+static int insert(struct store* s, const uint8_t* hash, uint64_t offset, uint32_t length)
+{
+    if ((s->count + 1) * 2 > s->capacity) {
+        uint64_t capacity = s->capacity ? s->capacity * 2 : 64 * 1024;
+        struct slot* table = calloc(capacity, sizeof(*table));
+        if (!table)
+            return -1;
+
+        for (uint64_t i = 0; i < s->capacity; ++i)
+            if (s->table[i].used)
+                *find_slot(table, capacity, s->table[i].hash) = s->table[i];
+
+        free(s->table);
+        s->table = table;
+        s->capacity = capacity;
+    }
+
+    struct slot* slot = find_slot(s->table, s->capacity, hash);
+    if (!slot->used) {
+        memcpy(slot->hash, hash, SHA256_SIZE);
+        slot->offset = offset;
+        slot->length = length;
+        slot->used = 1;
+        s->count++;
+    }
+
+    return 0;
+}
+
+static void store_close(struct store* s)
+{
+    // closing the index releases the lock
+    if (s->index_fd >= 0)
+        close(s->index_fd);
+    if (s->pack_fd >= 0)
+        close(s->pack_fd);
+    free(s->table);
+    free(s->pending);
+    memset(s, 0, sizeof(*s));
+    s->pack_fd = s->index_fd = -1;
+}
+
+static int store_open(struct store* s, const char* path, int create)
+{
+    memset(s, 0, sizeof(*s));
+    s->pack_fd = s->index_fd = -1;
+
+    if (create && mkdir(path, 0755) != 0 && errno != EEXIST) {
+        fprintf(stderr, "%s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    // stored images refer to their store by absolute path
+    if (!realpath(path, s->path)) {
+        fprintf(stderr, "%s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    char file[PATH_MAX + 16];
+    int flags = create ? O_RDWR | O_CREAT : O_RDONLY;
+
+    snprintf(file, sizeof(file), "%s/%s", s->path, DIMAGE_INDEX);
+    s->index_fd = open(file, flags, 0644);
+    if (s->index_fd < 0 || flock(s->index_fd, create ? LOCK_EX : LOCK_SH) != 0) {
+        fprintf(stderr, "%s: %s\n", file, strerror(errno));
+        store_close(s);
+        return -1;
+    }
+
+    snprintf(file, sizeof(file), "%s/%s", s->path, DIMAGE_PACK);
+    s->pack_fd = open(file, flags, 0644);
+    if (s->pack_fd < 0) {
+        fprintf(stderr, "%s: %s\n", file, strerror(errno));
+        store_close(s);
+        return -1;
+    }
+
+    struct stat st;
+    fstat(s->pack_fd, &st);
+    s->pack_end = st.st_size;
+    fstat(s->index_fd, &st);
+
+    // a torn record at the end is the remainder of an interrupted run
+    s->index_end = st.st_size - st.st_size % RECORD_SIZE;
+
+    uint8_t* raw = malloc(s->index_end + 1);
+    if (!raw || pread(s->index_fd, raw, s->index_end, 0) != (ssize_t)s->index_end) {
+        fprintf(stderr, "%s: can't read index\n", s->path);
+        free(raw);
+        store_close(s);
+        return -1;
+    }
+
+    int ret = 0;
+    for (uint64_t pos = 0; pos < s->index_end && ret == 0; pos += RECORD_SIZE) {
+        const uint8_t* r = raw + pos;
+        uint64_t offset = le32(r + 32) | ((uint64_t)le32(r + 36) << 32);
+        uint32_t length = le32(r + 40);
+        // the pack is synced before the index, anything else means corruption
+        if (offset + length > s->pack_end) {
+            fprintf(stderr, "%s: index refers past the end of the pack\n", s->path);
+            ret = -1;
+        } else {
+            ret = insert(s, r, offset, length);
+        }
+    }
+
+    free(raw);
+    if (ret != 0)
+        store_close(s);
+
+    return ret;
+}
+
+// returns the pack offset of the chunk, appending it if it is new
+static int store_add(struct store* s, const uint8_t* data, const struct chunk* c, uint64_t* offset)
+{
+    struct slot* slot = s->capacity ? find_slot(s->table, s->capacity, c->hash) : NULL;
+    if (slot && slot->used) {
+        *offset = slot->offset;
+        return 0;
+    }
+
+    for (size_t done = 0; done < c->length; ) {
+        ssize_t n = pwrite(s->pack_fd, data + done, c->length - done, s->pack_end + done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        done += n;
+    }
+
+    uint8_t* pending = realloc(s->pending, (s->pending_count + 1) * RECORD_SIZE);
+    if (!pending)
+        return -1;
+    s->pending = pending;
+
+    uint8_t* r = s->pending + s->pending_count * RECORD_SIZE;
+    memset(r, 0, RECORD_SIZE);
+    memcpy(r, c->hash, SHA256_SIZE);
+    set_le32(r + 32, s->pack_end);
+    set_le32(r + 36, s->pack_end >> 32);
+    set_le32(r + 40, c->length);
+    s->pending_count++;
+    s->pending_bytes += c->length;
+
+    *offset = s->pack_end;
+    s->pack_end += c->length;
+
+    return insert(s, c->hash, *offset, c->length);
+}
+
+// chunk data first, then the index records referring to it
+static int store_commit(struct store* s)
+{
+    if (s->pending_count == 0)
+        return 0;
+
+    if (fdatasync(s->pack_fd) != 0)
+        return -1;
+
+    uint64_t len = s->pending_count * RECORD_SIZE;
+    if (pwrite(s->index_fd, s->pending, len, s->index_end) != (ssize_t)len || fdatasync(s->index_fd) != 0)
+        return -1;
+
+    s->index_end += len;
+    return 0;
+}
+
+static int add_entry(struct dentry** entries, uint64_t* count, uint64_t* capacity, uint64_t offset, uint32_t length)
+{
+    // merge zero runs and chunks that follow each other in the pack
+    if (*count > 0) {
+        struct dentry* last = &(*entries)[*count - 1];
+        if (last->length + (uint64_t)length <= RUN_MAX
+            && ((offset == DIMAGE_ZERO && last->offset == DIMAGE_ZERO)
+                || (offset != DIMAGE_ZERO && last->offset != DIMAGE_ZERO && last->offset + last->length == offset))) {
+            last->length += length;
+            return 0;
+        }
+    }
+
+    if (*count == *capacity) {
+        uint64_t n = *capacity ? *capacity * 2 : 4096;
+        struct dentry* e = realloc(*entries, n * sizeof(*e));
+        if (!e)
+            return -1;
+        *entries = e;
+        *capacity = n;
+    }
+
+    (*entries)[*count].offset = offset;
+    (*entries)[*count].length = length;
+    (*count)++;
+
+    return 0;
+}
+
+static int get_threads(uint64_t size)
+{
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    uint64_t threads = cpus > 0 ? (uint64_t)cpus : 1;
+
+    threads = min(threads, (uint64_t)THREADS_MAX);
+    threads = min(threads, (size + SEGMENT_SIZE - 1) / SEGMENT_SIZE);
+
+    return threads ? threads : 1;
+}
+
+static void free_segments(struct segment* segments, int threads)
+{
+    for (int i = 0; i < threads; ++i) {
+        free(segments[i].data);
+        free(segments[i].chunks);
+    }
+}
+
+static int alloc_segments(struct segment* segments, int threads, int chunks)
+{
+    memset(segments, 0, threads * sizeof(*segments));
+
+    for (int i = 0; i < threads; ++i) {
+        segments[i].data = malloc(SEGMENT_SIZE);
+        if (chunks)
+            segments[i].chunks = malloc((SEGMENT_SIZE / CDC_MIN + 1) * sizeof(struct chunk));
+        if (!segments[i].data || (chunks && !segments[i].chunks)) {
+            fprintf(stderr, "Not enough memory\n");
+            free_segments(segments, threads);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+// Chunks and hashes up to one segment per thread, then appends the new chunks of
+// all segments in image order. The stored image is replaced atomically.
+static int store_source(const char* store_path, const struct source* src, const char* out_path)
+{
+    struct store store;
+    if (store_open(&store, store_path, 1) != 0)
+        return -1;
+
+    struct segment segments[THREADS_MAX];
+    int threads = get_threads(src->img->size);
+    if (alloc_segments(segments, threads, 1) != 0) {
+        store_close(&store);
+        return -1;
+    }
+
+    struct dentry* entries = NULL;
+    uint64_t count = 0;
+    uint64_t capacity = 0;
+    uint64_t chunks = 0;
+    int ret = 0;
+
+    for (uint64_t offset = 0; offset < src->img->size && ret == 0; ) {
+        pthread_t tids[THREADS_MAX];
+        int started[THREADS_MAX];
+        int n = 0;
+
+        for (; n < threads && offset < src->img->size; ++n, offset += SEGMENT_SIZE) {
+            segments[n].src = src;
+            segments[n].offset = offset;
+            segments[n].len = min(src->img->size - offset, (uint64_t)SEGMENT_SIZE);
+            started[n] = pthread_create(&tids[n], NULL, chunk_segment, &segments[n]) == 0;
+            if (!started[n])
+                chunk_segment(&segments[n]);
+        }
+
+        for (int i = 0; i < n; ++i) {
+            if (started[i])
+                pthread_join(tids[i], NULL);
+        }
+
+        for (int i = 0; i < n && ret == 0; ++i) {
+            const struct segment* s = &segments[i];
+            if (s->ret != 0) {
+                fprintf(stderr, "Read error at offset %llu\n", (unsigned long long)s->offset);
+                ret = -1;
+                break;
+            }
+
+            for (size_t j = 0; j < s->count && ret == 0; ++j) {
+                const struct chunk* c = &s->chunks[j];
+                uint64_t pack_offset = DIMAGE_ZERO;
+                if (!c->zero)
+                    ret = store_add(&store, s->data + c->pos, c, &pack_offset);
+                if (ret == 0)
+                    ret = add_entry(&entries, &count, &capacity, pack_offset, c->length);
+            }
+            chunks += s->count;
+        }
+    }
+
+    if (ret == 0)
+        ret = store_commit(&store);
+
+    char tmp_path[PATH_MAX + 8];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", out_path);
+
+    if (ret == 0) {
+        int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) {
+            fprintf(stderr, "%s: %s\n", tmp_path, strerror(errno));
+            ret = -1;
+        } else {
+            ret = dimage_save(fd, store.path, src->img->size, entries, count);
+            if (ret == 0)
+                ret = fsync(fd);
+            close(fd);
+            if (ret == 0)
+                ret = rename(tmp_path, out_path);
+            if (ret != 0)
+                unlink(tmp_path);
+        }
+    }
+
+    if (ret == 0)
+        printf("%llu chunks, %llu new (%llu bytes), %llu entries\n", (unsigned long long)chunks,
+            (unsigned long long)store.pending_count, (unsigned long long)store.pending_bytes, (unsigned long long)count);
+    else
+        fprintf(stderr, "%s: storing failed\n", out_path);
+
+    free(entries);
+    free_segments(segments, threads);
+    store_close(&store);
+    return ret;
+}
+
+static int store_image(const char* store_path, const char* in_path, const char* out_path)
+{
+    struct image img;
+
+    if (image_open(&img, in_path, 0) != 0)
+        return -1;
+
+    struct source src = { &img, -1, 0, 0 };
+    int ret = store_source(store_path, &src, out_path);
+
+    image_close(&img);
+    return ret;
+}
+
+static void* restore_segment(void* arg)
+{
+    struct segment* s = arg;
+
+    s->ret = image_read(s->img, s->data, s->len, s->offset);
+
+    // sparse output: zero ranges are just skipped
+    if (s->ret == 0 && !is_zero(s->data, s->len)
+        && pwrite(s->out_fd, s->data, s->len, s->offset) != (ssize_t)s->len)
+        s->ret = -1;
+
+    return NULL;
+}
+
+static int restore_image(const char* in_path, const char* out_path)
+{
+    struct image img;
+
+    if (image_open(&img, in_path, 0) != 0)
+        return -1;
+
+    int fd = open(out_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        fprintf(stderr, "%s: %s\n", out_path, strerror(errno));
+        image_close(&img);
+        return -1;
+    }
+
+    struct segment segments[THREADS_MAX];
+    int threads = get_threads(img.size);
+    int ret = alloc_segments(segments, threads, 0);
+    if (ret == 0)
+        ret = ftruncate(fd, img.size);
+
+    for (uint64_t offset = 0; offset < img.size && ret == 0; ) {
+        pthread_t tids[THREADS_MAX];
+        int started[THREADS_MAX];
+        int n = 0;
+
+        for (; n < threads && offset < img.size; ++n, offset += SEGMENT_SIZE) {
+            segments[n].img = &img;
+            segments[n].out_fd = fd;
+            segments[n].offset = offset;
+            segments[n].len = min(img.size - offset, (uint64_t)SEGMENT_SIZE);
+            started[n] = pthread_create(&tids[n], NULL, restore_segment, &segments[n]) == 0;
+            if (!started[n])
+                restore_segment(&segments[n]);
+        }
+
+        for (int i = 0; i < n; ++i) {
+            if (started[i])
+                pthread_join(tids[i], NULL);
+            ret |= segments[i].ret;
+        }
+    }
+
+    if (ret != 0)
+        fprintf(stderr, "%s: restore failed\n", out_path);
+
+    free_segments(segments, threads);
+    close(fd);
+    image_close(&img);
+    return ret;
+}
+
+static int info(const char* path)
+{
+    struct stat st;
+
+    if (stat(path, &st) == 0 && S_ISDIR(st.st_mode)) {
+        struct store store;
+        if (store_open(&store, path, 0) != 0)
+            return -1;
+
+        printf("Store: %s\n", store.path);
+        printf("Chunks: %llu\n", (unsigned long long)store.count);
+        printf("Pack size: %llu bytes\n", (unsigned long long)store.pack_end);
+        store_close(&store);
+        return 0;
+    }
+
+    struct image img;
+    if (image_open(&img, path, 0) != 0)
+        return -1;
+
+    if (!img.d) {
+        fprintf(stderr, "%s: not a stored image\n", path);
+        image_close(&img);
+        return -1;
+    }
+
+    uint64_t entries, zero_bytes;
+    dimage_stats(img.d, &entries, &zero_bytes);
+
+    printf("Store: %s\n", dimage_store(img.d));
+    printf("Image size: %llu bytes\n", (unsigned long long)img.size);
+    printf("Entries: %llu\n", (unsigned long long)entries);
+    printf("All-zero: %llu bytes (%.1f%%)\n", (unsigned long long)zero_bytes, img.size ? 100.0 * zero_bytes / img.size : 0.0);
+
+    image_close(&img);
+    return 0;
+}
+
+// stored images are immutable: the result is stored again, only changed chunks are new
+static int put(const char* path, uint64_t sector, const char* file)
+{
+    struct image img;
+
+    if (image_open(&img, path, 0) != 0)
+        return -1;
+
+    if (!img.d) {
+        fprintf(stderr, "%s: not a stored image\n", path);
+        image_close(&img);
+        return -1;
+    }
+
+    int fd = open(file, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        fprintf(stderr, "%s: %s\n", file, strerror(errno));
+        if (fd >= 0)
+            close(fd);
+        image_close(&img);
+        return -1;
+    }
+
+    struct source src = { &img, fd, sector * SECTOR_SIZE, st.st_size };
+    int ret = -1;
+    if (src.patch_offset + src.patch_len > img.size)
+        fprintf(stderr, "%s: doesn't fit into %s\n", file, path);
+    else
+        ret = store_source(dimage_store(img.d), &src, path);
+
+    close(fd);
+    image_close(&img);
+    return ret;
+}
+
+int main(int argc, char* argv[])
+{
+    int ret = -1;
+
+    init_gear();
+
+    if (argc == 5 && strcmp(argv[1], "c") == 0)
+        ret = store_image(argv[2], argv[3], argv[4]);
+    else if (argc == 4 && strcmp(argv[1], "x") == 0)
+        ret = restore_image(argv[2], argv[3]);
+    else if (argc == 3 && strcmp(argv[1], "i") == 0)
+        ret = info(argv[2]);
+    else if (argc == 5 && strcmp(argv[1], "put") == 0)
+        ret = put(argv[2], strtoull(argv[3], NULL, 0), argv[4]);
+    else
+        print_help(argv[0]);
+
+    return ret == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
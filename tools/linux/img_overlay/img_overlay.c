@@ -0,0 +1,300 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "image.h"
+#include "oimage.h"
+#include "partition.h"
+
+#define BUFFER_SECTORS 2048
+
+#define min(a,b) \
+   ({ __typeof__ (a) _a = (a); \
+       __typeof__ (b) _b = (b); \
+     _a < _b ? _a : _b; })
+
+static uint8_t buffer[BUFFER_SECTORS * SECTOR_SIZE];
+static uint8_t base_buffer[BUFFER_SECTORS * SECTOR_SIZE];
+
+static void print_help(const char* name)
+{
+    fprintf(stderr, "Usage: %s c <disk image> <overlay>\n", name);
+    fprintf(stderr, "       %s i <overlay>\n", name);
+    fprintf(stderr, "       %s diff <overlay>\n", name);
+    fprintf(stderr, "       %s commit <overlay>\n", name);
+    fprintf(stderr, "       %s discard <overlay>\n", name);
+    fprintf(stderr, "\n");
+    fprintf(stderr, "c creates an empty copy-on-write overlay which all tools\n");
+    fprintf(stderr, "accept in place of the disk image; the disk image itself is\n");
+    fprintf(stderr, "left untouched. i shows its size, diff lists the sectors that\n");
+    fprintf(stderr, "differ from the disk image, commit writes the overlay's sectors\n");
+    fprintf(stderr, "into the disk image and discard drops them. An interrupted\n");
+    fprintf(stderr, "commit can be run again to finish it.\n");
+}
+
+static int open_overlay(struct image* img, const char* path, int writable)
+{
+    if (image_open(img, path, writable) != 0)
+        return -1;
+
+    if (!img->o) {
+        fprintf(stderr, "%s: not an overlay\n", path);
+        image_close(img);
+        return -1;
+    }
+
+    return 0;
+}
+
+static int create(const char* base, const char* path)
+{
+    char full[PATH_MAX];
+    if (!realpath(base, full)) {
+        fprintf(stderr, "%s: %s\n", base, strerror(errno));
+        return -1;
+    }
+
+    int fd = open(path, O_RDWR | O_CREAT | O_EXCL, 0644);
+    if (fd < 0) {
+        fprintf(stderr, "%s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    int ret = oimage_create(fd, full);
+    close(fd);
+
+    if (ret != 0) {
+        fprintf(stderr, "%s: can't create overlay\n", path);
+        unlink(path);
+    }
+
+    return ret;
+}
+
+static int info(const char* path)
+{
+    struct image img;
+
+    if (open_overlay(&img, path, 0) != 0)
+        return -1;
+
+    uint64_t sectors = 0;
+    uint64_t runs = 0;
+    uint64_t count;
+    for (uint64_t sector = 0; oimage_next_run(img.o, &sector, &count) == 0; sector += count) {
+        sectors += count;
+        runs++;
+    }
+
+    struct stat st;
+    fstat(img.fd, &st);
+
+    printf("Base image: %s\n", oimage_base(img.o));
+    printf("Image size: %llu bytes\n", (unsigned long long)img.size);
+    printf("Sectors: %llu in %llu runs\n", (unsigned long long)sectors, (unsigned long long)runs);
+    printf("Disk usage: %llu bytes\n", (unsigned long long)st.st_blocks * 512);
+
+    image_close(&img);
+    return 0;
+}
+
+static void print_range(const struct partition* parts, int count, uint64_t sector, uint64_t length)
+{
+    // innermost partition: the volumes of an ATonce image follow the image
+    int found = -1;
+    for (int i = 0; i < count; ++i)
+        if (sector >= parts[i].start && sector < parts[i].start + parts[i].size)
+            found = i;
+
+    printf("%-10llu %-10llu ", (unsigned long long)sector, (unsigned long long)length);
+    if (found < 0) {
+        printf("-\n");
+        return;
+    }
+
+    char name[3+1];
+    partition_name(&parts[found], name);
+    printf("%s at %llu, +%llu\n", name, (unsigned long long)parts[found].start,
+        (unsigned long long)(sector - parts[found].start));
+}
+
+static int diff(const char* path)
+{
+    struct image img;
+
+    if (open_overlay(&img, path, 0) != 0)
+        return -1;
+
+    struct image* base = oimage_base_image(img.o);
+    struct partition parts[PARTITIONS_MAX];
+    int parts_count = partition_walk(&img, parts, PARTITIONS_MAX);
+
+    printf("Sector     Count      Partition\n");
+    printf("----------------------------------------------------------------------\n");
+
+    int ret = 0;
+    uint64_t total = 0;
+    uint64_t changed = 0;
+    uint64_t run_start = 0;
+    uint64_t run_length = 0;
+    uint64_t count;
+
+    for (uint64_t sector = 0; ret == 0 && oimage_next_run(img.o, &sector, &count) == 0; ) {
+        total += count;
+
+        while (count > 0) {
+            uint64_t n = min(count, (uint64_t)BUFFER_SECTORS);
+            size_t len = min(n * SECTOR_SIZE, img.size - sector * SECTOR_SIZE);
+            if (image_read(&img, buffer, len, sector * SECTOR_SIZE) != 0
+                || image_read(base, base_buffer, len, sector * SECTOR_SIZE) != 0) {
+                fprintf(stderr, "Can't read sectors %llu-%llu\n", (unsigned long long)sector,
+                    (unsigned long long)(sector + n - 1));
+                ret = -1;
+                break;
+            }
+
+            // coalesce differing sectors, also across overlay runs
+            for (uint64_t i = 0; i < n; ++i) {
+                size_t at = i * SECTOR_SIZE;
+                if (at < len && memcmp(&buffer[at], &base_buffer[at], min((size_t)SECTOR_SIZE, len - at)) != 0) {
+                    if (run_length > 0 && run_start + run_length == sector + i) {
+                        run_length++;
+                    } else {
+                        if (run_length > 0)
+                            print_range(parts, parts_count, run_start, run_length);
+                        run_start = sector + i;
+                        run_length = 1;
+                    }
+                    changed++;
+                }
+            }
+
+            sector += n;
+            count -= n;
+        }
+    }
+
+    if (run_length > 0)
+        print_range(parts, parts_count, run_start, run_length);
+
+    printf("\n");
+    printf("%llu sectors in the overlay, %llu differ from %s\n", (unsigned long long)total,
+        (unsigned long long)changed, oimage_base(img.o));
+
+    image_close(&img);
+    return ret;
+}
+
+static int commit(const char* path)
+{
+    struct image img;
+
+    if (open_overlay(&img, path, 1) != 0)
+        return -1;
+
+    if (oimage_committing(img.o))
+        printf("Resuming an interrupted commit to %s\n", oimage_base(img.o));
+
+    struct image base;
+    if (image_open(&base, oimage_base(img.o), 1) != 0) {
+        image_close(&img);
+        return -1;
+    }
+
+    // from here on the base no longer matches the overlay's header
+    if (oimage_begin_commit(img.o) != 0) {
+        fprintf(stderr, "%s: can't update overlay\n", path);
+        image_close(&base);
+        image_close(&img);
+        return -1;
+    }
+
+    int ret = 0;
+    uint64_t written = 0;
+    uint64_t count;
+
+    // only the sectors in the overlay, one run at a time
+    for (uint64_t sector = 0; ret == 0 && oimage_next_run(img.o, &sector, &count) == 0; ) {
+        while (count > 0) {
+            uint64_t n = min(count, (uint64_t)BUFFER_SECTORS);
+            size_t len = min(n * SECTOR_SIZE, img.size - sector * SECTOR_SIZE);
+            if (image_read(&img, buffer, len, sector * SECTOR_SIZE) != 0
+                || image_write(&base, buffer, len, sector * SECTOR_SIZE) != 0) {
+                fprintf(stderr, "Can't copy sectors %llu-%llu\n", (unsigned long long)sector,
+                    (unsigned long long)(sector + n - 1));
+                ret = -1;
+                break;
+            }
+
+            written += n;
+            sector += n;
+            count -= n;
+        }
+    }
+
+    if (image_flush(&base) != 0) {
+        fprintf(stderr, "%s: write failed\n", oimage_base(img.o));
+        ret = -1;
+    }
+    image_close(&base);
+
+    // a partial commit keeps the overlay marked, so it can be run again
+    if (ret == 0 && oimage_discard(img.o) != 0) {
+        fprintf(stderr, "%s: can't reset overlay\n", path);
+        ret = -1;
+    }
+
+    if (ret != 0)
+        fprintf(stderr, "%s is partially written, commit %s again to finish\n", oimage_base(img.o), path);
+
+    if (ret == 0)
+        printf("%llu sectors written to %s\n", (unsigned long long)written, oimage_base(img.o));
+
+    image_close(&img);
+    return ret;
+}
+
+static int discard(const char* path)
+{
+    struct image img;
+
+    if (open_overlay(&img, path, 1) != 0)
+        return -1;
+
+    if (oimage_committing(img.o))
+        fprintf(stderr, "Warning: %s was partially committed, it keeps the sectors written so far\n",
+            oimage_base(img.o));
+
+    int ret = oimage_discard(img.o);
+    if (ret != 0)
+        fprintf(stderr, "%s: can't reset overlay\n", path);
+
+    image_close(&img);
+    return ret;
+}
+
+int main(int argc, char* argv[])
+{
+    int ret = -1;
+
+    if (argc == 4 && strcmp(argv[1], "c") == 0)
+        ret = create(argv[2], argv[3]);
+    else if (argc == 3 && strcmp(argv[1], "i") == 0)
+        ret = info(argv[2]);
+    else if (argc == 3 && strcmp(argv[1], "diff") == 0)
+        ret = diff(argv[2]);
+    else if (argc == 3 && strcmp(argv[1], "commit") == 0)
+        ret = commit(argv[2]);
+    else if (argc == 3 && strcmp(argv[1], "discard") == 0)
+        ret = discard(argv[2]);
+    else
+        print_help(argv[0]);
+
+    return ret == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
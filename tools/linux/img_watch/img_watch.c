@@ -0,0 +1,463 @@
+#include <errno.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "fat16.h"
+#include "partition.h"
+
+#define SETTLE_MS    20     // a burst of writes is handled once it has been quiet this long
+#define SETTLE_MAX   500    // ... but not later than this
+#define LAYOUT_MAX   (PARTITIONS_MAX * 3 + 1)
+#define RANGES_MAX   8
+
+#define min(a,b) \
+   ({ __typeof__ (a) _a = (a); \
+       __typeof__ (b) _b = (b); \
+     _a < _b ? _a : _b; })
+
+// FAT16 volume with FAT #1 mirrored as an allocation bitmap and a hash per FAT sector
+struct volume {
+    struct partition part;
+    struct fat16_volume vol;
+    int ok;
+
+    uint64_t* bitmap;   /* bit set: cluster allocated (or bad) */
+    uint32_t used;
+    uint32_t fat_sectors;   /* 512 byte sectors covering the used part of FAT #1 */
+    uint64_t* hashes;
+};
+
+struct layout_sector {
+    uint64_t sector;
+    uint64_t hash;
+};
+
+static struct image img;
+static const char* path;
+static ino_t inode;
+static uint64_t image_size;
+
+static struct partition parts[PARTITIONS_MAX];
+static int num_parts;
+static struct volume volumes[PARTITIONS_MAX];
+static int num_volumes;
+
+// every sector the partition walk and the BPB decoding depend on
+static struct layout_sector layout[LAYOUT_MAX];
+static int num_layout;
+
+static uint8_t* fat_buf;
+static size_t fat_buf_size;
+
+static void print_help(const char* name)
+{
+    fprintf(stderr, "Usage: %s <disk image>\n", name);
+    fprintf(stderr, "\n");
+    fprintf(stderr, "Prints the partition layout and FAT16 usage of a disk\n");
+    fprintf(stderr, "image, then watches it for changes (e.g. by a running\n");
+    fprintf(stderr, "emulator) and reports what changed. Only the partition\n");
+    fprintf(stderr, "tables, boot sectors and FATs are re-read.\n");
+}
+
+static uint64_t hash_sector(const uint8_t* sect)
+{
+    // FNV-1a over 64-bit words
+    uint64_t h = 0xcbf29ce484222325ULL;
+
+    for (int i = 0; i < SECTOR_SIZE; i += 8) {
+        uint64_t w;
+        memcpy(&w, sect + i, sizeof(w));
+        h = (h ^ w) * 0x100000001b3ULL;
+    }
+
+    return h;
+}
+
+static double now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+static void print_time(void)
+{
+    char buf[16];
+    time_t t = time(NULL);
+
+    strftime(buf, sizeof(buf), "%H:%M:%S", localtime(&t));
+    printf("[%s] ", buf);
+}
+
+static void add_layout_sector(uint64_t sector)
+{
+    for (int i = 0; i < num_layout; ++i)
+        if (layout[i].sector == sector)
+            return;
+
+    if (num_layout < LAYOUT_MAX)
+        layout[num_layout++].sector = sector;
+}
+
+// 0: unchanged, 1: changed, -1: read error
+static int hash_layout(int update)
+{
+    int changed = 0;
+
+    for (int i = 0; i < num_layout; ++i) {
+        uint8_t sect[SECTOR_SIZE] = {};
+        // sectors past the end hash as zeroes, the image may grow later
+        if (layout[i].sector * SECTOR_SIZE + SECTOR_SIZE <= img.size
+            && image_read(&img, sect, sizeof(sect), layout[i].sector * SECTOR_SIZE) != 0)
+            return -1;
+
+        uint64_t h = hash_sector(sect);
+        if (h != layout[i].hash) {
+            changed = 1;
+            if (update)
+                layout[i].hash = h;
+        }
+    }
+
+    return changed;
+}
+
+static void close_volumes(void)
+{
+    for (int i = 0; i < num_volumes; ++i) {
+        fat16_close(&volumes[i].vol);
+        free(volumes[i].bitmap);
+        free(volumes[i].hashes);
+    }
+
+    memset(volumes, 0, sizeof(volumes));
+    num_volumes = 0;
+}
+
+static int read_fat(struct volume* v)
+{
+    size_t len = (size_t)v->fat_sectors * SECTOR_SIZE;
+
+    if (len > fat_buf_size) {
+        uint8_t* buf = realloc(fat_buf, len);
+        if (!buf)
+            return -1;
+        fat_buf = buf;
+        fat_buf_size = len;
+    }
+
+    return image_read(&img, fat_buf, len, v->vol.fat_offset);
+}
+
+static int is_allocated(uint16_t entry)
+{
+    return entry != FAT16_FREE;
+}
+
+static int open_volume(struct volume* v, const struct partition* part)
+{
+    memset(v, 0, sizeof(*v));
+    v->part = *part;
+
+    if (fat16_open(&v->vol, &img, part->start * SECTOR_SIZE) != 0)
+        return -1;
+
+    uint32_t entries = v->vol.clusters + 2;
+    v->fat_sectors = (entries * 2 + SECTOR_SIZE - 1) / SECTOR_SIZE;
+    v->bitmap = calloc((entries + 63) / 64, sizeof(uint64_t));
+    v->hashes = calloc(v->fat_sectors, sizeof(uint64_t));
+    if (!v->bitmap || !v->hashes || read_fat(v) != 0)
+        return -1;
+
+    for (uint32_t i = 0; i < v->fat_sectors; ++i)
+        v->hashes[i] = hash_sector(fat_buf + i * SECTOR_SIZE);
+
+    for (uint32_t c = FAT16_FIRST_CLUSTER; c < entries; ++c) {
+        if (is_allocated(v->vol.fat[c])) {
+            v->bitmap[c / 64] |= 1ULL << (c % 64);
+            v->used++;
+        }
+    }
+
+    v->ok = 1;
+    return 0;
+}
+
+static void print_volume(const struct volume* v)
+{
+    char name[3+1];
+    partition_name(&v->part, name);
+
+    printf("%-4s %-10llu %-10llu ", name, (unsigned long long)v->part.start, (unsigned long long)v->part.size);
+    if (v->ok)
+        printf("%-8u %-8u %-8u\n", v->vol.clusters, v->used, v->vol.clusters - v->used);
+    else
+        printf("no FAT16 volume\n");
+}
+
+// full (re)load: partition walk, layout sector hashes, all FATs
+static int load(void)
+{
+    close_volumes();
+    num_layout = 0;
+
+    num_parts = partition_walk(&img, parts, PARTITIONS_MAX);
+
+    add_layout_sector(0);
+    for (int i = 0; i < num_parts; ++i) {
+        add_layout_sector(parts[i].pte / SECTOR_SIZE);
+        // an Atari partition turns into an ATonce container once it gets an MBR
+        if (parts[i].id[0])
+            add_layout_sector(parts[i].start + 1);
+        if (partition_is_fat(&parts[i])) {
+            add_layout_sector(parts[i].start);
+            open_volume(&volumes[num_volumes++], &parts[i]);
+        }
+    }
+
+    for (int i = 0; i < num_layout; ++i)
+        layout[i].hash = 0;
+    if (hash_layout(1) < 0)
+        return -1;
+
+    image_size = img.size;
+    return 0;
+}
+
+static void print_layout(void)
+{
+    printf("Type Start      Sectors    Clusters Used     Free\n");
+    printf("----------------------------------------------------------------------\n");
+
+    for (int i = 0; i < num_parts; ++i) {
+        int fat = 0;
+        for (int j = 0; j < num_volumes; ++j) {
+            if (volumes[j].part.start == parts[i].start && volumes[j].part.pte == parts[i].pte) {
+                print_volume(&volumes[j]);
+                fat = 1;
+            }
+        }
+
+        if (!fat) {
+            char name[3+1];
+            partition_name(&parts[i], name);
+            printf("%-4s %-10llu %-10llu %s\n", name, (unsigned long long)parts[i].start, (unsigned long long)parts[i].size,
+                parts[i].container ? "ATonce image" : "-");
+        }
+    }
+
+    if (num_parts == 0)
+        printf("No partitions found\n");
+}
+
+// re-reads FAT #1, only the sectors whose hash changed are decoded again
+static void update_volume(struct volume* v)
+{
+    if (!v->ok || read_fat(v) != 0)
+        return;
+
+    uint32_t entries = v->vol.clusters + 2;
+    uint32_t allocated = 0;
+    uint32_t freed = 0;
+    uint32_t changed_sectors = 0;
+    uint32_t ranges[RANGES_MAX][2];
+    int num_ranges = 0;
+
+    for (uint32_t s = 0; s < v->fat_sectors; ++s) {
+        const uint8_t* sect = fat_buf + s * SECTOR_SIZE;
+        uint64_t h = hash_sector(sect);
+        if (h == v->hashes[s])
+            continue;
+
+        v->hashes[s] = h;
+        changed_sectors++;
+
+        uint32_t first = s * (SECTOR_SIZE / 2);
+        uint32_t last = min(first + SECTOR_SIZE / 2, entries);
+        uint32_t range_first = UINT32_MAX;
+        uint32_t range_last = 0;
+
+        for (uint32_t c = first; c < last; ++c) {
+            uint16_t entry = le16(&sect[(c - first) * 2]);
+            if (entry == v->vol.fat[c])
+                continue;
+
+            if (c >= FAT16_FIRST_CLUSTER && is_allocated(entry) != is_allocated(v->vol.fat[c])) {
+                v->bitmap[c / 64] ^= 1ULL << (c % 64);
+                if (is_allocated(entry))
+                    allocated++;
+                else
+                    freed++;
+            }
+
+            v->vol.fat[c] = entry;
+            range_first = min(range_first, c);
+            range_last = c;
+        }
+
+        if (range_first == UINT32_MAX)
+            continue;
+
+        // neighbouring sectors extend the previous range
+        if (num_ranges > 0 && ranges[num_ranges - 1][1] + 1 + SECTOR_SIZE / 2 > range_first)
+            ranges[num_ranges - 1][1] = range_last;
+        else if (num_ranges < RANGES_MAX) {
+            ranges[num_ranges][0] = range_first;
+            ranges[num_ranges][1] = range_last;
+            num_ranges++;
+        }
+    }
+
+    if (changed_sectors == 0)
+        return;
+
+    v->used += allocated;
+    v->used -= freed;
+
+    char name[3+1];
+    partition_name(&v->part, name);
+    print_time();
+    printf("%s at %llu: %u FAT sectors changed, +%u/-%u clusters, %u used, %u free\n", name,
+        (unsigned long long)v->part.start, changed_sectors, allocated, freed, v->used, v->vol.clusters - v->used);
+
+    for (int i = 0; i < num_ranges; ++i)
+        printf("           entries %u-%u\n", ranges[i][0], ranges[i][1]);
+}
+
+static int reopen(void)
+{
+    image_close(&img);
+    if (image_open(&img, path, 0) != 0)
+        return -1;
+
+    struct stat st;
+    fstat(img.fd, &st);
+    inode = st.st_ino;
+
+    return 0;
+}
+
+static void refresh(void)
+{
+    double start = now_ms();
+    struct stat st;
+
+    // replaced (renamed over) or cached in-process: open it again
+    if (stat(path, &st) != 0)
+        return;
+    if (st.st_ino != inode || img.z || img.d || img.o) {
+        if (reopen() != 0)
+            return;
+    } else {
+        img.size = st.st_size;
+    }
+
+    int layout_changed = hash_layout(0);
+    if (layout_changed < 0)
+        return;
+
+    if (layout_changed || img.size != image_size) {
+        if (load() != 0)
+            return;
+        print_time();
+        printf("Partition layout changed (%.1f ms):\n", now_ms() - start);
+        print_layout();
+        return;
+    }
+
+    for (int i = 0; i < num_volumes; ++i)
+        update_volume(&volumes[i]);
+}
+
+static int add_watch(int fd)
+{
+    return inotify_add_watch(fd, path, IN_MODIFY | IN_CLOSE_WRITE | IN_ATTRIB | IN_MOVE_SELF | IN_DELETE_SELF);
+}
+
+// waits until a burst of events has settled; returns 1 if the file was replaced
+static int drain_events(int fd, int wd)
+{
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    double deadline = 0;
+    int replaced = 0;
+    struct pollfd pfd = { fd, POLLIN, 0 };
+
+    do {
+        // the first read blocks until something happens
+        ssize_t n = read(fd, buf, sizeof(buf));
+        for (char* p = buf; n > 0 && p < buf + n; ) {
+            const struct inotify_event* ev = (const struct inotify_event*)p;
+            if (ev->wd == wd && (ev->mask & (IN_MOVE_SELF | IN_DELETE_SELF | IN_IGNORED)))
+                replaced = 1;
+            p += sizeof(*ev) + ev->len;
+        }
+        if (deadline == 0)
+            deadline = now_ms() + SETTLE_MAX;
+    } while (now_ms() < deadline && poll(&pfd, 1, SETTLE_MS) > 0);
+
+    return replaced;
+}
+
+int main(int argc, char* argv[])
+{
+    if (argc != 2) {
+        print_help(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    // reports are usually piped into a log
+    setvbuf(stdout, NULL, _IOLBF, 0);
+
+    path = argv[1];
+    if (image_open(&img, path, 0) != 0)
+        return EXIT_FAILURE;
+
+    struct stat st;
+    fstat(img.fd, &st);
+    inode = st.st_ino;
+
+    double start = now_ms();
+    if (load() != 0) {
+        fprintf(stderr, "%s: can't read image\n", path);
+        image_close(&img);
+        return EXIT_FAILURE;
+    }
+    print_layout();
+    printf("\n(loaded in %.1f ms, watching for changes)\n", now_ms() - start);
+
+    int fd = inotify_init1(IN_CLOEXEC);
+    int wd = fd >= 0 ? add_watch(fd) : -1;
+    if (wd < 0) {
+        fprintf(stderr, "%s: can't watch: %s\n", path, strerror(errno));
+        image_close(&img);
+        return EXIT_FAILURE;
+    }
+
+    for (;;) {
+        if (drain_events(fd, wd)) {
+            // the old inode is gone, watch whatever is at the path now
+            inotify_rm_watch(fd, wd);
+            for (int i = 0; i < 100 && (wd = add_watch(fd)) < 0; ++i)
+                usleep(10000);
+            if (wd < 0) {
+                fprintf(stderr, "%s: image gone\n", path);
+                break;
+            }
+        }
+
+        refresh();
+    }
+
+    close(fd);
+    close_volumes();
+    image_close(&img);
+    return EXIT_FAILURE;
+}
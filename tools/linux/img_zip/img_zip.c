@@ -0,0 +1,225 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "image.h"
+#include "zimage.h"
+
+#define BUFFER_SIZE (1024 * 1024)
+
+static uint8_t buffer[BUFFER_SIZE];
+
+static void print_help(const char* name)
+{
+    fprintf(stderr, "Usage: %s c <disk image> <compressed image>\n", name);
+    fprintf(stderr, "       %s x <compressed image> <disk image>\n", name);
+    fprintf(stderr, "       %s i <compressed image>\n", name);
+    fprintf(stderr, "       %s put <disk image> <sector> <file>\n", name);
+    fprintf(stderr, "       %s get <disk image> <sector> <count> <file>\n", name);
+    fprintf(stderr, "\n");
+    fprintf(stderr, "c/x compress/decompress (c on a compressed image repacks it),\n");
+    fprintf(stderr, "i shows chunk statistics, put/get write/read a range of\n");
+    fprintf(stderr, "512 byte sectors of a raw or compressed disk image.\n");
+}
+
+static int is_zero(const uint8_t* data, size_t len)
+{
+    for (size_t i = 0; i < len; ++i)
+        if (data[i])
+            return 0;
+
+    return 1;
+}
+
+static int compress_image(const char* in_path, const char* out_path)
+{
+    struct image in, out;
+
+    if (image_open(&in, in_path, 0) != 0)
+        return -1;
+
+    // next to the output and renamed at the end, the output may well be the input
+    char tmp_path[PATH_MAX + 8];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", out_path);
+
+    if (image_create_compressed(&out, tmp_path, in.size) != 0) {
+        image_close(&in);
+        return -1;
+    }
+
+    int ret = 0;
+    for (uint64_t offset = 0; offset < in.size && ret == 0; offset += BUFFER_SIZE) {
+        size_t len = in.size - offset < BUFFER_SIZE ? in.size - offset : BUFFER_SIZE;
+        ret = image_read(&in, buffer, len, offset);
+        // zero chunks are implicit, don't even pass them through the cache
+        if (ret == 0 && !is_zero(buffer, len))
+            ret = image_write(&out, buffer, len, offset);
+    }
+
+    if (ret == 0)
+        ret = image_flush(&out);
+    if (ret == 0)
+        ret = fsync(out.fd);
+    image_close(&out);
+    image_close(&in);
+
+    if (ret == 0)
+        ret = rename(tmp_path, out_path);
+    if (ret != 0) {
+        fprintf(stderr, "%s: compression failed\n", out_path);
+        unlink(tmp_path);
+    }
+
+    return ret;
+}
+
+static int decompress_image(const char* in_path, const char* out_path)
+{
+    struct image in;
+
+    if (image_open(&in, in_path, 0) != 0)
+        return -1;
+
+    char tmp_path[PATH_MAX + 8];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", out_path);
+
+    int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        fprintf(stderr, "%s: %s\n", tmp_path, strerror(errno));
+        image_close(&in);
+        return -1;
+    }
+
+    // sparse output: zero ranges are just skipped
+    int ret = ftruncate(fd, in.size);
+    for (uint64_t offset = 0; offset < in.size && ret == 0; offset += BUFFER_SIZE) {
+        size_t len = in.size - offset < BUFFER_SIZE ? in.size - offset : BUFFER_SIZE;
+        ret = image_read(&in, buffer, len, offset);
+        if (ret == 0 && !is_zero(buffer, len) && pwrite(fd, buffer, len, offset) != (ssize_t)len)
+            ret = -1;
+    }
+
+    if (ret == 0)
+        ret = fsync(fd);
+    close(fd);
+    image_close(&in);
+
+    if (ret == 0)
+        ret = rename(tmp_path, out_path);
+    if (ret != 0) {
+        fprintf(stderr, "%s: decompression failed\n", out_path);
+        unlink(tmp_path);
+    }
+
+    return ret;
+}
+
+static int info(const char* path)
+{
+    struct image img;
+
+    if (image_open(&img, path, 0) != 0)
+        return -1;
+
+    if (!img.z) {
+        printf("%s: %s image, %llu bytes\n", path, img.d ? "stored" : img.o ? "overlay" : "raw", (unsigned long long)img.size);
+        image_close(&img);
+        return 0;
+    }
+
+    uint64_t chunks, zero_chunks, stored;
+    zimage_stats(img.z, &chunks, &zero_chunks, &stored);
+
+    struct stat st;
+    fstat(img.fd, &st);
+
+    printf("Image size: %llu bytes\n", (unsigned long long)img.size);
+    printf("Chunks: %llu (%llu all-zero)\n", (unsigned long long)chunks, (unsigned long long)zero_chunks);
+    printf("Chunk data: %llu bytes (%.1f%%)\n", (unsigned long long)stored, img.size ? 100.0 * stored / img.size : 0.0);
+    printf("File size: %llu bytes\n", (unsigned long long)st.st_size);
+
+    image_close(&img);
+    return 0;
+}
+
+static int put(const char* path, uint64_t sector, const char* file)
+{
+    struct image img;
+
+    if (image_open(&img, path, 1) != 0)
+        return -1;
+
+    int fd = open(file, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "%s: %s\n", file, strerror(errno));
+        image_close(&img);
+        return -1;
+    }
+
+    int ret = 0;
+    uint64_t offset = sector * SECTOR_SIZE;
+    ssize_t n;
+    while ((n = read(fd, buffer, sizeof(buffer))) > 0 && ret == 0) {
+        ret = image_write(&img, buffer, n, offset);
+        offset += n;
+    }
+
+    // a compressed image only gets its chunks and index written here
+    if (n < 0 || ret != 0 || image_flush(&img) != 0) {
+        fprintf(stderr, "%s: write failed\n", path);
+        ret = -1;
+    }
+
+    close(fd);
+    image_close(&img);
+    return ret;
+}
+
+static int get(const char* path, uint64_t sector, uint64_t count, const char* file)
+{
+    struct image img;
+
+    if (image_open(&img, path, 0) != 0)
+        return -1;
+
+    int fd = open(file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        fprintf(stderr, "%s: %s\n", file, strerror(errno));
+        image_close(&img);
+        return -1;
+    }
+
+    int ret = image_copy_to_fd(&img, sector * SECTOR_SIZE, count * SECTOR_SIZE, fd);
+    if (ret != 0)
+        fprintf(stderr, "%s: read failed\n", path);
+
+    close(fd);
+    image_close(&img);
+    return ret;
+}
+
+int main(int argc, char* argv[])
+{
+    int ret = -1;
+
+    if (argc == 4 && strcmp(argv[1], "c") == 0)
+        ret = compress_image(argv[2], argv[3]);
+    else if (argc == 4 && strcmp(argv[1], "x") == 0)
+        ret = decompress_image(argv[2], argv[3]);
+    else if (argc == 3 && strcmp(argv[1], "i") == 0)
+        ret = info(argv[2]);
+    else if (argc == 5 && strcmp(argv[1], "put") == 0)
+        ret = put(argv[2], strtoull(argv[3], NULL, 0), argv[4]);
+    else if (argc == 6 && strcmp(argv[1], "get") == 0)
+        ret = get(argv[2], strtoull(argv[3], NULL, 0), strtoull(argv[4], NULL, 0), argv[5]);
+    else
+        print_help(argv[0]);
+
+    return ret == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
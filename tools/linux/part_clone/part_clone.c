@@ -0,0 +1,262 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "chs.h"
+#include "fat16.h"
+#include "partition.h"
+
+#define min(a,b) \
+   ({ __typeof__ (a) _a = (a); \
+       __typeof__ (b) _b = (b); \
+     _a < _b ? _a : _b; })
+
+static void print_help(const char* name)
+{
+    fprintf(stderr, "Usage: %s <disk image>\n", name);
+    fprintf(stderr, "       %s <source image> <n> <destination image> <n>\n", name);
+    fprintf(stderr, "\n");
+    fprintf(stderr, "Lists the partitions of an image, or clones partition #n\n");
+    fprintf(stderr, "(a FAT16 volume or a whole ATonce image) into partition #n\n");
+    fprintf(stderr, "of the destination, which may be the same image. The data\n");
+    fprintf(stderr, "is shared or copied in the kernel where possible and holes\n");
+    fprintf(stderr, "are kept. The destination partition entry is resized to the\n");
+    fprintf(stderr, "source size if there is room and the hidden sectors of the\n");
+    fprintf(stderr, "cloned boot sectors are adjusted to their new position.\n");
+}
+
+static void list(const struct partition* parts, int count)
+{
+    printf("#   Type Start      Sectors    Contents\n");
+    printf("----------------------------------------------------------------------\n");
+    for (int i = 0; i < count; ++i) {
+        char name[3+1];
+        partition_name(&parts[i], name);
+        printf("%-3d %-4s %-10llu %-10llu %s%s\n", i, name, (unsigned long long)parts[i].start,
+            (unsigned long long)parts[i].size, parts[i].image ? "  " : "",
+            parts[i].container ? "ATonce image" : partition_is_fat(&parts[i]) ? "FAT" : "-");
+    }
+}
+
+// the ATonce image a partition lives in, -1 for partitions of the disk itself
+static int container_of(const struct partition* parts, int index)
+{
+    if (!parts[index].image)
+        return -1;
+
+    while (index > 0 && !parts[index].container)
+        index--;
+    return index;
+}
+
+// sector the partition's MBR addresses (and the BPB's hidden sectors) count from
+static uint64_t base_of(const struct partition* parts, int index)
+{
+    int c = container_of(parts, index);
+    return c < 0 ? 0 : parts[c].start + 1;
+}
+
+// entry in an EBR or XGM sector rather than in the MBR/root sector itself
+static int is_logical(const struct partition* parts, int index)
+{
+    return parts[index].pte / SECTOR_SIZE != base_of(parts, index);
+}
+
+// sectors available from the start of the partition up to whatever follows it
+static uint64_t room(struct image* img, const struct partition* parts, int count, int index)
+{
+    const struct partition* part = &parts[index];
+    int c = container_of(parts, index);
+
+    // growing a logical partition would need the enclosing entries changed as well
+    if (is_logical(parts, index))
+        return part->size;
+
+    uint64_t end = c < 0 ? img->size / SECTOR_SIZE : parts[c].start + parts[c].size;
+
+    for (int i = 0; i < count; ++i) {
+        if (i == index || container_of(parts, i) != c)
+            continue;
+        if (parts[i].start > part->start)
+            end = min(end, parts[i].start);
+        if (parts[i].pte / SECTOR_SIZE > part->start)
+            end = min(end, parts[i].pte / SECTOR_SIZE);
+    }
+
+    // AHDI bad sector list
+    uint8_t sect[SECTOR_SIZE];
+    if (c < 0 && part->id[0] && image_read(img, sect, sizeof(sect), 0) == 0) {
+        uint64_t bsl = be32(&sect[0x1f6]);
+        if (be32(&sect[0x1fa]) != 0 && bsl > part->start)
+            end = min(end, bsl);
+    }
+
+    return end > part->start ? end - part->start : 0;
+}
+
+static int set_size(struct image* img, const struct partition* parts, int index, const struct partition* src)
+{
+    const struct partition* part = &parts[index];
+    uint8_t sect[SECTOR_SIZE];
+    uint64_t sector = part->pte / SECTOR_SIZE;
+    uint8_t* pe = &sect[part->pte % SECTOR_SIZE];
+
+    if (image_read(img, sect, sizeof(sect), sector * SECTOR_SIZE) != 0)
+        return -1;
+
+    if (part->id[0]) {
+        // struct partinfo: flag, id[3], st, siz, big-endian
+        if (src->id[0])
+            memcpy(&pe[1], src->id, 3);
+        pe[8] = src->size >> 24;
+        pe[9] = src->size >> 16;
+        pe[10] = src->size >> 8;
+        pe[11] = src->size;
+    } else {
+        uint8_t boot[SECTOR_SIZE];
+        if (image_read(img, boot, sizeof(boot), part->start * SECTOR_SIZE) != 0)
+            return -1;
+
+        if (!src->id[0])
+            pe[4] = src->type;
+        set_le32(&pe[12], src->size);
+        // geometry of the cloned volume, relative to the MBR it is addressed from
+        chs_encode(part->start - base_of(parts, index) + src->size - 1, le16(&boot[0x018]), le16(&boot[0x01a]), &pe[5]);
+    }
+
+    return image_write(img, sect, sizeof(sect), sector * SECTOR_SIZE);
+}
+
+static int fix_hidden(struct image* img, uint64_t sector, uint64_t hidden)
+{
+    uint8_t sect[SECTOR_SIZE];
+    struct fat16_volume vol = { .offset = sector * SECTOR_SIZE };
+
+    if (image_read(img, sect, sizeof(sect), sector * SECTOR_SIZE) != 0
+        || fat16_decode_bpb(&vol, sect) == FAT16_BAD_BPB || vol.hid == hidden)
+        return 0;
+
+    printf("Boot sector at %llu: hidden sectors %u -> %llu\n", (unsigned long long)sector,
+        vol.hid, (unsigned long long)hidden);
+    set_le32(&sect[0x01c], hidden);
+    return image_write(img, sect, sizeof(sect), sector * SECTOR_SIZE);
+}
+
+static int clone(struct image* src_img, const struct partition* src, struct image* dst_img, int index)
+{
+    struct partition parts[PARTITIONS_MAX];
+    int count = partition_walk(dst_img, parts, PARTITIONS_MAX);
+    if (index < 0 || index >= count) {
+        fprintf(stderr, "There is no destination partition #%d\n", index);
+        return -1;
+    }
+
+    const struct partition* dst = &parts[index];
+    int src_kind = src->container ? 2 : partition_is_fat(src);
+    int dst_kind = dst->container ? 2 : partition_is_fat(dst);
+    if (src_kind == 0 || src_kind != dst_kind) {
+        fprintf(stderr, "Source and destination must both be FAT16 volumes or ATonce images\n");
+        return -1;
+    }
+
+    uint64_t available = room(dst_img, parts, count, index);
+    if (src->size > available) {
+        fprintf(stderr, "Source partition has %llu sectors, there is room for %llu\n",
+            (unsigned long long)src->size, (unsigned long long)available);
+        return -1;
+    }
+
+    if (src_img == dst_img && src->start < dst->start + src->size && dst->start < src->start + src->size) {
+        fprintf(stderr, "Source and destination overlap\n");
+        return -1;
+    }
+
+    if (image_clone(dst_img, dst->start * SECTOR_SIZE, src_img, src->start * SECTOR_SIZE, src->size * SECTOR_SIZE) != 0) {
+        fprintf(stderr, "Can't copy partition data\n");
+        return -1;
+    }
+
+    printf("Cloned %llu sectors to sector %llu\n", (unsigned long long)src->size, (unsigned long long)dst->start);
+
+    if (src->size != dst->size) {
+        if (set_size(dst_img, parts, index, src) != 0) {
+            fprintf(stderr, "Can't update partition entry\n");
+            return -1;
+        }
+        printf("Partition #%d resized from %llu to %llu sectors\n", index,
+            (unsigned long long)dst->size, (unsigned long long)src->size);
+    }
+
+    if (!dst->container)
+        return fix_hidden(dst_img, dst->start, dst->start - base_of(parts, index));
+
+    // the volumes inside the cloned ATonce image
+    uint64_t start = dst->start;
+    count = partition_walk(dst_img, parts, PARTITIONS_MAX);
+    for (int i = 0; i < count; ++i) {
+        if (parts[i].image && parts[i].start > start && parts[i].start < start + src->size
+            && fix_hidden(dst_img, parts[i].start, parts[i].start - (start + 1)) != 0)
+            return -1;
+    }
+
+    return 0;
+}
+
+int main(int argc, char* argv[])
+{
+    if (argc != 2 && argc != 5) {
+        print_help(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    struct image src_img;
+    if (image_open(&src_img, argv[1], 0) != 0)
+        return EXIT_FAILURE;
+
+    struct partition parts[PARTITIONS_MAX];
+    int count = partition_walk(&src_img, parts, PARTITIONS_MAX);
+
+    if (argc == 2) {
+        list(parts, count);
+        image_close(&src_img);
+        return EXIT_SUCCESS;
+    }
+
+    int src_index = atoi(argv[2]);
+    int dst_index = atoi(argv[4]);
+    if (src_index < 0 || src_index >= count) {
+        fprintf(stderr, "There is no source partition #%s\n", argv[2]);
+        image_close(&src_img);
+        return EXIT_FAILURE;
+    }
+
+    // within one image, source and destination share the (writable) handle
+    struct stat src_st, dst_st;
+    struct image dst_img;
+    struct image* dst = &dst_img;
+    if (stat(argv[3], &dst_st) == 0 && fstat(src_img.fd, &src_st) == 0
+        && src_st.st_dev == dst_st.st_dev && src_st.st_ino == dst_st.st_ino) {
+        image_close(&src_img);
+        if (image_open(&src_img, argv[1], 1) != 0)
+            return EXIT_FAILURE;
+        dst = &src_img;
+    } else if (image_open(&dst_img, argv[3], 1) != 0) {
+        image_close(&src_img);
+        return EXIT_FAILURE;
+    }
+
+    int ret = clone(&src_img, &parts[src_index], dst, dst_index);
+    if (image_flush(dst) != 0) {
+        fprintf(stderr, "Can't write %s\n", argv[3]);
+        ret = -1;
+    }
+
+    if (dst != &src_img)
+        image_close(&dst_img);
+    image_close(&src_img);
+
+    return ret == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
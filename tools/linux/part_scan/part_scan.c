@@ -0,0 +1,475 @@
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "chs.h"
+#include "fat16.h"
+#include "partition.h"
+
+#define THREADS_MAX     64
+#define MIN_SLICE       (64 * 1024 * 1024ULL)
+#define VECTOR_SECTORS  8
+#define WINDOW_SECTORS  (4 * 1024 * 1024 / SECTOR_SIZE)
+#define EXTENDED_MAX    64
+
+enum kind {
+    KIND_BPB,
+    KIND_MBR,
+    KIND_AHDI
+};
+
+struct candidate {
+    uint64_t sector;
+    enum kind kind;
+    uint32_t sec;       /* BPB: total number of logical sectors */
+    uint16_t bps;       /* BPB: bytes per sector */
+    uint32_t hid;       /* BPB: number of hidden sectors */
+    uint16_t spt;       /* BPB: sectors per track */
+    uint16_t sides;     /* BPB: number of sides */
+};
+
+struct slice {
+    pthread_t thread;
+    int started;
+    struct image* img;
+    const uint8_t* map; /* whole image, NULL if it can't be mapped (compressed/stored) */
+    uint64_t first;     /* sector range [first, last) */
+    uint64_t last;
+    uint64_t sectors;   /* of the whole image */
+
+    struct candidate* found;
+    size_t count;
+    size_t capacity;
+};
+
+typedef uint16_t v8u16 __attribute__((vector_size(16)));
+
+static void print_help(const char* name)
+{
+    fprintf(stderr, "Usage: %s [-w] <disk image>\n", name);
+    fprintf(stderr, "\n");
+    fprintf(stderr, "Scans the whole image for boot sectors, MBRs/EBRs and\n");
+    fprintf(stderr, "AHDI root sectors and proposes MBRs for the FAT16\n");
+    fprintf(stderr, "volumes found.\n");
+    fprintf(stderr, "  -w: write the proposed MBRs where no valid MBR is\n");
+    fprintf(stderr, "      present (boot code is kept)\n");
+}
+
+static int add(struct slice* s, const struct candidate* c)
+{
+    if (s->count == s->capacity) {
+        size_t capacity = s->capacity ? s->capacity * 2 : 256;
+        struct candidate* found = realloc(s->found, capacity * sizeof(*found));
+        if (!found)
+            return -1;
+        s->found = found;
+        s->capacity = capacity;
+    }
+
+    s->found[s->count++] = *c;
+    return 0;
+}
+
+static int is_ahdi(const uint8_t* sect, uint64_t sectors)
+{
+    int used = 0;
+
+    for (int i = 0; i < 4; ++i) {
+        // struct rootsector: part[4] at 0x1c6, 12 bytes each, big-endian
+        const uint8_t* pi = &sect[0x1c6 + i * 12];
+        if (!(pi[0] & 0x01))
+            continue;
+        if (memcmp(&pi[1], "GEM", 3) != 0 && memcmp(&pi[1], "BGM", 3) != 0 && memcmp(&pi[1], "XGM", 3) != 0)
+            return 0;
+        if (be32(&pi[8]) == 0 || (uint64_t)be32(&pi[4]) + be32(&pi[8]) > sectors)
+            return 0;
+        used++;
+    }
+
+    return used > 0;
+}
+
+static void classify(struct slice* s, const uint8_t* sect, uint64_t sector)
+{
+    struct candidate c = {};
+    c.sector = sector;
+
+    if (sect[0x1fe] == 0x55 && sect[0x1ff] == 0xaa) {
+        struct fat16_volume vol = {};
+        if ((sect[0] == 0xeb || sect[0] == 0xe9) && fat16_decode_bpb(&vol, sect) == 0) {
+            c.kind = KIND_BPB;
+            c.sec = vol.sec;
+            c.bps = vol.bps;
+            c.hid = vol.hid;
+            c.spt = le16(&sect[0x018]);
+            c.sides = le16(&sect[0x01a]);
+            add(s, &c);
+        } else if (partition_valid_mbr(sect, s->sectors - sector)) {
+            c.kind = KIND_MBR;
+            add(s, &c);
+        }
+    } else if (is_ahdi(sect, s->sectors)) {
+        c.kind = KIND_AHDI;
+        add(s, &c);
+    }
+}
+
+// data holds sectors [first, first + count)
+static void scan_window(struct slice* s, const uint8_t* data, uint64_t first, uint64_t count)
+{
+    uint64_t i = 0;
+
+    // Everything we look at (0x1c6..0x1ff) sits in the last cache line of a sector, so
+    // the loop only pulls one line per sector; the 0x55AA and 'M' (last char of the
+    // "GEM"/"BGM"/"XGM" AHDI ids) tests are done for VECTOR_SECTORS sectors at once.
+    const v8u16 sig = { 0xaa55, 0xaa55, 0xaa55, 0xaa55, 0xaa55, 0xaa55, 0xaa55, 0xaa55 };
+    const v8u16 m = { 'M', 'M', 'M', 'M', 'M', 'M', 'M', 'M' };
+    for (; i + VECTOR_SECTORS <= count; i += VECTOR_SECTORS) {
+        const uint8_t* p = data + i * SECTOR_SIZE;
+        v8u16 sigs, ids;
+        for (int j = 0; j < VECTOR_SECTORS; ++j) {
+            const uint8_t* q = p + j * SECTOR_SIZE;
+            memcpy(&sigs[j], q + 0x1fe, 2);
+            ids[j] = q[0x1c9] == 'M' || q[0x1d5] == 'M' || q[0x1e1] == 'M' || q[0x1ed] == 'M' ? 'M' : 0;
+        }
+
+        v8u16 hit = (sigs == sig) | (ids == m);
+        uint64_t mask[2];
+        memcpy(mask, &hit, sizeof(mask));
+        if (!(mask[0] | mask[1]))
+            continue;
+
+        for (int j = 0; j < VECTOR_SECTORS; ++j)
+            if (hit[j])
+                classify(s, p + j * SECTOR_SIZE, first + i + j);
+    }
+
+    for (; i < count; ++i)
+        classify(s, data + i * SECTOR_SIZE, first + i);
+}
+
+static void* scan(void* arg)
+{
+    struct slice* s = arg;
+
+    if (s->map) {
+        const uint8_t* data = s->map + s->first * SECTOR_SIZE;
+        madvise((void*)((uintptr_t)data & ~4095UL), (s->last - s->first) * SECTOR_SIZE, MADV_SEQUENTIAL);
+        scan_window(s, data, s->first, s->last - s->first);
+        return NULL;
+    }
+
+    uint8_t* window = malloc(WINDOW_SECTORS * SECTOR_SIZE);
+    if (!window)
+        return NULL;
+
+    for (uint64_t sector = s->first; sector < s->last; sector += WINDOW_SECTORS) {
+        uint64_t count = s->last - sector < WINDOW_SECTORS ? s->last - sector : WINDOW_SECTORS;
+        if (image_read(s->img, window, count * SECTOR_SIZE, sector * SECTOR_SIZE) != 0)
+            break;
+        scan_window(s, window, sector, count);
+    }
+
+    free(window);
+    return NULL;
+}
+
+static int compare(const void* a, const void* b)
+{
+    const struct candidate* ca = a;
+    const struct candidate* cb = b;
+
+    return ca->sector < cb->sector ? -1 : ca->sector > cb->sector;
+}
+
+static int is_extended(uint8_t type)
+{
+    return type == 0x05 || type == 0x0f;
+}
+
+// Extended partitions of the MBRs found, returns the number of ranges. The
+// EBRs' own (relative) links are dropped, they don't address sectors from the EBR.
+static size_t extended_ranges(struct image* img, const struct candidate* found, size_t count, uint64_t (*ranges)[2])
+{
+    size_t n = 0;
+
+    for (size_t i = 0; i < count && n < EXTENDED_MAX; ++i) {
+        uint8_t sect[SECTOR_SIZE];
+        if (found[i].kind != KIND_MBR || image_read(img, sect, sizeof(sect), found[i].sector * SECTOR_SIZE) != 0)
+            continue;
+
+        for (int j = 0; j < 4 && n < EXTENDED_MAX; ++j) {
+            const uint8_t* pe = &sect[0x1be + j * 0x10];
+            if (is_extended(pe[4]) && le32(&pe[12]) != 0) {
+                ranges[n][0] = found[i].sector + le32(&pe[8]);
+                ranges[n][1] = ranges[n][0] + le32(&pe[12]);
+                n++;
+            }
+        }
+    }
+
+    // an EBR's link starts inside the extended partition of the MBR
+    uint8_t nested[EXTENDED_MAX] = {};
+    for (size_t i = 0; i < n; ++i)
+        for (size_t j = 0; j < n && !nested[i]; ++j)
+            nested[i] = j != i && ranges[i][0] > ranges[j][0] && ranges[i][0] < ranges[j][1];
+
+    size_t kept = 0;
+    for (size_t i = 0; i < n; ++i) {
+        if (!nested[i]) {
+            ranges[kept][0] = ranges[i][0];
+            ranges[kept][1] = ranges[i][1];
+            kept++;
+        }
+    }
+
+    return kept;
+}
+
+// Logical volumes count their hidden sectors from their EBR, so they would aim a
+// primary MBR at it: volumes inside an extended partition...
+static int in_extended(uint64_t (*ranges)[2], size_t n, uint64_t sector)
+{
+    for (size_t i = 0; i < n; ++i)
+        if (sector >= ranges[i][0] && sector < ranges[i][1])
+            return 1;
+
+    return 0;
+}
+
+// ...and volumes based at an intact EBR, which links to the next logical volume in entry #1
+static int is_ebr(const uint8_t* sect)
+{
+    return sect[0x1fe] == 0x55 && sect[0x1ff] == 0xaa && is_extended(sect[0x1be + 0x10 + 4]);
+}
+
+// nothing but a (possibly damaged) MBR or an empty sector may be overwritten
+static int may_write(const uint8_t* sect)
+{
+    int empty = 1;
+    for (int i = 0; i < SECTOR_SIZE && empty; ++i)
+        empty = sect[i] == 0;
+    if (empty)
+        return 1;
+
+    struct fat16_volume vol = {};
+    return sect[0x1fe] == 0x55 && sect[0x1ff] == 0xaa
+        && !((sect[0] == 0xeb || sect[0] == 0xe9) && fat16_decode_bpb(&vol, sect) != FAT16_BAD_BPB);
+}
+
+// one MBR per image base (the sector the BPBs' hidden sectors count from)
+static void propose(struct image* img, struct candidate* found, size_t count, int write)
+{
+    uint8_t* used = calloc(count, 1);
+    if (!used)
+        return;
+
+    uint64_t ranges[EXTENDED_MAX][2];
+    size_t extended = extended_ranges(img, found, count, ranges);
+
+    for (size_t i = 0; i < count; ++i) {
+        // hid 0: a volume without an MBR (superfloppy), the base would be the boot sector itself
+        if (used[i] || found[i].kind != KIND_BPB || found[i].hid == 0 || found[i].hid > found[i].sector
+            || in_extended(ranges, extended, found[i].sector))
+            continue;
+
+        uint64_t base = found[i].sector - found[i].hid;
+        uint8_t sect[SECTOR_SIZE];
+        if (image_read(img, sect, sizeof(sect), base * SECTOR_SIZE) != 0)
+            continue;
+
+        if (is_ebr(sect)) {
+            // nor any other volume counting from it
+            for (size_t j = i; j < count; ++j)
+                used[j] |= found[j].kind == KIND_BPB && found[j].hid <= found[j].sector
+                    && found[j].sector - found[j].hid == base;
+            continue;
+        }
+        int damaged = !partition_valid_mbr(sect, 0);
+        int writable = may_write(sect);
+        memset(&sect[0x1be], 0, 4 * 0x10);
+
+        printf("\n");
+        printf("Proposed MBR at sector %llu", (unsigned long long)base);
+        if (base > 0)
+            printf(" (ATonce image in Atari partition at %llu?)", (unsigned long long)base - 1);
+        printf(", existing MBR %s:\n", damaged ? "damaged" : "valid");
+
+        int entries = 0;
+        uint64_t end = 0;
+        for (size_t j = i; j < count; ++j) {
+            const struct candidate* c = &found[j];
+            if (c->kind != KIND_BPB || c->hid == 0 || c->hid > c->sector || c->sector - c->hid != base
+                || in_extended(ranges, extended, c->sector))
+                continue;
+
+            used[j] = 1;
+
+            // skip backup boot sectors and anything nested in an accepted volume
+            if (c->sector < end)
+                continue;
+
+            uint64_t size = (uint64_t)c->sec * c->bps / SECTOR_SIZE;
+            end = c->sector + size;
+
+            // 0x04 below 32 MB, counted in 512 byte sectors rather than logical ones
+            uint8_t type = size < 65536 ? 0x04 : 0x06;
+            printf("  #%d type %02x start %llu size %llu\n", entries, type,
+                (unsigned long long)c->hid, (unsigned long long)size);
+
+            if (entries == 4) {
+                printf("  (more than 4 volumes, the rest needs an extended partition)\n");
+                continue;
+            }
+
+            uint8_t* pe = &sect[0x1be + entries * 0x10];
+            pe[0] = entries == 0 ? 0x80 : 0x00;
+            chs_encode(c->hid, c->spt, c->sides, &pe[1]);
+            pe[4] = type;
+            chs_encode(c->hid + size - 1, c->spt, c->sides, &pe[5]);
+            set_le32(&pe[8], c->hid);
+            set_le32(&pe[12], size);
+            entries++;
+        }
+
+        if (write && damaged && !writable) {
+            printf("Sector %llu is neither empty nor an MBR, not written.\n", (unsigned long long)base);
+        } else if (write && damaged) {
+            sect[0x1fe] = 0x55;
+            sect[0x1ff] = 0xaa;
+            if (image_write(img, sect, sizeof(sect), base * SECTOR_SIZE) == 0)
+                printf("MBR (sector %llu) updated.\n", (unsigned long long)base);
+            else
+                fprintf(stderr, "Can't write sector %llu\n", (unsigned long long)base);
+        }
+    }
+
+    free(used);
+}
+
+int main(int argc, char* argv[])
+{
+    int write = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "w")) != -1) {
+        switch (opt) {
+            case 'w':
+                write = 1;
+                break;
+            default:
+                print_help(argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+
+    if (optind != argc - 1) {
+        print_help(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    struct image img;
+    if (image_open(&img, argv[optind], write) != 0)
+        return EXIT_FAILURE;
+
+    uint64_t sectors = img.size / SECTOR_SIZE;
+    if (sectors == 0) {
+        fprintf(stderr, "Image too small\n");
+        image_close(&img);
+        return EXIT_FAILURE;
+    }
+
+    // compressed and stored images are read through the image layer instead
+    const uint8_t* map = NULL;
+    if (!img.z && !img.d && !img.o) {
+        map = mmap(NULL, sectors * SECTOR_SIZE, PROT_READ, MAP_SHARED, img.fd, 0);
+        if (map == MAP_FAILED) {
+            fprintf(stderr, "Can't map image\n");
+            image_close(&img);
+            return EXIT_FAILURE;
+        }
+    }
+
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    uint64_t threads = cpus > 0 ? (uint64_t)cpus : 1;
+    if (threads > THREADS_MAX)
+        threads = THREADS_MAX;
+    if (threads > sectors * SECTOR_SIZE / MIN_SLICE)
+        threads = sectors * SECTOR_SIZE / MIN_SLICE;
+    if (threads == 0)
+        threads = 1;
+
+    struct slice slices[THREADS_MAX] = {};
+    uint64_t per_slice = (sectors + threads - 1) / threads;
+    for (uint64_t i = 0; i < threads; ++i) {
+        slices[i].img = &img;
+        slices[i].map = map;
+        slices[i].sectors = sectors;
+        slices[i].first = i * per_slice;
+        slices[i].last = slices[i].first + per_slice < sectors ? slices[i].first + per_slice : sectors;
+        if (pthread_create(&slices[i].thread, NULL, scan, &slices[i]) == 0)
+            slices[i].started = 1;
+        else
+            scan(&slices[i]);
+    }
+
+    size_t count = 0;
+    for (uint64_t i = 0; i < threads; ++i) {
+        if (slices[i].started)
+            pthread_join(slices[i].thread, NULL);
+        count += slices[i].count;
+    }
+
+    struct candidate* found = malloc((count ? count : 1) * sizeof(*found));
+    if (!found) {
+        if (map)
+            munmap((void*)map, sectors * SECTOR_SIZE);
+        image_close(&img);
+        return EXIT_FAILURE;
+    }
+
+    size_t n = 0;
+    for (uint64_t i = 0; i < threads; ++i) {
+        memcpy(&found[n], slices[i].found, slices[i].count * sizeof(*found));
+        n += slices[i].count;
+        free(slices[i].found);
+    }
+    qsort(found, count, sizeof(*found), compare);
+
+    printf("Sector     Kind    Details\n");
+    printf("----------------------------------------------------------------------\n");
+    for (size_t i = 0; i < count; ++i) {
+        const struct candidate* c = &found[i];
+        printf("%-10llu ", (unsigned long long)c->sector);
+        switch (c->kind) {
+            case KIND_BPB:
+                printf("FAT16   %u sectors of %u bytes, %u hidden\n", c->sec, c->bps, c->hid);
+                break;
+            case KIND_MBR:
+                printf("MBR/EBR\n");
+                break;
+            case KIND_AHDI:
+                printf("AHDI    root sector\n");
+                break;
+        }
+    }
+
+    propose(&img, found, count, write);
+
+    free(found);
+    if (map)
+        munmap((void*)map, sectors * SECTOR_SIZE);
+
+    int ret = EXIT_SUCCESS;
+    if (image_flush(&img) != 0) {
+        fprintf(stderr, "Can't write %s\n", argv[optind]);
+        ret = EXIT_FAILURE;
+    }
+    image_close(&img);
+
+    return ret;
+}